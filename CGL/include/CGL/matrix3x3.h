@@ -17,12 +17,12 @@ class Matrix3x3 {
   public:
 
   // The default constructor. Returns identity.
-  Matrix3x3(void) { 
-    for( int i = 0; i < 3; i++ ) {
-      for( int j = 0; j < 3; j++ ) {
-        (*this)(i,j) = (i==j) ? 1. : 0.;
-      }
-    }
+  // Whole columns are written, scalar writes into a column would stall the
+  // vector loads that follow when Vector3D is SIMD.
+  Matrix3x3(void) {
+    entries[0] = Vector3D( 1., 0., 0. );
+    entries[1] = Vector3D( 0., 1., 0. );
+    entries[2] = Vector3D( 0., 0., 1. );
   }
 
   // Constructor for row major form data.
@@ -42,9 +42,9 @@ class Matrix3x3 {
             double m10, double m11, double m12, 
             double m20, double m21, double m22)
   {
-    (*this)(0,0) = m00; (*this)(0,1) = m01; (*this)(0,2) = m02;
-    (*this)(1,0) = m10; (*this)(1,1) = m11; (*this)(1,2) = m12;
-    (*this)(2,0) = m20; (*this)(2,1) = m21; (*this)(2,2) = m22;
+    entries[0] = Vector3D( m00, m10, m20 );
+    entries[1] = Vector3D( m01, m11, m21 );
+    entries[2] = Vector3D( m02, m12, m22 );
   }
 
   /**
@@ -124,6 +124,46 @@ class Matrix3x3 {
 
 }; // class Matrix3x3
 
+// The accessors, the transpose and the matrix - vector product run per
+// sample in the renderers, so they are inline rather than in matrix3x3.cpp.
+
+inline double& Matrix3x3::operator()( int i, int j ) {
+  return entries[j][i];
+}
+
+inline const double& Matrix3x3::operator()( int i, int j ) const {
+  return entries[j][i];
+}
+
+inline Vector3D& Matrix3x3::operator[]( int j ) {
+  return entries[j];
+}
+
+inline const Vector3D& Matrix3x3::operator[]( int j ) const {
+  return entries[j];
+}
+
+inline Vector3D& Matrix3x3::column( int i ) {
+  return entries[i];
+}
+
+inline const Vector3D& Matrix3x3::column( int i ) const {
+  return entries[i];
+}
+
+inline Vector3D Matrix3x3::operator*( const Vector3D& x ) const {
+  return x.x * entries[0] +
+         x.y * entries[1] +
+         x.z * entries[2];
+}
+
+inline Matrix3x3 Matrix3x3::T( void ) const {
+  const Matrix3x3& A( *this );
+  return Matrix3x3( A(0,0), A(1,0), A(2,0),
+                    A(0,1), A(1,1), A(2,1),
+                    A(0,2), A(1,2), A(2,2) );
+}
+
 // returns the outer product of u and v
 Matrix3x3 outer( const Vector3D& u, const Vector3D& v );
 
@@ -11,7 +11,14 @@
 #include <ostream>
 #include <new>
 
-#ifdef __AVX__
+// When CGL is configured with CGL_SIMD_MATH on a machine with AVX, the
+// components live in one AVX register padded to four lanes. Operations that
+// reduce over the components ignore the padding lane.
+#if defined(CGL_SIMD_MATH) && defined(__AVX__)
+#define CGL_VECTOR3D_AVX
+#endif
+
+#ifdef CGL_VECTOR3D_AVX
 #ifdef _MSC_VER
 #include <intrin.h>
 #else
@@ -28,7 +35,7 @@ class Vector3D {
 public:
 
   // components
-#ifdef __AVX__
+#ifdef CGL_VECTOR3D_AVX
   union {
     struct {
       double x, y, z;
@@ -36,10 +43,7 @@ public:
     struct {
       double r, g, b;
     };
-    struct {
-      alignas(16) __m128d __vec;
-      double _z;
-    };
+    __m256d __vec; ///< x, y, z and the padding lane
   };
 #else
   union {
@@ -56,29 +60,43 @@ public:
    * Constructor.
    * Initializes tp vector (0,0,0).
    */
+#ifdef CGL_VECTOR3D_AVX
+  Vector3D() : __vec(_mm256_setzero_pd()) { }
+#else
   Vector3D() : x(0.0), y(0.0), z(0.0) { }
+#endif
 
   /**
    * Constructor.
    * Initializes to vector (x,y,z).
    */
+#ifdef CGL_VECTOR3D_AVX
+  Vector3D( double x, double y, double z) : __vec(_mm256_set_pd(0, z, y, x)) { }
+#else
   Vector3D( double x, double y, double z) : x( x ), y( y ), z( z ) { }
+#endif
 
   /**
    * Constructor.
    * Initializes to vector (c,c,c)
    */
-  Vector3D( double c ) : x( c ), y( c ), z( c ) { }
+#ifdef CGL_VECTOR3D_AVX
+  Vector3D( double c ) : __vec(_mm256_set_pd(0, c, c, c)) { }
 
-  #ifdef __AVX__
-  Vector3D( __m128d v, double z ) : __vec(v), _z(z) { }
-  #endif
+  Vector3D( __m256d v ) : __vec(v) { }
+#else
+  Vector3D( double c ) : x( c ), y( c ), z( c ) { }
+#endif
 
   /**
    * Constructor.
    * Initializes from existing vector
    */
+#ifdef CGL_VECTOR3D_AVX
+  Vector3D( const Vector3D& v ) : __vec(v.__vec) { }
+#else
   Vector3D( const Vector3D& v ) : x( v.x ), y( v.y ), z( v.z ) { }
+#endif
 
   // returns reference to the specified component (0-based indexing: x, y, z)
   inline double& operator[] ( const int& index ) {
@@ -96,13 +114,17 @@ public:
 
   // negation
   inline Vector3D operator-( void ) const {
+#ifdef CGL_VECTOR3D_AVX
+    return Vector3D(_mm256_xor_pd(__vec, _mm256_set1_pd(-0.0)));
+#else
     return Vector3D( -x, -y, -z );
+#endif
   }
 
   // addition
   inline Vector3D operator+( const Vector3D& v ) const {
-#ifdef __AVX__
-    return Vector3D(_mm_add_pd(__vec, v.__vec), _z + v._z);
+#ifdef CGL_VECTOR3D_AVX
+    return Vector3D(_mm256_add_pd(__vec, v.__vec));
 #else
     return Vector3D(x + v.x, y + v.y, z + v.z);
 #endif
@@ -110,8 +132,8 @@ public:
 
   // subtraction
   inline Vector3D operator-( const Vector3D& v ) const {
-#ifdef __AVX__
-    return Vector3D( _mm_sub_pd(__vec, v.__vec), _z - v._z );
+#ifdef CGL_VECTOR3D_AVX
+    return Vector3D(_mm256_sub_pd(__vec, v.__vec));
 #else
     return Vector3D( x - v.x, y - v.y, z - v.z );
 #endif
@@ -119,8 +141,8 @@ public:
 
   // element wise multiplication
   inline Vector3D operator*(const Vector3D& v) const {
-#ifdef __AVX__
-    return Vector3D(_mm_mul_pd(__vec, v.__vec), _z * v._z);
+#ifdef CGL_VECTOR3D_AVX
+    return Vector3D(_mm256_mul_pd(__vec, v.__vec));
 #else
     return Vector3D(x * v.x, y * v.y, z * v.z);
 #endif
@@ -128,8 +150,8 @@ public:
   
   // element wise division
   inline Vector3D operator/(const Vector3D& v) const {
-#ifdef __AVX__
-    return Vector3D(_mm_div_pd(__vec, v.__vec), _z / v._z);
+#ifdef CGL_VECTOR3D_AVX
+    return Vector3D(_mm256_div_pd(__vec, v.__vec));
 #else
     return Vector3D(x / v.x, y / v.y, z / v.z);
 #endif
@@ -137,20 +159,27 @@ public:
 
   // right scalar multiplication
   inline Vector3D operator*( const double& c ) const {
+#ifdef CGL_VECTOR3D_AVX
+    return Vector3D(_mm256_mul_pd(__vec, _mm256_set1_pd(c)));
+#else
     return Vector3D( x * c, y * c, z * c );
+#endif
   }
 
   // scalar division
   inline Vector3D operator/( const double& c ) const {
     const double rc = 1.0 / c;
+#ifdef CGL_VECTOR3D_AVX
+    return Vector3D(_mm256_mul_pd(_mm256_set1_pd(rc), __vec));
+#else
     return Vector3D( rc * x, rc * y, rc * z );
+#endif
   }
 
   // addition / assignment
   inline void operator+=( const Vector3D& v ) {
-#ifdef __AVX__
-    __vec = _mm_add_pd(__vec, v.__vec);
-    _z += v._z;
+#ifdef CGL_VECTOR3D_AVX
+    __vec = _mm256_add_pd(__vec, v.__vec);
 #else
     x += v.x; y += v.y; z += v.z;
 #endif
@@ -158,9 +187,8 @@ public:
 
   // subtraction / assignment
   inline void operator-=( const Vector3D& v ) {
-#ifdef __AVX__
-    __vec = _mm_sub_pd(__vec, v.__vec);
-    _z -= v._z;
+#ifdef CGL_VECTOR3D_AVX
+    __vec = _mm256_sub_pd(__vec, v.__vec);
 #else
     x -= v.x; y -= v.y; z -= v.z;
 #endif
@@ -168,7 +196,11 @@ public:
 
   // scalar multiplication / assignment
   inline void operator*=( const double& c ) {
+#ifdef CGL_VECTOR3D_AVX
+    __vec = _mm256_mul_pd(__vec, _mm256_set1_pd(c));
+#else
     x *= c; y *= c; z *= c;
+#endif
   }
 
   // scalar division / assignment
@@ -180,8 +212,8 @@ public:
    * Returns per entry reciprocal
    */
   inline Vector3D rcp(void) const {
-#ifdef __AVX__
-    return Vector3D(_mm_div_pd(_mm_set1_pd(1.0), __vec), 1.0 / z);
+#ifdef CGL_VECTOR3D_AVX
+    return Vector3D(_mm256_div_pd(_mm256_set1_pd(1.0), __vec));
 #else
     return Vector3D(1.0 / x, 1.0 / y, 1.0 / z);
 #endif
@@ -191,23 +223,13 @@ public:
    * Returns Euclidean length.
    */
   inline double norm( void ) const {
-#ifdef __AVX__
     return sqrt(norm2());
-#else
-    return sqrt(x * x + y * y + z * z);
-#endif
   }
 
   /**
    * Returns Euclidean length squared.
    */
-  inline double norm2( void ) const {
-#ifdef __AVX__
-    return _mm_cvtsd_f64(_mm_dp_pd(__vec, __vec, 0b00110001)) + z * z;
-#else
-    return x * x + y * y + z * z;
-#endif
-  }
+  inline double norm2( void ) const;
 
   /**
    * Returns unit vector.
@@ -240,13 +262,17 @@ public:
 
 // left scalar multiplication
 inline Vector3D operator* ( const double& c, const Vector3D& v ) {
+#ifdef CGL_VECTOR3D_AVX
+  return Vector3D(_mm256_mul_pd(_mm256_set1_pd(c), v.__vec));
+#else
   return Vector3D( c * v.x, c * v.y, c * v.z );
+#endif
 }
 
 // left scalar divide
 inline Vector3D operator/(const double &c, const Vector3D &v) {
-#ifdef __AVX__
-  return Vector3D(_mm_div_pd(_mm_set1_pd(c), v.__vec), c / v._z);
+#ifdef CGL_VECTOR3D_AVX
+  return Vector3D(_mm256_div_pd(_mm256_set1_pd(c), v.__vec));
 #else
   return Vector3D(c / v.x, c / v.y, c / v.z);
 #endif
@@ -254,18 +280,36 @@ inline Vector3D operator/(const double &c, const Vector3D &v) {
 
 // dot product (a.k.a. inner or scalar product)
 inline double dot( const Vector3D& u, const Vector3D& v ) {
-#ifdef __AVX__
-  return _mm_cvtsd_f64(_mm_dp_pd(u.__vec, v.__vec, 0b00110001)) + u._z * v._z;
+#ifdef CGL_VECTOR3D_AVX
+  // (x + y) + z like the scalar code, the padding lane is dropped
+  __m256d p = _mm256_mul_pd(u.__vec, v.__vec);
+  __m128d xy = _mm256_castpd256_pd128(p);
+  __m128d zw = _mm256_extractf128_pd(p, 1);
+  return _mm_cvtsd_f64(_mm_add_sd(_mm_add_sd(xy, _mm_unpackhi_pd(xy, xy)), zw));
 #else
   return u.x * v.x + u.y * v.y + u.z * v.z;
 #endif
 }
 
+inline double Vector3D::norm2( void ) const {
+  return dot(*this, *this);
+}
+
 // cross product
 inline Vector3D cross( const Vector3D& u, const Vector3D& v ) {
+#if defined(CGL_VECTOR3D_AVX) && defined(__AVX2__)
+  // u.yzx * v.zxy - u.zxy * v.yzx
+  __m256d u_yzx = _mm256_permute4x64_pd(u.__vec, _MM_SHUFFLE(3, 0, 2, 1));
+  __m256d u_zxy = _mm256_permute4x64_pd(u.__vec, _MM_SHUFFLE(3, 1, 0, 2));
+  __m256d v_yzx = _mm256_permute4x64_pd(v.__vec, _MM_SHUFFLE(3, 0, 2, 1));
+  __m256d v_zxy = _mm256_permute4x64_pd(v.__vec, _MM_SHUFFLE(3, 1, 0, 2));
+  return Vector3D(_mm256_sub_pd(_mm256_mul_pd(u_yzx, v_zxy),
+                                _mm256_mul_pd(u_zxy, v_yzx)));
+#else
   return Vector3D( u.y*v.z - u.z*v.y,
                    u.z*v.x - u.x*v.z,
                    u.x*v.y - u.y*v.x );
+#endif
 }
 
 // prints components
@@ -7,6 +7,14 @@
 #include <ostream>
 #include <cmath>
 
+#ifdef __AVX__
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#endif
+
 namespace CGL {
 
 /**
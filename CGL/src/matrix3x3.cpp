@@ -7,22 +7,6 @@ using namespace std;
 
 namespace CGL {
 
-  double& Matrix3x3::operator()( int i, int j ) {
-    return entries[j][i];
-  }
-
-  const double& Matrix3x3::operator()( int i, int j ) const {
-    return entries[j][i];
-  }
-
-  Vector3D& Matrix3x3::operator[]( int j ) {
-      return entries[j];
-  }
-
-  const Vector3D& Matrix3x3::operator[]( int j ) const {
-    return entries[j];
-  }
-
   void Matrix3x3::zero( double val ) {
     // sets all elements to val
     entries[0] = entries[1] = entries[2] = Vector3D( val, val, val );
@@ -107,25 +91,6 @@ namespace CGL {
     return C;
   }
 
-  Vector3D Matrix3x3::operator*( const Vector3D& x ) const {
-    return x.x * entries[0] +
-           x.y * entries[1] +
-           x.z * entries[2];
-  }
-
-  Matrix3x3 Matrix3x3::T( void ) const {
-    const Matrix3x3& A( *this );
-    Matrix3x3 B;
-
-    for( int i = 0; i < 3; i++ )
-    for( int j = 0; j < 3; j++ )
-    {
-       B(i,j) = A(j,i);
-    }
-
-    return B;
-  }
-
   Matrix3x3 Matrix3x3::inv( void ) const {
     const Matrix3x3& A( *this );
     Matrix3x3 B;
@@ -170,17 +135,11 @@ namespace CGL {
 
   Matrix3x3 outer( const Vector3D& u, const Vector3D& v ) {
     Matrix3x3 B;
-    double* Bij = (double*) &B;
-
-    *Bij++ = u.x*v.x;
-    *Bij++ = u.y*v.x;
-    *Bij++ = u.z*v.x;
-    *Bij++ = u.x*v.y;
-    *Bij++ = u.y*v.y;
-    *Bij++ = u.z*v.y;
-    *Bij++ = u.x*v.z;
-    *Bij++ = u.y*v.z;
-    *Bij++ = u.z*v.z;
+
+    // columns are padded when Vector3D is, so fill them one at a time
+    B[0] = u * v.x;
+    B[1] = u * v.y;
+    B[2] = u * v.z;
 
     return B;
   }
@@ -200,12 +159,4 @@ namespace CGL {
 
     return os;
   }
-
-  Vector3D& Matrix3x3::column( int i ) {
-    return entries[i];
-  }
-
-  const Vector3D& Matrix3x3::column( int i ) const {
-    return entries[i];
-  }
 }
@@ -129,7 +129,7 @@ Matrix4x4 Matrix4x4::operator*(const Matrix4x4 &B) const {
   for (int i = 0; i < 4; i++) {
     for (int j = 0; j < 4; j++) {
 #ifdef __AVX__
-      C(i, j) = dot(A[i], Vector4D(B(0, j), B(1, j), B(2, j), B(3, j)));
+      C(i, j) = dot(Vector4D(A(i, 0), A(i, 1), A(i, 2), A(i, 3)), B[j]);
 #else
       C(i, j) = 0.;
 
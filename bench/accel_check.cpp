@@ -0,0 +1,178 @@
+#include "CGL/CGL.h"
+
+#include "pathtracer/intersection.h"
+#include "scene/bvh.h"
+#include "scene/grid.h"
+#include "scene/kdtree.h"
+#include "scene/triangle.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+using namespace std;
+using namespace CGL;
+using namespace CGL::SceneObjects;
+
+typedef chrono::high_resolution_clock Clock;
+
+static double seconds_since(Clock::time_point start) {
+  return chrono::duration<double>(Clock::now() - start).count();
+}
+
+/**
+ * Compare the closest hits and occlusion of an accelerator with testing
+ * every primitive, and time its closest hit queries.
+ * \param tolerance relative difference allowed in the hit distance, 0 to
+ *        require the same distance. The primitive hit is not compared,
+ *        overlapping coplanar triangles tie.
+ * \return the number of rays where they disagree
+ */
+static size_t check(const char *name, const Aggregate &accel,
+                    double build_seconds, double tolerance,
+                    const vector<Primitive *> &primitives,
+                    const vector<Ray> &rays) {
+  size_t mismatches = 0, hits = 0;
+  for (const Ray &ray : rays) {
+    Ray r0 = ray;
+    Intersection i0;
+    bool h0 = false;
+    for (Primitive *p : primitives)
+      h0 = p->intersect(r0, &i0) || h0;
+
+    Ray r1 = ray;
+    Intersection i1;
+    bool h1 = accel.intersect(r1, &i1);
+    Ray r2 = ray;
+    bool blocked = accel.occluded(r2, r2.max_t);
+    hits += h1;
+    bool close = fabs(i0.t - i1.t) <= tolerance * (1 + i0.t);
+    bool same = h0 == h1 && blocked == h0 && r2.max_t == ray.max_t &&
+                (!h0 || close);
+    if (!same && mismatches++ < 5)
+      printf("    ray %zu: hit %d t %.9g occluded %d, brute force hit %d "
+             "t %.9g\n",
+             &ray - rays.data(), h1, h1 ? i1.t : 0.0, blocked, h0,
+             h0 ? i0.t : 0.0);
+  }
+
+  Clock::time_point start = Clock::now();
+  for (const Ray &ray : rays) {
+    Ray r = ray;
+    Intersection i;
+    accel.intersect(r, &i);
+  }
+  double s = seconds_since(start);
+  printf("  %-8s %8.4f s build %8.1f bytes/prim %8.3f Mrays/s %7zu hits "
+         "%5zu mismatches\n",
+         name, build_seconds,
+         (double)accel.memory_bytes() / primitives.size(),
+         rays.size() / s * 1e-6, hits, mismatches);
+  return mismatches;
+}
+
+/**
+ * Build every accelerator over a triangle soup and check them.
+ * \param size extent of the triangles
+ * \param flat keep every triangle in the plane z = 0
+ * \param place maps a uniform random point in the unit cube to a triangle
+ *        center
+ */
+template <typename Place>
+static size_t check_scene(const char *scene, size_t num_triangles,
+                          size_t num_rays, double size, bool flat,
+                          Place place) {
+  mt19937 rng(184);
+  uniform_real_distribution<double> u(0.0, 1.0);
+  vector<Vector3D> positions, normals;
+  vector<uint32_t> indices;
+  for (size_t i = 0; i < num_triangles; i++) {
+    Vector3D c = place(Vector3D(u(rng), u(rng), u(rng)));
+    Vector3D p[3];
+    for (int k = 0; k < 3; k++) {
+      p[k] = c + size * Vector3D(u(rng) - 0.5, u(rng) - 0.5, u(rng) - 0.5);
+      if (flat)
+        p[k].z = 0;
+      indices.push_back(positions.size());
+      positions.push_back(p[k]);
+    }
+    Vector3D n = cross(p[1] - p[0], p[2] - p[0]).unit();
+    normals.insert(normals.end(), 3, n);
+  }
+  TriangleStore store(positions.data(), normals.data(), positions.size(),
+                      indices, NULL);
+  vector<Primitive *> primitives;
+  for (Triangle &t : store.triangles)
+    primitives.push_back(&t);
+
+  Clock::time_point start = Clock::now();
+  BVHAccel bvh(primitives);
+  double bvh_seconds = seconds_since(start);
+  start = Clock::now();
+  KdTreeAccel kdtree(primitives);
+  double kdtree_seconds = seconds_since(start);
+  start = Clock::now();
+  UniformGridAccel grid(primitives);
+  double grid_seconds = seconds_since(start);
+
+  // rays from inside and around the scene, some along the axes where the
+  // kd-tree and the grid divide by zero, some with a shortened segment. The
+  // origins are padded so that no ray lies in the plane of a flat scene.
+  BBox bb = bvh.get_bbox();
+  bb.expand(bb.min - Vector3D(0.1 * bb.extent.norm()));
+  bb.expand(bb.max + Vector3D(0.1 * bb.extent.norm()));
+  vector<Ray> rays;
+  for (size_t i = 0; i < num_rays; i++) {
+    Vector3D o = bb.min + Vector3D(u(rng) * bb.extent.x, u(rng) * bb.extent.y,
+                                   u(rng) * bb.extent.z);
+    Vector3D d(u(rng) - 0.5, u(rng) - 0.5, u(rng) - 0.5);
+    if (i % 5 == 0)
+      d = Vector3D(0, 0, i % 10 ? 1 : -1);
+    if (i % 7 == 0) {
+      o = bb.centroid() - 2 * bb.extent;
+      d = bb.centroid() + bb.extent * (Vector3D(u(rng), u(rng), u(rng)) - 0.5) -
+          o;
+    }
+    if (i % 11 == 0)
+      d = Vector3D(1, 0, 0);
+    Ray r(o, d.unit());
+    if (i % 3 == 0)
+      r.max_t = u(rng) * bb.extent.norm();
+    rays.push_back(r);
+  }
+
+  printf("%s: %zu triangles x %zu rays\n", scene, num_triangles, num_rays);
+  size_t mismatches = 0;
+  // BVH leaves use the single precision triangle kernel, the others test
+  // the primitives themselves
+  mismatches += check("bvh", bvh, bvh_seconds, 1e-4, primitives, rays);
+  mismatches += check("kdtree", kdtree, kdtree_seconds, 0, primitives, rays);
+  mismatches += check("grid", grid, grid_seconds, 0, primitives, rays);
+  return mismatches;
+}
+
+int main(int argc, char **argv) {
+  size_t num_triangles = argc > 1 ? atoi(argv[1]) : 20000;
+  size_t num_rays = argc > 2 ? atoi(argv[2]) : 20000;
+  double size = 2.0 / cbrt((double)num_triangles);
+
+  size_t mismatches = 0;
+  mismatches += check_scene("uniform", num_triangles, num_rays, size, false,
+                            [](const Vector3D &p) { return p; });
+  // most triangles in a small cluster, the case uniform grids handle worst
+  mismatches += check_scene("clustered", num_triangles, num_rays, size / 8,
+                            false, [](const Vector3D &p) {
+                              return p.x < 0.1 ? Vector3D(10 * p.x, p.y, p.z)
+                                               : Vector3D(0.45, 0.45, 0.45) +
+                                                     0.1 * p;
+                            });
+  // a tiled floor, which leaves the bounds flat along z
+  mismatches += check_scene("flat", num_triangles, num_rays, size / 8, true,
+                            [](const Vector3D &p) {
+                              return Vector3D(p.x, p.y, 0);
+                            });
+  return mismatches ? 1 : 0;
+}
@@ -0,0 +1,176 @@
+#include "CGL/CGL.h"
+
+#include "pathtracer/intersection.h"
+#include "scene/bvh.h"
+#include "scene/triangle.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+using namespace CGL;
+using namespace CGL::SceneObjects;
+
+/**
+ * Read misses of one cache counted by the kernel for this thread.
+ * Reports -1 where performance counters are unavailable, e.g. on other
+ * platforms or when perf_event_paranoid forbids them.
+ */
+class CacheMissCounter {
+ public:
+  CacheMissCounter(uint64_t cache) : fd(-1) {
+#ifdef __linux__
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+  }
+
+  ~CacheMissCounter() {
+#ifdef __linux__
+    if (fd >= 0)
+      close(fd);
+#endif
+  }
+
+  void start() {
+#ifdef __linux__
+    if (fd >= 0) {
+      ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+  }
+
+  long long stop() {
+    long long count = -1;
+#ifdef __linux__
+    if (fd >= 0) {
+      ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+      if (read(fd, &count, sizeof(count)) != sizeof(count))
+        count = -1;
+    }
+#endif
+    return count;
+  }
+
+ private:
+  int fd;
+};
+
+#ifndef __linux__
+#define PERF_COUNT_HW_CACHE_L1D 0
+#define PERF_COUNT_HW_CACHE_LL 0
+#define PERF_COUNT_HW_CACHE_DTLB 0
+#endif
+
+typedef chrono::high_resolution_clock Clock;
+
+static void print_per_ray(long long count, size_t rays) {
+  if (count < 0)
+    printf("      n/a");
+  else
+    printf(" %8.2f", (double)count / rays);
+}
+
+int main(int argc, char **argv) {
+  size_t num_triangles = argc > 1 ? atoi(argv[1]) : 1 << 20;
+  size_t num_rays = argc > 2 ? atoi(argv[2]) : 1 << 18;
+
+  // a soup of small triangles filling the unit cube, large enough that the
+  // nodes do not fit in the caches
+  mt19937 rng(184);
+  uniform_real_distribution<double> u(0.0, 1.0);
+  double size = 2.0 / cbrt((double)num_triangles);
+  vector<Vector3D> positions, normals;
+  vector<uint32_t> indices;
+  for (size_t i = 0; i < num_triangles; i++) {
+    Vector3D c(u(rng), u(rng), u(rng));
+    Vector3D p[3];
+    for (int k = 0; k < 3; k++) {
+      p[k] = c + size * Vector3D(u(rng) - 0.5, u(rng) - 0.5, u(rng) - 0.5);
+      indices.push_back(positions.size());
+      positions.push_back(p[k]);
+    }
+    Vector3D n = cross(p[1] - p[0], p[2] - p[0]).unit();
+    normals.insert(normals.end(), 3, n);
+  }
+  TriangleStore store(positions.data(), normals.data(), positions.size(),
+                      indices, NULL);
+  vector<Primitive *> primitives;
+  for (Triangle &t : store.triangles)
+    primitives.push_back(&t);
+
+  // incoherent rays, like those of diffuse bounces
+  vector<Ray> rays;
+  for (size_t i = 0; i < num_rays; i++) {
+    Vector3D o(u(rng), u(rng), u(rng));
+    Vector3D d(u(rng) - 0.5, u(rng) - 0.5, u(rng) - 0.5);
+    rays.push_back(Ray(o, d.unit()));
+  }
+
+  printf("%zu triangles x %zu rays, node bytes per triangle and read misses "
+         "per ray\n", num_triangles, num_rays);
+  printf("  width layout   bytes/tri    ns/ray  L1D miss  LLC miss  dTLB miss\n");
+  CacheMissCounter l1(PERF_COUNT_HW_CACHE_L1D);
+  CacheMissCounter llc(PERF_COUNT_HW_CACHE_LL);
+  CacheMissCounter tlb(PERF_COUNT_HW_CACHE_DTLB);
+  BVHNodeFormat formats[] = {BVH_NODE_BINARY, BVH_NODE_WIDE4, BVH_NODE_WIDE8,
+                             BVH_NODE_QUANTIZED4};
+  BVHNodeLayout layouts[] = {BVH_LAYOUT_DEPTH_FIRST, BVH_LAYOUT_TREELET};
+  for (BVHNodeFormat format : formats) {
+    for (BVHNodeLayout layout : layouts) {
+      BVHBuildOptions options;
+      options.method = BVH_BUILD_SAH;
+      options.node_format = format;
+      options.node_layout = layout;
+      options.num_threads = max(thread::hardware_concurrency(), 1u);
+      BVHAccel bvh(primitives, options);
+
+      size_t hits = 0;
+      Clock::time_point start = Clock::now();
+      l1.start();
+      llc.start();
+      tlb.start();
+      for (const Ray &ray : rays) {
+        Ray r = ray;
+        Intersection isect;
+        hits += bvh.intersect(r, &isect);
+      }
+      long long l1_misses = l1.stop();
+      long long llc_misses = llc.stop();
+      long long tlb_misses = tlb.stop();
+      double s = chrono::duration<double>(Clock::now() - start).count();
+
+      BVHQualityReport report = bvh.quality_report();
+      printf("  %5s %-8s %9.1f %9.1f", bvh_node_format_name(format),
+             bvh_node_layout_name(layout),
+             (double)report.node_bytes / num_triangles, s * 1e9 / num_rays);
+      print_per_ray(l1_misses, num_rays);
+      print_per_ray(llc_misses, num_rays);
+      print_per_ray(tlb_misses, num_rays);
+      printf("   (%zu hits)\n", hits);
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,167 @@
+#include "CGL/CGL.h"
+
+#include "scene/bbox.h"
+#include "scene/ray_box.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+using namespace std;
+using namespace CGL;
+
+/**
+ * Ray - bbox test as it was before the slab kernels, kept as the baseline.
+ */
+static bool legacy_intersect(const BBox &b, const Ray &r, double &t0,
+                             double &t1) {
+  auto mn = std::vector<double>(3);
+  auto mx = std::vector<double>(3);
+  for (int i = 0; i < 3; i++) {
+    mn[i] = (b.min[i] - r.o[i]) / r.d[i];
+    mx[i] = (b.max[i] - r.o[i]) / r.d[i];
+    if (mn[i] > mx[i])
+      std::swap(mn[i], mx[i]);
+  }
+  auto min_t = *std::max_element(mn.begin(), mn.end());
+  auto max_t = *std::min_element(mx.begin(), mx.end());
+  if (min_t > max_t || max_t < t0 || min_t > t1)
+    return false;
+  t0 = std::max(t0, min_t);
+  t1 = std::min(t1, max_t);
+  return true;
+}
+
+struct alignas(32) Box8 {
+  float b[8];
+};
+
+static int bit_count(int mask) {
+  int n = 0;
+  for (; mask; mask &= mask - 1)
+    n++;
+  return n;
+}
+
+typedef chrono::high_resolution_clock Clock;
+
+static void report(const char *name, Clock::time_point start, size_t tests,
+                   size_t hits) {
+  double s = chrono::duration<double>(Clock::now() - start).count();
+  printf("  %-22s %8.3f ns/box %10zu hits\n", name, s * 1e9 / tests, hits);
+}
+
+int main(int argc, char **argv) {
+  size_t num_boxes = argc > 1 ? atoi(argv[1]) : 1024;
+  size_t num_rays = argc > 2 ? atoi(argv[2]) : 4096;
+  num_boxes = (num_boxes + 7) / 8 * 8;
+
+  mt19937 rng(184);
+  uniform_real_distribution<double> u(-1.0, 1.0);
+  uniform_real_distribution<double> ext(0.02, 0.4);
+
+  vector<BBox> boxes;
+  vector<Box8> flat(num_boxes);
+  vector<RayBox4> soa4(num_boxes / 4);
+  vector<RayBox8> soa8(num_boxes / 8);
+  for (size_t i = 0; i < num_boxes; i++) {
+    Vector3D c(u(rng), u(rng), u(rng));
+    Vector3D e(ext(rng), ext(rng), ext(rng));
+    BBox bb(c - e, c + e);
+    boxes.push_back(bb);
+    for (int a = 0; a < 3; a++) {
+      flat[i].b[a] = bb.min[a];
+      flat[i].b[4 + a] = bb.max[a];
+    }
+    flat[i].b[3] = flat[i].b[7] = 0;
+    soa4[i / 4].set(i % 4, flat[i].b);
+    soa8[i / 8].set(i % 8, flat[i].b);
+  }
+
+  vector<Ray> rays;
+  for (size_t i = 0; i < num_rays; i++) {
+    Vector3D o(2 * u(rng), 2 * u(rng), 2 * u(rng));
+    Vector3D d(u(rng), u(rng), u(rng));
+    // every 16th ray is axis aligned to exercise the 0 * inf case
+    if (i % 16 == 0)
+      d = Vector3D(0, i % 32 ? 1 : -1, 0);
+    rays.push_back(Ray(o, d.unit()));
+  }
+  vector<RayBoxData> ray_data(rays.begin(), rays.end());
+
+  size_t tests = num_boxes * num_rays;
+  printf("%zu boxes x %zu rays\n", num_boxes, num_rays);
+
+  Clock::time_point start = Clock::now();
+  size_t hits = 0;
+  for (const Ray &r : rays) {
+    for (const BBox &b : boxes) {
+      double t0 = r.min_t, t1 = r.max_t;
+      hits += legacy_intersect(b, r, t0, t1);
+    }
+  }
+  report("legacy BBox", start, tests, hits);
+
+  start = Clock::now();
+  hits = 0;
+  for (const Ray &r : rays) {
+    for (const BBox &b : boxes) {
+      double t0 = r.min_t, t1 = r.max_t;
+      hits += b.intersect(r, t0, t1);
+    }
+  }
+  report("BBox::intersect", start, tests, hits);
+
+  start = Clock::now();
+  hits = 0;
+  for (const RayBoxData &r : ray_data) {
+    for (const Box8 &b : flat) {
+      float t;
+      hits += ray_box_intersect(b.b, r, INF_F, &t);
+    }
+  }
+  report("scalar", start, tests, hits);
+
+  alignas(32) float t[8];
+  start = Clock::now();
+  hits = 0;
+  for (const RayBoxData &r : ray_data) {
+    for (size_t i = 0; i < flat.size(); i += 2) {
+      RayBox4 pair;
+      pair.clear();
+      pair.set(0, flat[i].b);
+      pair.set(1, flat[i + 1].b);
+      hits += bit_count(ray_box_intersect4(pair, r, INF_F, t));
+    }
+  }
+  report("SSE gathered pairs", start, tests, hits);
+
+  start = Clock::now();
+  hits = 0;
+  for (const RayBoxData &r : ray_data) {
+    for (const RayBox4 &b : soa4)
+      hits += bit_count(ray_box_intersect4(b, r, INF_F, t));
+  }
+  report("SSE 4 wide", start, tests, hits);
+
+  start = Clock::now();
+  hits = 0;
+  for (const RayBoxData &r : ray_data) {
+    for (const RayBox8 &b : soa8)
+      hits += bit_count(ray_box_intersect8(b, r, INF_F, t));
+  }
+  report("AVX 8 wide", start, tests, hits);
+
+  start = Clock::now();
+  hits = 0;
+  for (const RayBoxData &r : ray_data) {
+    for (const RayBox8 &b : soa8)
+      hits += bit_count(ray_box_intersect_scalar(b, r, INF_F, t));
+  }
+  report("scalar 8 wide", start, tests, hits);
+
+  return 0;
+}
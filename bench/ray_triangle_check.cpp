@@ -0,0 +1,193 @@
+#include "CGL/CGL.h"
+
+#include "scene/ray_triangle.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <random>
+#include <vector>
+
+using namespace std;
+using namespace CGL;
+
+/**
+ * A run of consecutive triangle slots and the segment of a ray to test.
+ */
+struct Query {
+  size_t ray;
+  size_t first, count;
+  Real t_min, t_max;
+  bool must_hit; ///< the ray crosses the shared edge of a quad in the run
+};
+
+typedef long (*NearestKernel)(const RayTriangleSoA &, size_t, size_t,
+                              const RayTriangleData &, Real, Real *, Real *,
+                              Real *);
+
+/**
+ * Nearest hit of a run tested one slot at a time, the reference the SIMD
+ * kernels have to match bit for bit.
+ */
+static long reference_nearest(const RayTriangleSoA &tris, size_t first,
+                              size_t count, const RayTriangleData &r,
+                              Real t_min, Real *t_max, Real *u, Real *v) {
+  long best = -1;
+  for (size_t i = first; i < first + count; i++) {
+    if (ray_triangle_intersect(tris, i, r, t_min, *t_max, t_max, u, v))
+      best = i;
+  }
+  return best;
+}
+
+/**
+ * Compare a kernel with the reference on every query.
+ * \return the number of queries where they disagree
+ */
+static size_t check(const char *name, NearestKernel kernel,
+                    const RayTriangleSoA &tris,
+                    const vector<RayTriangleData> &rays,
+                    const vector<Query> &queries) {
+  size_t mismatches = 0, leaks = 0, hits = 0;
+  for (const Query &q : queries) {
+    Real t0 = q.t_max, u0 = 0, v0 = 0;
+    long s0 = reference_nearest(tris, q.first, q.count, rays[q.ray], q.t_min,
+                                &t0, &u0, &v0);
+    Real t1 = q.t_max, u1 = 0, v1 = 0;
+    long s1 = kernel(tris, q.first, q.count, rays[q.ray], q.t_min, &t1, &u1,
+                     &v1);
+    hits += s1 >= 0;
+    if (q.must_hit && s1 < 0)
+      leaks++;
+    if (s0 != s1 || (s0 >= 0 && (t0 != t1 || u0 != u1 || v0 != v1))) {
+      if (mismatches++ < 5)
+        printf("    run [%zu, %zu) segment (%g, %g): slot %ld t %.9g, "
+               "reference slot %ld t %.9g\n",
+               q.first, q.first + q.count, (double)q.t_min, (double)q.t_max,
+               s1, (double)t1, s0, (double)t0);
+    }
+  }
+  printf("  %-10s %8zu hits %6zu mismatches %6zu shared edge misses\n", name,
+         hits, mismatches, leaks);
+  return mismatches + leaks;
+}
+
+typedef chrono::high_resolution_clock Clock;
+
+static void time_kernel(const char *name, NearestKernel kernel,
+                        const RayTriangleSoA &tris,
+                        const vector<RayTriangleData> &rays,
+                        const vector<Query> &queries) {
+  size_t tests = 0, hits = 0;
+  Clock::time_point start = Clock::now();
+  for (const Query &q : queries) {
+    Real t = q.t_max, u, v;
+    hits += kernel(tris, q.first, q.count, rays[q.ray], q.t_min, &t, &u,
+                   &v) >= 0;
+    tests += q.count;
+  }
+  double s = chrono::duration<double>(Clock::now() - start).count();
+  printf("  %-10s %8.3f ns/triangle %10zu hits\n", name, s * 1e9 / tests,
+         hits);
+}
+
+int main(int argc, char **argv) {
+  size_t num_quads = argc > 1 ? atoi(argv[1]) : 512;
+  size_t num_rays = argc > 2 ? atoi(argv[2]) : 20000;
+  const Real inf = numeric_limits<Real>::infinity();
+
+  mt19937 rng(184);
+  uniform_real_distribution<double> u(-1.0, 1.0);
+  uniform_real_distribution<double> unit(0.0, 1.0);
+  uniform_real_distribution<double> ext(0.02, 0.3);
+
+  // quads split along a diagonal into two triangles, followed by an empty
+  // slot as left by primitives that are not triangles. Three slots per quad
+  // put the quads at every offset within the blocks.
+  size_t num_slots = 3 * num_quads;
+  RayTriangleSoA tris;
+  tris.resize(num_slots);
+  vector<Vector3D> centers(num_quads);
+  vector<Vector3D> corners(4 * num_quads);
+  for (size_t q = 0; q < num_quads; q++) {
+    Vector3D c(u(rng), u(rng), u(rng));
+    Vector3D a = ext(rng) * Vector3D(u(rng), u(rng), u(rng)).unit();
+    Vector3D b = ext(rng) * cross(a, Vector3D(u(rng), u(rng), u(rng))).unit();
+    Vector3D p[4] = {c - a - b, c + a - b, c + a + b, c - a + b};
+    Vector3D t0[3] = {p[0], p[1], p[2]};
+    Vector3D t1[3] = {p[0], p[2], p[3]};
+    tris.set(3 * q, t0);
+    tris.set(3 * q + 1, t1);
+    centers[q] = c;
+    for (int k = 0; k < 4; k++)
+      corners[4 * q + k] = p[k];
+  }
+
+  vector<RayTriangleData> rays;
+  vector<Query> queries;
+  for (size_t i = 0; i < num_rays; i++) {
+    size_t q = rng() % num_quads;
+    // aim at the middle of the shared edge, a corner or inside a triangle
+    Vector3D target = centers[q];
+    bool edge = i % 4 < 2;
+    if (i % 4 == 2) {
+      target = corners[4 * q + rng() % 4];
+    } else if (i % 4 == 3) {
+      double b1 = unit(rng), b2 = unit(rng);
+      if (b1 + b2 > 1) {
+        b1 = 1 - b1;
+        b2 = 1 - b2;
+      }
+      const Vector3D *p = &corners[4 * q];
+      target = p[0] + b1 * (p[1] - p[0]) + b2 * (p[2] - p[0]);
+    }
+    Vector3D o(2 * u(rng), 2 * u(rng), 2 * u(rng));
+    // every 8th ray is axis aligned to exercise zero shears
+    if (i % 8 == 1)
+      o = target - 3 * Vector3D(0, 0, i % 16 == 1 ? 1 : -1);
+    Vector3D d = (target - o).unit();
+    double dist = (target - o).norm();
+    rays.push_back(RayTriangleData(Ray(o, d)));
+
+    // runs around the quad starting at every lane of a block and spanning
+    // up to three blocks, and a few runs elsewhere
+    for (size_t j = 0; j <= 8; j++) {
+      size_t first = 3 * q >= j ? 3 * q - j : 0;
+      size_t count = min(3 * q + 2 - first + rng() % 9, num_slots - first);
+      Query query = {i, first, count, 0, inf, edge};
+      if (j % 3 == 1) {
+        query.t_max = 1.5 * unit(rng) * dist;
+        query.must_hit = false;
+      } else if (j % 3 == 2) {
+        query.t_min = unit(rng) * dist;
+        query.must_hit = false;
+      }
+      queries.push_back(query);
+    }
+    size_t first = rng() % num_slots;
+    size_t count = 1 + rng() % min<size_t>(17, num_slots - first);
+    queries.push_back({i, first, count, 0, inf, false});
+  }
+
+  printf("%zu triangles, %zu runs of %zu rays\n", 2 * num_quads,
+         queries.size(), num_rays);
+  size_t failures = 0;
+#ifdef RAY_TRIANGLE_SSE
+  failures += check("SSE 4 wide", ray_triangle_nearest4, tris, rays, queries);
+#endif
+#ifdef RAY_TRIANGLE_AVX
+  failures += check("AVX 8 wide", ray_triangle_nearest8, tris, rays, queries);
+#endif
+  failures += check("scalar", reference_nearest, tris, rays, queries);
+
+  time_kernel("scalar", reference_nearest, tris, rays, queries);
+#ifdef RAY_TRIANGLE_SSE
+  time_kernel("SSE 4 wide", ray_triangle_nearest4, tris, rays, queries);
+#endif
+#ifdef RAY_TRIANGLE_AVX
+  time_kernel("AVX 8 wide", ray_triangle_nearest8, tris, rays, queries);
+#endif
+
+  return failures ? 1 : 0;
+}
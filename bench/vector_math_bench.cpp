@@ -0,0 +1,241 @@
+#include "CGL/CGL.h"
+#include "CGL/matrix3x3.h"
+#include "CGL/vector3D.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+using namespace std;
+using namespace CGL;
+
+#ifdef _MSC_VER
+#define BENCH_NOINLINE __declspec(noinline)
+#else
+#define BENCH_NOINLINE __attribute__((noinline))
+#endif
+
+/**
+ * Vector3D and Matrix3x3 as they were before CGL_SIMD_MATH, kept as the
+ * baseline: three doubles, out-of-line matrix - vector product.
+ */
+struct ScalarVector3D {
+  double x, y, z;
+
+  ScalarVector3D() : x(0), y(0), z(0) {}
+  ScalarVector3D(double x, double y, double z) : x(x), y(y), z(z) {}
+
+  double &operator[](int i) { return (&x)[i]; }
+  ScalarVector3D operator-() const { return ScalarVector3D(-x, -y, -z); }
+  ScalarVector3D operator+(const ScalarVector3D &v) const {
+    return ScalarVector3D(x + v.x, y + v.y, z + v.z);
+  }
+  ScalarVector3D operator-(const ScalarVector3D &v) const {
+    return ScalarVector3D(x - v.x, y - v.y, z - v.z);
+  }
+  ScalarVector3D operator*(double c) const {
+    return ScalarVector3D(x * c, y * c, z * c);
+  }
+  void operator+=(const ScalarVector3D &v) {
+    x += v.x;
+    y += v.y;
+    z += v.z;
+  }
+  double norm() const { return sqrt(x * x + y * y + z * z); }
+  void normalize() { *this = *this * (1. / norm()); }
+};
+
+static inline ScalarVector3D operator*(double c, const ScalarVector3D &v) {
+  return ScalarVector3D(c * v.x, c * v.y, c * v.z);
+}
+
+static inline double dot(const ScalarVector3D &u, const ScalarVector3D &v) {
+  return u.x * v.x + u.y * v.y + u.z * v.z;
+}
+
+static inline ScalarVector3D cross(const ScalarVector3D &u,
+                                   const ScalarVector3D &v) {
+  return ScalarVector3D(u.y * v.z - u.z * v.y, u.z * v.x - u.x * v.z,
+                        u.x * v.y - u.y * v.x);
+}
+
+struct ScalarMatrix3x3 {
+  ScalarVector3D entries[3];
+
+  ScalarVector3D &operator[](int j) { return entries[j]; }
+  double operator()(int i, int j) const { return (&entries[j].x)[i]; }
+  ScalarVector3D operator*(const ScalarVector3D &x) const;
+  ScalarMatrix3x3 T() const;
+};
+
+// out of line like Matrix3x3 in matrix3x3.cpp before
+BENCH_NOINLINE ScalarVector3D
+ScalarMatrix3x3::operator*(const ScalarVector3D &x) const {
+  return x.x * entries[0] + x.y * entries[1] + x.z * entries[2];
+}
+
+BENCH_NOINLINE ScalarMatrix3x3 ScalarMatrix3x3::T() const {
+  ScalarMatrix3x3 B;
+  for (int i = 0; i < 3; i++)
+    for (int j = 0; j < 3; j++)
+      (&B.entries[j].x)[i] = (*this)(j, i);
+  return B;
+}
+
+/**
+ * Same as make_coord_space in pathtracer/bsdf.cpp.
+ */
+template <typename V, typename M>
+static inline void make_coord_space(M &o2w, const V &n) {
+  V z = n;
+  V h = z;
+  // h is rebuilt whole, writing a single component of a SIMD Vector3D
+  // stalls the vector loads that follow
+  if (fabs(h.x) <= fabs(h.y) && fabs(h.x) <= fabs(h.z))
+    h = V(1.0, h.y, h.z);
+  else if (fabs(h.y) <= fabs(h.x) && fabs(h.y) <= fabs(h.z))
+    h = V(h.x, 1.0, h.z);
+  else
+    h = V(h.x, h.y, 1.0);
+
+  z.normalize();
+  V y = cross(h, z);
+  y.normalize();
+  V x = cross(z, y);
+  x.normalize();
+
+  o2w[0] = x;
+  o2w[1] = y;
+  o2w[2] = z;
+}
+
+/**
+ * Shading frame of a hit as in the integrator: build the frame around the
+ * normal, bring the outgoing direction into it and a sample out of it.
+ */
+template <typename V, typename M>
+static V shading_frame(const vector<V> &n, const vector<V> &d,
+                       const vector<V> &wi) {
+  V sum;
+  for (size_t i = 0; i < n.size(); i++) {
+    M o2w;
+    make_coord_space<V, M>(o2w, n[i]);
+    M w2o = o2w.T();
+    V w_out = w2o * (-d[i]);
+    V w = o2w * wi[i];
+    sum += w + w_out * dot(n[i], w);
+  }
+  return sum;
+}
+
+/**
+ * Moller - Trumbore as in Triangle::intersect.
+ */
+template <typename V>
+static double moller_trumbore(const vector<V> &p, const vector<V> &o,
+                              const vector<V> &d) {
+  double sum = 0;
+  for (size_t i = 0; i + 2 < p.size(); i++) {
+    V e1 = p[i + 1] - p[i], e2 = p[i + 2] - p[i];
+    V s = o[i] - p[i];
+    V s1 = cross(d[i], e2), s2 = cross(s, e1);
+    double r = 1 / dot(s1, e1);
+    double t = dot(s2, e2) * r;
+    double b1 = dot(s1, s) * r, b2 = dot(s2, d[i]) * r;
+    if (t > 0 && b1 >= 0 && b2 >= 0 && b1 + b2 <= 1)
+      sum += t;
+  }
+  return sum;
+}
+
+/**
+ * Bilinear lookup as in EnvironmentLight::bilerp.
+ */
+template <typename V>
+static V bilerp(const vector<V> &texels, const vector<double> &u,
+                const vector<double> &v) {
+  V sum;
+  for (size_t i = 0; i + 3 < texels.size(); i++) {
+    double u0 = u[i], u1 = 1 - u0, v1 = v[i];
+    sum += (texels[i] * u1 + texels[i + 1] * u0) * v1 +
+           (texels[i + 2] * u1 + texels[i + 3] * u0) * (1 - v1);
+  }
+  return sum;
+}
+
+typedef chrono::high_resolution_clock Clock;
+
+static double elapsed_ns(Clock::time_point start, size_t n) {
+  return chrono::duration<double>(Clock::now() - start).count() * 1e9 / n;
+}
+
+static void report(const char *name, double scalar, double cgl) {
+  printf("  %-16s %8.2f ns %8.2f ns %6.2fx\n", name, scalar, cgl,
+         scalar / cgl);
+}
+
+int main(int argc, char **argv) {
+  size_t n = argc > 1 ? atoi(argv[1]) : 1 << 16;
+  int repeats = argc > 2 ? atoi(argv[2]) : 20;
+
+  mt19937 rng(7);
+  uniform_real_distribution<double> U(-1, 1);
+  vector<ScalarVector3D> sa(n), sb(n), sc(n);
+  vector<Vector3D> ca(n), cb(n), cc(n);
+  vector<double> u(n), v(n);
+  for (size_t i = 0; i < n; i++) {
+    double a[9];
+    for (double &x : a)
+      x = U(rng);
+    sa[i] = ScalarVector3D(a[0], a[1], a[2]);
+    sb[i] = ScalarVector3D(a[3], a[4], a[5]);
+    sc[i] = ScalarVector3D(a[6], a[7], a[8]);
+    ca[i] = Vector3D(a[0], a[1], a[2]);
+    cb[i] = Vector3D(a[3], a[4], a[5]);
+    cc[i] = Vector3D(a[6], a[7], a[8]);
+    u[i] = (a[0] + 1) / 2;
+    v[i] = (a[1] + 1) / 2;
+  }
+
+#ifdef CGL_VECTOR3D_AVX
+  printf("Vector3D: AVX, %zu bytes\n", sizeof(Vector3D));
+#else
+  printf("Vector3D: scalar, %zu bytes\n", sizeof(Vector3D));
+#endif
+  printf("  %-16s %11s %11s %7s\n", "per element", "baseline", "Vector3D",
+         "speedup");
+
+  // best of the repeats, results are summed so the loops are kept
+  double best[6] = {1e30, 1e30, 1e30, 1e30, 1e30, 1e30};
+  double check = 0;
+  for (int r = 0; r < repeats; r++) {
+    Clock::time_point start = Clock::now();
+    check += shading_frame<ScalarVector3D, ScalarMatrix3x3>(sa, sb, sc).x;
+    best[0] = min(best[0], elapsed_ns(start, n));
+    start = Clock::now();
+    check += shading_frame<Vector3D, Matrix3x3>(ca, cb, cc).x;
+    best[1] = min(best[1], elapsed_ns(start, n));
+
+    start = Clock::now();
+    check += moller_trumbore(sa, sb, sc);
+    best[2] = min(best[2], elapsed_ns(start, n));
+    start = Clock::now();
+    check += moller_trumbore(ca, cb, cc);
+    best[3] = min(best[3], elapsed_ns(start, n));
+
+    start = Clock::now();
+    check += bilerp(sa, u, v).x;
+    best[4] = min(best[4], elapsed_ns(start, n));
+    start = Clock::now();
+    check += bilerp(ca, u, v).x;
+    best[5] = min(best[5], elapsed_ns(start, n));
+  }
+  report("shading frame", best[0], best[1]);
+  report("Moller-Trumbore", best[2], best[3]);
+  report("envmap bilerp", best[4], best[5]);
+  printf("  (checksum %g)\n", check);
+  return 0;
+}
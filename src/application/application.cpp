@@ -35,7 +35,12 @@ Application::Application(AppConfig config, bool gl) {
     config.pathtracer_direct_hemisphere_sample,
     config.pathtracer_filename,
     config.pathtracer_lensRadius,
-    config.pathtracer_focalDistance
+    config.pathtracer_focalDistance,
+    config.pathtracer_bvh_options,
+    config.pathtracer_stats_filename,
+    config.pathtracer_packet_size,
+    config.pathtracer_stream_rays,
+    config.pathtracer_accelerator
   );
   filename = config.pathtracer_filename;
 }
@@ -237,6 +242,10 @@ void Application::load(SceneInfo* sceneInfo) {
   Vector3D c_pos = Vector3D();
   Vector3D c_dir = Vector3D();
 
+  // first mesh loaded from each geometry and its transform; later nodes
+  // instancing the same geometry become copies of it
+  map<string, pair<GLScene::Mesh *, Matrix4x4> > prototypes;
+
   int len = nodes.size();
   for (int i = 0; i < len; i++) {
     Collada::Node& node = nodes[i];
@@ -261,9 +270,22 @@ void Application::load(SceneInfo* sceneInfo) {
           init_sphere(static_cast<SphereInfo&>(*instance), transform));
         break;
       case Collada::Instance::POLYMESH:
-        objects.push_back(
-          init_polymesh(static_cast<PolymeshInfo&>(*instance), transform));
+      {
+        GLScene::SceneObject *obj =
+          init_polymesh(static_cast<PolymeshInfo&>(*instance), transform);
+        GLScene::Mesh *mesh = dynamic_cast<GLScene::Mesh *>(obj);
+        if (mesh && !instance->id.empty()) {
+          auto it = prototypes.find(instance->id);
+          if (it == prototypes.end()) {
+            prototypes[instance->id] = make_pair(mesh, transform);
+          } else {
+            mesh->set_instance_of(it->second.first,
+                                  transform * it->second.second.inv());
+          }
+        }
+        objects.push_back(obj);
         break;
+      }
       case Collada::Instance::MATERIAL:
         init_material(static_cast<MaterialInfo&>(*instance));
         break;
@@ -432,8 +454,8 @@ void Application::keyboard_event(int key, int event, unsigned char mods) {
             break;
           case 'v': case 'V':
             renderer->stop();
-            renderer->start_visualizing();
-            mode = VISUALIZE_MODE;
+            if (renderer->start_visualizing())
+              mode = VISUALIZE_MODE;
             break;
           case 's': case 'S':
             renderer->save_image();
@@ -493,8 +515,8 @@ void Application::keyboard_event(int key, int event, unsigned char mods) {
             break;
           case 'v': case 'V':
             set_up_pathtracer();
-            renderer->start_visualizing();
-            mode = VISUALIZE_MODE;
+            if (renderer->start_visualizing())
+              mode = VISUALIZE_MODE;
             break;
           case ' ':
             reset_camera();
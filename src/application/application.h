@@ -8,6 +8,7 @@
 #include <algorithm>
 #include <string>
 #include <vector>
+#include <map>
 
 // libCGL
 #include "CGL/CGL.h"
@@ -63,6 +64,11 @@ struct AppConfig {
     pathtracer_filename = "";
     pathtracer_lensRadius = 0.0;
     pathtracer_focalDistance = 4.7;
+
+    pathtracer_stats_filename = "";
+    pathtracer_packet_size = 0;
+    pathtracer_stream_rays = false;
+    pathtracer_accelerator = SceneObjects::ACCEL_BVH;
   }
 
   size_t pathtracer_ns_aa;
@@ -86,6 +92,16 @@ struct AppConfig {
 
   double pathtracer_lensRadius;
   double pathtracer_focalDistance;
+
+  SceneObjects::BVHBuildOptions pathtracer_bvh_options;
+
+  string pathtracer_stats_filename;
+
+  size_t pathtracer_packet_size;
+
+  bool pathtracer_stream_rays;
+
+  SceneObjects::AcceleratorType pathtracer_accelerator;
 };
 
 class Application : public Renderer {
@@ -33,6 +33,16 @@ void usage(const char *binaryName) {
   printf("  -e  <PATH>       Path to environment map\n");
   printf("  -b  <FLOAT>      The size of the aperture\n");
   printf("  -d  <FLOAT>      The focal distance\n");
+  printf("  -A  <NAME>       Accelerator (bvh, kdtree, grid)\n");
+  printf("  -B  <NAME>       BVH builder (median, sah, lbvh, hlbvh, sbvh)\n");
+  printf("  -W  <INT>        BVH width used for traversal (2, 4, 8, 4q for\n"
+         "                   quantized 4 wide nodes)\n");
+  printf("  -L  <NAME>       BVH node layout (dfs, treelet)\n");
+  printf("  -C  <PATH>       Directory to cache built BVHs in\n");
+  printf("  -S  <FILENAME>   Write BVH and traversal statistics as JSON\n");
+  printf("  -P  <INT>        Trace camera rays in packets of INT x INT pixels\n"
+         "                   (1 to 8, 0 traces them one by one)\n");
+  printf("  -R               Trace the rays of each tile as sorted streams\n");
   printf("  -f  <FILENAME>   Image (.png) file to save output to in windowless "
          "mode\n");
   printf(
@@ -72,7 +82,8 @@ HDRImageBuffer *load_exr(const char *file_path) {
   float *channel_g = (float *)exr.images[1];
   float *channel_b = (float *)exr.images[0];
   for (size_t i = 0; i < exr.width * exr.height; i++) {
-    envmap->data[i] = Vector3D(channel_r[i], channel_g[i], channel_b[i]);
+    envmap->update_pixel(Vector3D(channel_r[i], channel_g[i], channel_b[i]),
+                         i % exr.width, i / exr.width);
   }
 
   return envmap;
@@ -123,7 +134,7 @@ int main(int argc, char **argv) {
       config.pathtracer_accumulate_bounces = settings.pathtracer_accumulate_bounces;
     }
   } else {
-    while ((opt = getopt(argc, argv, "s:l:t:m:o:e:h:H:f:r:c:b:d:a:p:")) !=
+    while ((opt = getopt(argc, argv, "s:l:t:m:o:e:h:H:f:r:c:b:d:a:p:A:B:W:L:C:S:P:R")) !=
            -1) { // for each option...
       switch (opt) {
       case 'f':
@@ -176,6 +187,50 @@ int main(int argc, char **argv) {
         config.pathtracer_max_tolerance = atof(argv[optind]);
         optind++;
         break;
+      case 'A':
+        if (!SceneObjects::parse_accelerator_type(
+                optarg, &config.pathtracer_accelerator)) {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'B':
+        if (!SceneObjects::parse_bvh_build_method(
+                optarg, &config.pathtracer_bvh_options.method)) {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'W':
+        if (!SceneObjects::parse_bvh_node_format(
+                optarg, &config.pathtracer_bvh_options.node_format)) {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'L':
+        if (!SceneObjects::parse_bvh_node_layout(
+                optarg, &config.pathtracer_bvh_options.node_layout)) {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'C':
+        config.pathtracer_bvh_options.cache_dir = optarg;
+        break;
+      case 'S':
+        config.pathtracer_stats_filename = optarg;
+        break;
+      case 'P':
+        config.pathtracer_packet_size = atoi(optarg);
+        if (config.pathtracer_packet_size > 8) {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'R':
+        config.pathtracer_stream_rays = true;
+        break;
       case 'H':
         config.pathtracer_direct_hemisphere_sample = true;
         optind--;
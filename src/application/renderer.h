@@ -67,8 +67,9 @@ public:
 
     /**
      * If the pathtracer is in READY, transition to VISUALIZE.
+     * \return true if the renderer is now visualizing
      */
-    virtual void start_visualizing() = 0;
+    virtual bool start_visualizing() = 0;
 
     /**
      * If the pathtracer is in READY, transition to RENDERING.
@@ -163,15 +163,15 @@ namespace CGL
 
         if (ImGui::TreeNode("Triangle"))
         {
-          static SceneObjects::Triangle t;
+          static Vector3D p[3], n[3];
 
-          DragDouble3("P1", &t.p1[0], 0.005);
-          DragDouble3("P2", &t.p2[0], 0.005);
-          DragDouble3("P3", &t.p3[0], 0.005);
+          DragDouble3("P1", &p[0][0], 0.005);
+          DragDouble3("P2", &p[1][0], 0.005);
+          DragDouble3("P3", &p[2][0], 0.005);
 
-          DragDouble3("N1", &t.n1[0], 0.005);
-          DragDouble3("N2", &t.n2[0], 0.005);
-          DragDouble3("N3", &t.n3[0], 0.005);
+          DragDouble3("N1", &n[0][0], 0.005);
+          DragDouble3("N2", &n[1][0], 0.005);
+          DragDouble3("N3", &n[2][0], 0.005);
 
           static SceneObjects::Intersection isect;
 
@@ -179,7 +179,8 @@ namespace CGL
 
           if (ImGui::Button("Test Intersect"))
           {
-            success = t.intersect(r, &isect);
+            SceneObjects::TriangleStore store(p, n, 3, {0, 1, 2}, NULL);
+            success = store.triangles[0].intersect(r, &isect);
           }
 
           if (success)
@@ -23,12 +23,14 @@ void make_coord_space(Matrix3x3 &o2w, const Vector3D n) {
 
   Vector3D z = Vector3D(n.x, n.y, n.z);
   Vector3D h = z;
+  // h is rebuilt whole, writing a single component of a SIMD Vector3D
+  // stalls the vector loads that follow
   if (fabs(h.x) <= fabs(h.y) && fabs(h.x) <= fabs(h.z))
-    h.x = 1.0;
+    h = Vector3D(1.0, h.y, h.z);
   else if (fabs(h.y) <= fabs(h.x) && fabs(h.y) <= fabs(h.z))
-    h.y = 1.0;
+    h = Vector3D(h.x, 1.0, h.z);
   else
-    h.z = 1.0;
+    h = Vector3D(h.x, h.y, 1.0);
 
   z.normalize();
   Vector3D y = cross(h, z);
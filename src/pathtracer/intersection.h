@@ -1,6 +1,7 @@
 #ifndef CGL_INTERSECT_H
 #define CGL_INTERSECT_H
 
+#include <cstdint>
 #include <vector>
 
 #include "CGL/vector3D.h"
@@ -20,12 +21,17 @@ class Primitive;
  */
 struct Intersection {
 
-  Intersection() : t (INF_D), primitive(NULL), bsdf(NULL) { }
+  Intersection()
+      : t (INF_D), primitive(NULL), primitive_id(0), u(0), v(0), bsdf(NULL) { }
 
   double t;    ///< time of intersection
 
   const Primitive* primitive;  ///< the primitive intersected
 
+  uint32_t primitive_id;  ///< index of the primitive in the accelerator
+
+  double u, v;  ///< barycentric coordinates of a triangle hit
+
   Vector3D n;  ///< normal at point of intersection
 
   BSDF* bsdf; ///< BSDF of the surface at point of intersection
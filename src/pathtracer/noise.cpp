@@ -3,6 +3,7 @@
 #include "vector3D.h"
 #include <algorithm>
 #include <cmath>
+#include <functional>
 #include <random>
 
 using namespace std;
@@ -11,6 +11,7 @@
 #include "vector2D.h"
 #include "vector3D.h"
 #include <cassert>
+#include <memory>
 
 using namespace CGL::SceneObjects;
 
@@ -28,6 +29,9 @@ PathTracer::PathTracer() {
   tm_level = 1.0f;
   tm_key = 0.18;
   tm_wht = 5.0f;
+  packet_size = 0;
+  stream_rays = false;
+  stream_paths = 1 << 14;
   P_absorb = 0.1;
   P_scatter = 0.1;
   P_transmit = P_scatter + P_absorb;
@@ -46,7 +50,7 @@ void PathTracer::set_frame_size(size_t width, size_t height) {
 }
 
 void PathTracer::clear() {
-  bvh = NULL;
+  accel = NULL;
   scene = NULL;
   camera = NULL;
   sampleBuffer.clear();
@@ -101,13 +105,14 @@ PathTracer::estimate_direct_lighting_hemisphere(const Ray &r,
     Intersection new_isect;
 
     // the ray is in world space
-    Ray new_ray = Ray(hit_p, o2w * wi, int(r.depth - 1));
-    new_ray.min_t = EPS_F;
+    Vector3D d = o2w * wi;
+    Ray new_ray(offset_ray_origin(hit_p, isect.n, d), d, int(r.depth - 1));
+    new_ray.min_t = 0;
 
     // the bsdf is the property of the object and is in object space
     Vector3D bsdf = isect.bsdf->f(w_out, wi);
 
-    Vector3D L_i = (bvh->intersect(new_ray, &new_isect))
+    Vector3D L_i = (accel->intersect(new_ray, &new_isect))
                        ? new_isect.bsdf->get_emission()
                        : envLight->sample_dir(new_ray);
 
@@ -148,29 +153,41 @@ PathTracer::estimate_direct_lighting_importance(const Ray &r,
     if (light->is_delta_light()) {
       Vector3D light_radiance =
           light->sample_L(hit_p, &wi, &dist_to_light, &pdf);
+      Ray new_ray(offset_ray_origin(hit_p, isect.n, wi), wi, int(r.depth - 1));
+      new_ray.min_t = 0;
+      if (accel->occluded(new_ray, dist_to_light - EPS_F))
+        continue;
+
       Vector3D bsdf = isect.bsdf->f(w_out, wi);
-      Ray new_ray(hit_p, wi, dist_to_light - EPS_F, r.depth - 1);
-      new_ray.min_t = EPS_F;
-      Intersection new_isect;
-
-      Vector3D L_i = (bvh->intersect(new_ray, &new_isect))
-                         ? new_isect.bsdf->get_emission()
-                         : light_radiance;
-      L_out += bsdf * L_i * dot(isect.n, new_ray.d) / pdf * 2;
+      L_out += bsdf * light_radiance * dot(isect.n, new_ray.d) / pdf * 2;
     } else {
+      // the shadow rays of all samples leave hit_p, trace them together
       Vector3D cur_L_out;
-      for (int i = 0; i < ns_area_light; i++) {
-        Vector3D light_radiance =
-            light->sample_L(hit_p, &wi, &dist_to_light, &pdf);
-        Vector3D bsdf = isect.bsdf->f(w_out, wi);
-        Ray new_ray(hit_p, wi, dist_to_light - EPS_F, r.depth - 1);
-        new_ray.min_t = EPS_F;
-        Intersection new_isect;
-
-        Vector3D L_i = (bvh->intersect(new_ray, &new_isect))
-                           ? new_isect.bsdf->get_emission()
-                           : light_radiance;
-        cur_L_out += bsdf * L_i * dot(isect.n, new_ray.d) / pdf * 2;
+      for (int i0 = 0; i0 < ns_area_light; i0 += RAY_PACKET_SIZE) {
+        int n = std::min<int>(ns_area_light - i0, RAY_PACKET_SIZE);
+        Vector3D light_radiance[RAY_PACKET_SIZE];
+        double light_pdf[RAY_PACKET_SIZE];
+        std::vector<Ray> shadow_rays;
+        shadow_rays.reserve(n);
+        for (int i = 0; i < n; i++) {
+          light_radiance[i] =
+              light->sample_L(hit_p, &wi, &dist_to_light, &light_pdf[i]);
+          Ray new_ray(offset_ray_origin(hit_p, isect.n, wi), wi,
+                      dist_to_light - EPS_F, int(r.depth - 1));
+          new_ray.min_t = 0;
+          shadow_rays.push_back(new_ray);
+        }
+
+        bool blocked[RAY_PACKET_SIZE];
+        accel->occluded_packet(shadow_rays.data(), blocked, n);
+        for (int i = 0; i < n; i++) {
+          if (blocked[i])
+            continue;
+          const Vector3D &d = shadow_rays[i].d;
+          Vector3D bsdf = isect.bsdf->f(w_out, d);
+          cur_L_out +=
+              bsdf * light_radiance[i] * dot(isect.n, d) / light_pdf[i] * 2;
+        }
       }
       cur_L_out /= ns_area_light;
       L_out += cur_L_out;
@@ -231,29 +248,46 @@ Vector3D PathTracer::hit_fog(const Ray &r, const Intersection &isect) {
 
   assert(r.depth > 0);
 
-  for (int i = 0; i < num_samples; i++) {
-    // generate the incident direction in object space
-    Vector3D wi = hemisphereSampler->get_sample();
-    Intersection new_isect;
+  // all samples leave hit_p, so their rays are traced together as packets
+  for (int i0 = 0; i0 < num_samples; i0 += RAY_PACKET_SIZE) {
+    int n = std::min<int>(num_samples - i0, RAY_PACKET_SIZE);
+    Vector3D bsdf[RAY_PACKET_SIZE];
+    std::vector<Ray> new_rays;
+    new_rays.reserve(n);
+    for (int i = 0; i < n; i++) {
+      // generate the incident direction in object space
+      Vector3D wi = hemisphereSampler->get_sample();
+
+      // the ray is in world space, points in the fog are not on a surface
+      Vector3D d = o2w * wi;
+      Ray new_ray(hit_fog ? hit_p : offset_ray_origin(hit_p, isect.n, d), d,
+                  int(r.depth - 1));
+      new_ray.min_t = 0;
+      new_rays.push_back(new_ray);
+
+      // the bsdf is the property of the object and is in object space
+      bsdf[i] = isect.bsdf->f(w_out, wi);
+    }
 
-    // the ray is in world space
-    Ray new_ray = Ray(hit_p, o2w * wi, int(r.depth - 1));
-    new_ray.min_t = EPS_F;
+    Intersection new_isects[RAY_PACKET_SIZE];
+    bool hit[RAY_PACKET_SIZE];
+    if (hit_fog == false)
+      accel->intersect_packet(new_rays.data(), new_isects, hit, n);
+
+    for (int i = 0; i < n; i++) {
+      const Ray &new_ray = new_rays[i];
+      Vector3D L_individual;
+      if (hit_fog == false) {
+        L_individual = hit[i] ? new_isects[i].bsdf->get_emission()
+                              : envLight->sample_dir(new_ray);
+      } else {
+        L_individual = 0;
+      }
 
-    // the bsdf is the property of the object and is in object space
-    Vector3D bsdf = isect.bsdf->f(w_out, wi);
-    Vector3D L_individual;
-    if (hit_fog == false) {
-      L_individual = (bvh->intersect(new_ray, &new_isect))
-                         ? new_isect.bsdf->get_emission()
-                         : envLight->sample_dir(new_ray);
-    } else {
-      L_individual = 0;
+      L_out += bsdf[i] * L_individual * dot(isect.n, new_ray.d) *
+               2; // we multiply the pdf outside of the for loop for
+                  // efficiency since it is a constant
     }
-
-    L_out += bsdf * L_individual * dot(isect.n, new_ray.d) *
-             2; // we multiply the pdf outside of the for loop for efficiency
-                // since it is a constant
   }
   L_out *= (2 * PI) / num_samples; // 1 / (2 * PI) is the pdf
 
@@ -290,14 +324,14 @@ Vector3D PathTracer::at_least_one_bounce_radiance(const Ray &r,
 
   // Intersection new_isect;
   // // Task 2
-  // // if (bvh->intersect(new_ray, &new_isect)) {
+  // // if (accel->intersect(new_ray, &new_isect)) {
   // //   Vector3D L_i = at_least_one_bounce_radiance(new_ray, new_isect);
   // //   L_out += bsdf * L_i * dot(isect.n, new_ray.d) / pdf;
   // // }
 
   // // Task 3
   // static const double p_rr = 0.3; // probability of russian roulette
-  // if (bvh->intersect(new_ray, &new_isect)) {
+  // if (accel->intersect(new_ray, &new_isect)) {
   //   if (r.depth == max_ray_depth || r.depth == max_ray_depth - 1) {
   //     Vector3D L_i = at_least_one_bounce_radiance(new_ray, new_isect) *
   //                    exp(-P_absorb * new_isect.t);
@@ -335,19 +369,20 @@ Vector3D PathTracer::at_least_one_bounce_radiance(const Ray &r,
   // bool intersectedMedium = false;
 
   Vector3D brdf = isect.bsdf->sample_f(w_out, &wi, &pdf);
-  Ray nextRay = Ray(hit_p, o2w * wi.unit());
+  Vector3D d = o2w * wi.unit();
+  Ray nextRay(offset_ray_origin(hit_p, isect.n, d), d);
 
   // if (intersectedMedium) {
   //   u = sampleFromHenyeyGreenstein(g);
   //   nextRay = Ray(r.o + r.d * t, o2w * generateScatteredDirection(u).unit());
   // }
 
-  nextRay.min_t = EPS_D;
+  nextRay.min_t = 0;
   nextRay.depth = r.depth - 1;
   Vector3D L_out = one_bounce_radiance(r, isect);
 
   Intersection shadowI;
-  bool intersects = bvh->intersect(nextRay, &shadowI);
+  bool intersects = accel->intersect(nextRay, &shadowI);
 
   if (coin_flip(terminationProbability)) {
     return L_out;
@@ -395,9 +430,14 @@ Vector3D PathTracer::est_radiance_global_illumination(const Ray &r) {
   //
   // REMOVE THIS LINE when you are ready to begin Part 3.
 
-  if (!bvh->intersect(r, &isect))
+  if (!accel->intersect(r, &isect))
     return envLight ? envLight->sample_dir(r) : L_out;
 
+  return est_radiance_global_illumination(r, isect);
+}
+
+Vector3D PathTracer::est_radiance_global_illumination(const Ray &r,
+                                                      const Intersection &isect) {
   // L_out = (isect.t == INF_D) ? debug_shading(r.d) :
   // normal_shading(isect.n);
   // // TODO (Part 3): Return the direct illumination.
@@ -405,6 +445,15 @@ Vector3D PathTracer::est_radiance_global_illumination(const Ray &r) {
 
   // TODO (Part 4): Accumulate the "direct" and "indirect"
   // parts of global illumination into L_out rather than just direct
+  float transmission;
+  Vector3D scattering = fog_scattering(r, &transmission);
+  Vector3D res = scattering + ((zero_bounce_radiance(r, isect) +
+                                at_least_one_bounce_radiance(r, isect))) *
+                                  transmission;
+  return res;
+}
+
+Vector3D PathTracer::fog_scattering(const Ray &r, float *transmission_out) {
   float transmission = 1.0;
   Vector3D scattering = 0.0;
   Vector3D marchDirection = r.d.unit();
@@ -448,10 +497,29 @@ Vector3D PathTracer::est_radiance_global_illumination(const Ray &r) {
                   light_ray_attenuation * light_color * transmission *
                   ray_step_size * density;
   }
-  Vector3D res = scattering + ((zero_bounce_radiance(r, isect) +
-                                at_least_one_bounce_radiance(r, isect))) *
-                                  transmission;
-  return res;
+  *transmission_out = transmission;
+  return scattering;
+}
+
+Ray PathTracer::sample_bounce(const Ray &r, const Intersection &isect,
+                              Vector3D *weight) {
+  Matrix3x3 o2w;
+  make_coord_space(o2w, isect.n);
+  Matrix3x3 w2o = o2w.T();
+
+  Vector3D hit_p = r.o + r.d * isect.t;
+  Vector3D w_out = w2o * (-r.d);
+
+  Vector3D wi;
+  double pdf;
+  Vector3D brdf = isect.bsdf->sample_f(w_out, &wi, &pdf);
+  Vector3D d = o2w * wi.unit();
+  Ray nextRay(offset_ray_origin(hit_p, isect.n, d), d);
+  nextRay.min_t = 0;
+  nextRay.depth = r.depth - 1;
+
+  *weight = brdf * dot(isect.n, nextRay.d) / pdf;
+  return nextRay;
 }
 
 void PathTracer::raytrace_pixel(size_t x, size_t y) {
@@ -523,11 +591,177 @@ void PathTracer::raytrace_pixel(size_t x, size_t y) {
   }
 }
 
+void PathTracer::raytrace_packet(size_t x0, size_t y0, size_t x1,
+                                 size_t y1) {
+  // adaptive sampling decides per pixel when to stop
+  if (PART > 4) {
+    for (size_t y = y0; y < y1; y++)
+      for (size_t x = x0; x < x1; x++)
+        raytrace_pixel(x, y);
+    return;
+  }
+
+  int num_samples = ns_aa;
+  auto w = sampleBuffer.w, h = sampleBuffer.h;
+  size_t num_pixels = (x1 - x0) * (y1 - y0);
+  assert(num_pixels <= RAY_PACKET_SIZE);
+
+  std::vector<std::vector<Vector2D>> samples(num_pixels);
+  std::vector<Vector3D> radiance(num_pixels);
+  for (size_t p = 0; p < num_pixels; p++)
+    samples[p] = gridSampler->get_samples_batch(num_samples);
+
+  std::vector<Ray> rays;
+  rays.reserve(num_pixels);
+  for (int i = 0; i < num_samples; i++) {
+    rays.clear();
+    for (size_t y = y0; y < y1; y++) {
+      for (size_t x = x0; x < x1; x++) {
+        auto sample = Vector2D(x, y) + samples[rays.size()][i];
+        Ray ray = camera->generate_ray(sample.x / w, sample.y / h);
+        ray.depth = max_ray_depth;
+        rays.push_back(ray);
+      }
+    }
+
+    Intersection isects[RAY_PACKET_SIZE];
+    bool hit[RAY_PACKET_SIZE];
+    accel->intersect_packet(rays.data(), isects, hit, rays.size());
+    for (size_t p = 0; p < num_pixels; p++) {
+      if (hit[p])
+        radiance[p] += est_radiance_global_illumination(rays[p], isects[p]);
+      else if (envLight)
+        radiance[p] += envLight->sample_dir(rays[p]);
+    }
+  }
+
+  size_t p = 0;
+  for (size_t y = y0; y < y1; y++) {
+    for (size_t x = x0; x < x1; x++, p++) {
+      sampleBuffer.update_pixel(radiance[p] / num_samples, x, y);
+      sampleCountBuffer[x + y * sampleBuffer.w] = num_samples;
+    }
+  }
+}
+
+void PathTracer::raytrace_stream(size_t x0, size_t y0, size_t x1,
+                                 size_t y1) {
+  // adaptive sampling decides per pixel when to stop
+  if (PART > 4) {
+    for (size_t y = y0; y < y1; y++)
+      for (size_t x = x0; x < x1; x++)
+        raytrace_pixel(x, y);
+    return;
+  }
+
+  int num_samples = ns_aa;
+  auto w = sampleBuffer.w, h = sampleBuffer.h;
+  size_t num_pixels = (x1 - x0) * (y1 - y0);
+
+  std::vector<std::vector<Vector2D>> samples(num_pixels);
+  std::vector<Vector3D> radiance(num_pixels);
+  for (size_t p = 0; p < num_pixels; p++)
+    samples[p] = gridSampler->get_samples_batch(num_samples);
+
+  // paths are traced in batches of whole samples of the block to bound the
+  // memory of a stream
+  int batch = std::max<int>(1, stream_paths / num_pixels);
+  for (int s0 = 0; s0 < num_samples; s0 += batch) {
+    int s1 = std::min(s0 + batch, num_samples);
+
+    // path k belongs to pixel k % num_pixels; rays[k] and isects[k] hold
+    // the ray reaching its current vertex and the hit there
+    std::vector<Ray> rays;
+    rays.reserve((s1 - s0) * num_pixels);
+    for (int i = s0; i < s1; i++) {
+      size_t p = 0;
+      for (size_t y = y0; y < y1; y++) {
+        for (size_t x = x0; x < x1; x++, p++) {
+          auto sample = Vector2D(x, y) + samples[p][i];
+          Ray ray = camera->generate_ray(sample.x / w, sample.y / h);
+          ray.depth = max_ray_depth;
+          rays.push_back(ray);
+        }
+      }
+    }
+    size_t num_paths = rays.size();
+    std::vector<Intersection> isects(num_paths);
+    std::unique_ptr<bool[]> hit(new bool[num_paths]);
+    accel->intersect_stream(rays.data(), isects.data(), hit.get(), num_paths);
+
+    // the radiance of a path is L plus T times that of its next vertex,
+    // which unrolls est_radiance_global_illumination
+    std::vector<Vector3D> L(num_paths), T(num_paths);
+    std::vector<size_t> active;
+    for (size_t k = 0; k < num_paths; k++) {
+      if (!hit[k]) {
+        if (envLight)
+          L[k] = envLight->sample_dir(rays[k]);
+        continue;
+      }
+      float transmission;
+      L[k] = fog_scattering(rays[k], &transmission);
+      L[k] += zero_bounce_radiance(rays[k], isects[k]) * transmission;
+      T[k] = Vector3D(transmission);
+      if (rays[k].depth > 0)
+        active.push_back(k);
+    }
+
+    // one bounce of every live path per pass, as at_least_one_bounce_radiance
+    // does recursively: a vertex adds its direct light only if its bounce
+    // hits, and without accumulation only the last vertex adds it
+    while (!active.empty()) {
+      size_t n = active.size();
+      std::vector<Ray> next;
+      next.reserve(n);
+      std::vector<Vector3D> direct(n), weight(n);
+      for (size_t j = 0; j < n; j++) {
+        size_t k = active[j];
+        if (isAccumBounces || rays[k].depth == 1)
+          direct[j] = one_bounce_radiance(rays[k], isects[k]);
+        next.push_back(sample_bounce(rays[k], isects[k], &weight[j]));
+      }
+
+      std::vector<Intersection> next_isects(n);
+      std::unique_ptr<bool[]> next_hit(new bool[n]);
+      accel->intersect_stream(next.data(), next_isects.data(), next_hit.get(),
+                            n);
+
+      std::vector<size_t> still_active;
+      for (size_t j = 0; j < n; j++) {
+        size_t k = active[j];
+        if (!next_hit[j])
+          continue;
+        if (isAccumBounces || next[j].depth == 0)
+          L[k] += T[k] * direct[j];
+        T[k] = T[k] * weight[j];
+        if (next[j].depth > 0) {
+          rays[k] = next[j];
+          isects[k] = next_isects[j];
+          still_active.push_back(k);
+        }
+      }
+      active.swap(still_active);
+    }
+
+    for (size_t k = 0; k < num_paths; k++)
+      radiance[k % num_pixels] += L[k];
+  }
+
+  size_t p = 0;
+  for (size_t y = y0; y < y1; y++) {
+    for (size_t x = x0; x < x1; x++, p++) {
+      sampleBuffer.update_pixel(radiance[p] / num_samples, x, y);
+      sampleCountBuffer[x + y * sampleBuffer.w] = num_samples;
+    }
+  }
+}
+
 void PathTracer::autofocus(Vector2D loc) {
   Ray r = camera->generate_ray(loc.x / sampleBuffer.w, loc.y / sampleBuffer.h);
   Intersection isect;
 
-  bvh->intersect(r, &isect);
+  accel->intersect(r, &isect);
 
   camera->focalDistance = isect.t;
 }
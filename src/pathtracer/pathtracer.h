@@ -16,6 +16,7 @@ using CGL::SceneObjects::Scene;
 #include "scene/environment_light.h"
 using CGL::SceneObjects::EnvironmentLight;
 
+using CGL::SceneObjects::Aggregate;
 using CGL::SceneObjects::BVHAccel;
 using CGL::SceneObjects::BVHNode;
 
@@ -58,6 +59,8 @@ public:
                                       const SceneObjects::Intersection &isect);
   Vector3D hit_fog(const Ray &r, const SceneObjects::Intersection &isect);
   Vector3D est_radiance_global_illumination(const Ray &r);
+  Vector3D est_radiance_global_illumination(
+      const Ray &r, const SceneObjects::Intersection &isect);
   Vector3D zero_bounce_radiance(const Ray &r,
                                 const SceneObjects::Intersection &isect);
   Vector3D one_bounce_radiance(const Ray &r,
@@ -66,6 +69,25 @@ public:
   at_least_one_bounce_radiance(const Ray &r,
                                const SceneObjects::Intersection &isect);
 
+  /**
+   * March a ray through the fog up to its hit.
+   * \param r ray whose max_t is the distance to its hit
+   * \param transmission set to the fraction of the hit's radiance that
+   *        passes through the fog
+   * \return radiance scattered toward the ray origin by the fog
+   */
+  Vector3D fog_scattering(const Ray &r, float *transmission);
+
+  /**
+   * Sample the bounce leaving a hit as at_least_one_bounce_radiance does.
+   * \param r ray that reached the hit
+   * \param isect the hit
+   * \param weight set to the brdf times cosine over the pdf of the bounce
+   * \return the bounce, one depth shorter than r
+   */
+  Ray sample_bounce(const Ray &r, const SceneObjects::Intersection &isect,
+                    Vector3D *weight);
+
   Vector3D debug_shading(const Vector3D d) {
     return Vector3D(abs(d.r), abs(d.g), .0).unit();
   }
@@ -77,6 +99,30 @@ public:
    */
   void raytrace_pixel(size_t x, size_t y);
 
+  /**
+   * Trace the camera rays of a block of pixels as packets.
+   * Sample i of every pixel in the block goes into the same packet, which
+   * is intersected with Aggregate::intersect_packet before each hit is shaded
+   * as in raytrace_pixel. The block may hold at most RAY_PACKET_SIZE pixels.
+   * \param x0 first column of the block
+   * \param y0 first row of the block
+   * \param x1 column past the end of the block
+   * \param y1 row past the end of the block
+   */
+  void raytrace_packet(size_t x0, size_t y0, size_t x1, size_t y1);
+
+  /**
+   * Trace the paths of a block of pixels one bounce at a time.
+   * The rays of all live paths at the same bounce are traced together with
+   * Aggregate::intersect_stream, which the BVH sorts into coherent bins, and
+   * each pixel is shaded as in raytrace_pixel up to noise.
+   * \param x0 first column of the block
+   * \param y0 first row of the block
+   * \param x1 column past the block
+   * \param y1 row past the block
+   */
+  void raytrace_stream(size_t x0, size_t y0, size_t x1, size_t y1);
+
   // Integrator sampling settings //
 
   size_t max_ray_depth;  ///< maximum allowed ray depth (applies to all rays)
@@ -86,6 +132,10 @@ public:
   size_t ns_diff;       ///< number of samples - diffuse surfaces
   size_t ns_glsy;       ///< number of samples - glossy surfaces
   size_t ns_refr;       ///< number of samples - refractive surfaces
+  size_t packet_size;   ///< side of the pixel blocks whose camera rays are
+                        ///< traced as packets, 0 to trace them one by one
+  bool stream_rays;     ///< trace the rays of a tile as sorted streams
+  size_t stream_paths;  ///< most paths traced together in one stream
 
   size_t samplesPerBatch;
   double maxTolerance;
@@ -95,7 +145,7 @@ public:
 
   // Components //
 
-  BVHAccel *bvh;                ///< BVH accelerator aggregate
+  Aggregate *accel;             ///< accelerator the rays are traced against
   EnvironmentLight *envLight;   ///< environment map
   Sampler2D *gridSampler;       ///< samples unit grid
   Sampler3D *hemisphereSampler; ///< samples unit hemisphere
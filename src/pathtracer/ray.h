@@ -6,6 +6,10 @@
 #include "CGL/vector3D.h"
 #include "CGL/vector4D.h"
 
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
 #define PART 4
 
 #define PART_1 (PART >= 1)
@@ -25,6 +29,7 @@ struct Ray {
   mutable double max_t; ///< treat the ray as a segment (ray "ends" at max_t)
 
   Vector3D inv_d; ///< component wise inverse
+  int sign[3];    ///< 1 where the direction component is negative
 
   // Ray() {}
 
@@ -38,6 +43,9 @@ struct Ray {
   Ray(const Vector3D o, const Vector3D d, int depth = 0)
       : o(o), d(d), min_t(EPS_F), max_t(INF_D), depth(depth) {
     inv_d = 1.0 / d;
+    sign[0] = inv_d.x < 0;
+    sign[1] = inv_d.y < 0;
+    sign[2] = inv_d.z < 0;
   }
 
   /**
@@ -51,6 +59,9 @@ struct Ray {
   Ray(const Vector3D o, const Vector3D d, double max_t, int depth = 0)
       : o(o), d(d), min_t(EPS_F), max_t(max_t), depth(depth) {
     inv_d = 1.0 / d;
+    sign[0] = inv_d.x < 0;
+    sign[1] = inv_d.y < 0;
+    sign[2] = inv_d.z < 0;
   }
 
   /**
@@ -68,6 +79,41 @@ struct Ray {
   }
 };
 
+/**
+ * Origin for a ray leaving a surface point.
+ * The point is moved off the surface, to the side the ray leaves towards,
+ * by a fixed number of float units in the last place per coordinate, so the
+ * ray cannot hit the surface it starts from whatever the magnitude of the
+ * coordinates (Waechter and Binder, "A Fast and Robust Method for Avoiding
+ * Self-Intersection", Ray Tracing Gems). The offset is sized for float hit
+ * points and also covers double ones. Coordinates close to zero, where the
+ * units in the last place get tiny, move by a fixed distance instead. Rays
+ * from the returned origin can start at min_t = 0.
+ * \param p point on the surface
+ * \param n surface normal at p
+ * \param w direction of the ray
+ * \return the origin of the ray
+ */
+inline Vector3D offset_ray_origin(const Vector3D &p, const Vector3D &n,
+                                  const Vector3D &w) {
+  const double origin = 1.0 / 32, float_scale = 1.0 / 65536, int_scale = 256;
+  Vector3D m = dot(n, w) < 0 ? -n : n;
+  Vector3D out;
+  for (int a = 0; a < 3; a++) {
+    if (std::fabs(p[a]) < origin) {
+      out[a] = p[a] + float_scale * m[a];
+      continue;
+    }
+    float x = (float)p[a];
+    int32_t bits, offset = int32_t(int_scale * m[a]);
+    std::memcpy(&bits, &x, sizeof(x));
+    bits += x < 0 ? -offset : offset;
+    std::memcpy(&x, &bits, sizeof(x));
+    out[a] = x;
+  }
+  return out;
+}
+
 // structure used for logging rays for subsequent visualization
 struct LoggedRay {
 
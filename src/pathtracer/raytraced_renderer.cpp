@@ -6,6 +6,7 @@
 #include <random>
 #include <algorithm>
 #include <sstream>
+#include <typeinfo>
 
 #include "CGL/CGL.h"
 #include "CGL/vector3D.h"
@@ -16,6 +17,7 @@
 
 #include "scene/sphere.h"
 #include "scene/triangle.h"
+#include "scene/instance.h"
 #include "scene/light.h"
 
 using namespace CGL::SceneObjects;
@@ -47,7 +49,12 @@ RaytracedRenderer::RaytracedRenderer(size_t ns_aa,
                        bool direct_hemisphere_sample,
                        string filename,
                        double lensRadius,
-                       double focalDistance) {
+                       double focalDistance,
+                       BVHBuildOptions bvh_options,
+                       string stats_filename,
+                       size_t packet_size,
+                       bool stream_rays,
+                       AcceleratorType accelerator) {
   state = INIT;
 
   pt = new PathTracer();
@@ -62,11 +69,18 @@ RaytracedRenderer::RaytracedRenderer(size_t ns_aa,
   pt->samplesPerBatch = samples_per_batch;                  // Number of samples per batch
   pt->maxTolerance = max_tolerance;                         // Maximum tolerance for early termination
   pt->direct_hemisphere_sample = direct_hemisphere_sample;  // Whether to use direct hemisphere sampling vs. Importance Sampling
+  pt->packet_size = packet_size;                            // Side of the pixel blocks traced as ray packets
+  pt->stream_rays = stream_rays;                            // Whether the rays of a tile are traced as sorted streams
 
   this->lensRadius = lensRadius;
   this->focalDistance = focalDistance;
 
   this->filename = filename;
+  this->bvh_options = bvh_options;
+  this->bvh_options.num_threads = num_threads; // build with the render threads
+  this->accelerator = accelerator;
+  this->stats_filename = stats_filename;
+  accel_build_time = 0;
 
   if (envmap) {
     pt->envLight = new EnvironmentLight(envmap);
@@ -74,8 +88,10 @@ RaytracedRenderer::RaytracedRenderer(size_t ns_aa,
     pt->envLight = NULL;
   }
 
+  accel = NULL;
   bvh = NULL;
   scene = NULL;
+  previous_scene = NULL;
   camera = NULL;
 
   show_rays = true;
@@ -91,7 +107,7 @@ RaytracedRenderer::RaytracedRenderer(size_t ns_aa,
  */
 RaytracedRenderer::~RaytracedRenderer() {
 
-  delete bvh;
+  free_accel();
   delete pt;
 
 }
@@ -111,16 +127,24 @@ void RaytracedRenderer::set_scene(Scene *scene) {
 
   if (this->scene != nullptr) {
     delete scene;
-    delete bvh;
+    free_accel();
     selectionHistory.pop();
   }
 
-  if (pt->envLight != nullptr) {
-    scene->lights.push_back(pt->envLight);
+  if (previous_scene && refit_accel(scene)) {
+    // the edits only moved vertices, which now are in the kept scene
+    delete scene;
+    this->scene = previous_scene;
+    selectionHistory.push(bvh->get_root());
+  } else {
+    free_accel();
+    if (pt->envLight != nullptr) {
+      scene->lights.push_back(pt->envLight);
+    }
+    this->scene = scene;
+    build_accel();
   }
-
-  this->scene = scene;
-  build_accel();
+  previous_scene = NULL;
 
   if (has_valid_configuration()) {
     state = READY;
@@ -240,8 +264,9 @@ void RaytracedRenderer::stop() {
  */
 void RaytracedRenderer::clear() {
   if (state != READY) return;
-  delete bvh;
-  bvh = NULL;
+  // the scene and its accelerators are kept until the next set_scene, which
+  // refits them if the scene was only deformed in the meantime
+  previous_scene = scene;
   scene = NULL;
   camera = NULL;
   selectionHistory.pop();
@@ -255,11 +280,18 @@ void RaytracedRenderer::clear() {
 /**
  * If the pathtracer is in READY, transition to VISUALIZE.
  */
-void RaytracedRenderer::start_visualizing() {
+bool RaytracedRenderer::start_visualizing() {
   if (state != READY) {
-    return;
+    return false;
+  }
+  if (!bvh) {
+    fprintf(stdout, "[PathTracer] Only the BVH can be visualized, "
+            "the %s accelerator has no BVH nodes.\n",
+            SceneObjects::accelerator_type_name(accelerator));
+    return false;
   }
   state = VISUALIZE;
+  return true;
 }
 
 /**
@@ -281,7 +313,7 @@ void RaytracedRenderer::start_raytracing() {
   pt->clear();
   pt->set_frame_size(width, height);
 
-  pt->bvh = bvh;
+  pt->accel = accel;
   pt->camera = camera;
   pt->scene = scene;
 
@@ -320,7 +352,7 @@ void RaytracedRenderer::start_raytracing() {
     }
   }
 
-  bvh->total_isects = 0; bvh->total_rays = 0;
+  render_stats.clear();
   // launch threads
   fprintf(stdout, "[PathTracer] Rendering... "); fflush(stdout);
   for (int i=0; i<numWorkerThreads; i++) {
@@ -353,27 +385,197 @@ void RaytracedRenderer::build_accel() {
   // collect primitives //
   fprintf(stdout, "[PathTracer] Collecting primitives... "); fflush(stdout);
   timer.start();
+
+  // meshes placed by instances get their own BVH, built once and shared
+  std::map<const Mesh *, BVHAccel *> shared;
+  for (SceneObject *obj : scene->objects) {
+    if (MeshInstance *inst = dynamic_cast<MeshInstance *>(obj))
+      shared[inst->get_mesh()] = NULL;
+  }
+
   vector<Primitive *> primitives;
+  size_t num_instances = 0;
   for (SceneObject *obj : scene->objects) {
-    const vector<Primitive *> &obj_prims = obj->get_primitives();
-    primitives.reserve(primitives.size() + obj_prims.size());
-    primitives.insert(primitives.end(), obj_prims.begin(), obj_prims.end());
+    MeshInstance *inst = dynamic_cast<MeshInstance *>(obj);
+    const Mesh *mesh = inst ? inst->get_mesh() : dynamic_cast<Mesh *>(obj);
+    if (!mesh || !shared.count(mesh)) {
+      const vector<Primitive *> &obj_prims = obj->get_primitives();
+      primitives.reserve(primitives.size() + obj_prims.size());
+      primitives.insert(primitives.end(), obj_prims.begin(), obj_prims.end());
+      if (mesh)
+        mesh_primitives[mesh] = obj_prims;
+      continue;
+    }
+
+    BVHAccel *&blas = shared[mesh];
+    if (!blas) {
+      const vector<Primitive *> &mesh_prims = mesh->get_primitives();
+      if (mesh_prims.empty())
+        continue;
+      mesh_primitives[mesh] = mesh_prims;
+      blas = new BVHAccel(mesh_prims, bvh_options);
+      instance_bvhs.push_back(blas);
+    }
+    if (inst) {
+      instances.push_back(new BVHInstance(blas, inst->get_transform(),
+                                          inst->get_bsdf()));
+    } else {
+      instances.push_back(new BVHInstance(blas, Matrix4x4::identity()));
+    }
+    primitives.push_back(instances.back());
+    num_instances++;
   }
   timer.stop();
   fprintf(stdout, "Done! (%.4f sec)\n", timer.duration());
+  if (num_instances) {
+    fprintf(stdout, "[PathTracer] Placed %lu instances of %lu shared meshes.\n",
+            num_instances, instance_bvhs.size());
+  }
+  size_t triangle_bytes = 0, num_triangles = 0;
+  for (const auto &entry : mesh_primitives) {
+    triangle_bytes += entry.first->get_triangles()->memory_bytes();
+    num_triangles += entry.first->get_triangles()->size();
+  }
+  if (num_triangles) {
+    fprintf(stdout, "[PathTracer] Triangles use %.2f MB, %.1f bytes per "
+            "triangle.\n", triangle_bytes / (1024.0 * 1024.0),
+            (double)triangle_bytes / num_triangles);
+  }
+
+  if (accelerator != SceneObjects::ACCEL_BVH) {
+    build_other_accel(primitives);
+    return;
+  }
 
   // build BVH //
-  fprintf(stdout, "[PathTracer] Building BVH from %lu primitives... ", primitives.size()); 
+  fprintf(stdout, "[PathTracer] Building BVH from %lu primitives on %lu threads... ",
+          primitives.size(), bvh_options.num_threads);
   fflush(stdout);
   timer.start();
-  bvh = new BVHAccel(primitives);
+  bvh = new BVHAccel(primitives, bvh_options);
+  accel = bvh;
   timer.stop();
-  fprintf(stdout, "Done! (%.4f sec)\n", timer.duration());
+  accel_build_time = timer.duration();
+  fprintf(stdout, "Done! (%.4f sec%s)\n", timer.duration(),
+          bvh->loaded_from_cache() ? ", loaded from cache" : "");
+  bvh_report = bvh->quality_report();
+  fprintf(stdout, "[PathTracer] BVH SAH cost %.4f (%s builder, %s wide, "
+          "%s layout).\n",
+          bvh_report.sah_cost, bvh_build_method_name(bvh_options.method),
+          bvh_node_format_name(bvh_options.node_format),
+          bvh_node_layout_name(bvh_options.node_layout));
+  fprintf(stdout, "[PathTracer] BVH has %lu nodes and %lu leaves (%.2f "
+          "primitives per leaf, max depth %lu, mean child overlap %.1f%%).\n",
+          bvh_report.num_nodes, bvh_report.num_leaves,
+          bvh_report.mean_leaf_size, bvh_report.max_depth,
+          bvh_report.mean_overlap * 100);
+  size_t bvh_bytes = bvh_report.node_bytes + bvh_report.tree_bytes +
+                     bvh_report.reference_bytes;
+  double per_primitive = 1.0 / max<size_t>(bvh_report.num_primitives, 1);
+  fprintf(stdout, "[PathTracer] BVH uses %.2f MB, %.1f bytes per primitive "
+          "(%.1f in traversal nodes, %.1f in the build tree, %.1f in "
+          "primitive references).\n",
+          bvh_bytes / (1024.0 * 1024.0), bvh_bytes * per_primitive,
+          bvh_report.node_bytes * per_primitive,
+          bvh_report.tree_bytes * per_primitive,
+          bvh_report.reference_bytes * per_primitive);
 
   // initial visualization //
   selectionHistory.push(bvh->get_root());
 }
 
+void RaytracedRenderer::build_other_accel(const vector<Primitive *> &primitives) {
+  bool kdtree = accelerator == SceneObjects::ACCEL_KDTREE;
+  const char *name = kdtree ? "kd-tree" : "grid";
+  fprintf(stdout, "[PathTracer] Building %s from %lu primitives... ", name,
+          primitives.size());
+  fflush(stdout);
+  timer.start();
+  if (kdtree) {
+    SceneObjects::KdTreeAccel *tree = new SceneObjects::KdTreeAccel(primitives);
+    accel = tree;
+    timer.stop();
+    fprintf(stdout, "Done! (%.4f sec)\n", timer.duration());
+    fprintf(stdout, "[PathTracer] Kd-tree has %lu nodes and %lu primitive "
+            "references (%.2f per primitive).\n",
+            tree->num_nodes(), tree->num_references(),
+            (double)tree->num_references() /
+                max<size_t>(primitives.size(), 1));
+  } else {
+    SceneObjects::UniformGridAccel *grid =
+        new SceneObjects::UniformGridAccel(primitives);
+    accel = grid;
+    timer.stop();
+    fprintf(stdout, "Done! (%.4f sec)\n", timer.duration());
+    const int *res = grid->resolution();
+    fprintf(stdout, "[PathTracer] Grid has %d x %d x %d cells and %lu "
+            "primitive references (%.2f per primitive).\n",
+            res[0], res[1], res[2], grid->num_references(),
+            (double)grid->num_references() /
+                max<size_t>(primitives.size(), 1));
+  }
+  accel_build_time = timer.duration();
+
+  size_t bytes = accel->memory_bytes();
+  fprintf(stdout, "[PathTracer] %s uses %.2f MB, %.1f bytes per "
+          "primitive.\n", kdtree ? "Kd-tree" : "Grid",
+          bytes / (1024.0 * 1024.0),
+          (double)bytes / max<size_t>(primitives.size(), 1));
+
+  // the visualizer walks BVH nodes, there are none to show
+  selectionHistory.push(NULL);
+}
+
+void RaytracedRenderer::free_accel() {
+  delete accel;
+  accel = NULL;
+  bvh = NULL;
+  for (BVHAccel *blas : instance_bvhs)
+    delete blas;
+  instance_bvhs.clear();
+  for (BVHInstance *instance : instances)
+    delete instance;
+  instances.clear();
+  mesh_primitives.clear();
+}
+
+bool RaytracedRenderer::refit_accel(Scene *edited) {
+  const vector<SceneObject *> &objects = previous_scene->objects;
+  if (!bvh || objects.size() != edited->objects.size())
+    return false;
+  for (size_t i = 0; i < objects.size(); i++) {
+    if (typeid(*objects[i]) != typeid(*edited->objects[i]))
+      return false;
+    const Mesh *mesh = dynamic_cast<const Mesh *>(objects[i]);
+    if (mesh && !mesh->same_topology(*(const Mesh *)edited->objects[i]))
+      return false;
+  }
+
+  fprintf(stdout, "[PathTracer] Refitting BVH to edited vertices... ");
+  fflush(stdout);
+  timer.start();
+  for (size_t i = 0; i < objects.size(); i++) {
+    Mesh *mesh = dynamic_cast<Mesh *>(objects[i]);
+    if (mesh && mesh_primitives.count(mesh)) {
+      mesh->update_vertices(*(const Mesh *)edited->objects[i]);
+    }
+  }
+  size_t rebuilt = 0;
+  for (BVHAccel *blas : instance_bvhs)
+    rebuilt += blas->refit();
+  for (BVHInstance *instance : instances)
+    instance->refit();
+  rebuilt += bvh->refit();
+  timer.stop();
+  accel_build_time = timer.duration();
+  fprintf(stdout, "Done! (%.4f sec, %lu subtrees rebuilt)\n",
+          timer.duration(), rebuilt);
+  bvh_report = bvh->quality_report();
+  fprintf(stdout, "[PathTracer] BVH SAH cost %.4f after refit.\n",
+          bvh_report.sah_cost);
+  return true;
+}
+
 void RaytracedRenderer::visualize_accel() const {
 
   glPushAttrib(GL_ENABLE_BIT);
@@ -559,17 +761,19 @@ void RaytracedRenderer::key_press(int key) {
     fprintf(stdout, "[PathTracer] Camera focal distance increased to %f.\n", pt->camera->focalDistance);
     break;
   case KEYBOARD_UP:
+    // the kd-tree and grid have no BVH nodes to walk
+    if (!bvh || !current) break;
     if (current != bvh->get_root()) {
         selectionHistory.pop();
     }
     break;
   case KEYBOARD_LEFT:
-    if (current->l) {
+    if (current && current->l) {
         selectionHistory.push(current->l);
     }
     break;
   case KEYBOARD_RIGHT:
-    if (current->l) {
+    if (current && current->l) {
         selectionHistory.push(current->r);
     }
     break;
@@ -608,10 +812,24 @@ void RaytracedRenderer::raytrace_tile(int tile_x, int tile_y,
   size_t tile_idx_y = tile_y / imageTileSize;
   size_t num_samples_tile = tile_samples[tile_idx_x + tile_idx_y * num_tiles_w];
 
-  for (size_t y = tile_start_y; y < tile_end_y; y++) {
+  size_t packet = pt->packet_size;
+  if (pt->stream_rays) {
     if (!continueRaytracing) return;
-    for (size_t x = tile_start_x; x < tile_end_x; x++) {
-      pt->raytrace_pixel(x, y);
+    pt->raytrace_stream(tile_start_x, tile_start_y, tile_end_x, tile_end_y);
+  } else if (packet) {
+    for (size_t y = tile_start_y; y < tile_end_y; y += packet) {
+      if (!continueRaytracing) return;
+      for (size_t x = tile_start_x; x < tile_end_x; x += packet) {
+        pt->raytrace_packet(x, y, std::min(x + packet, tile_end_x),
+                            std::min(y + packet, tile_end_y));
+      }
+    }
+  } else {
+    for (size_t y = tile_start_y; y < tile_end_y; y++) {
+      if (!continueRaytracing) return;
+      for (size_t x = tile_start_x; x < tile_end_x; x++) {
+        pt->raytrace_pixel(x, y);
+      }
     }
   }
 
@@ -657,6 +875,8 @@ void RaytracedRenderer::worker_thread() {
   Timer timer;
   timer.start();
 
+  BVHAccel::thread_stats().clear();
+
   WorkItem work;
   while (continueRaytracing && workQueue.try_get_work(&work)) {
     raytrace_tile(work.tile_x, work.tile_y, work.tile_w, work.tile_h);
@@ -668,6 +888,11 @@ void RaytracedRenderer::worker_thread() {
     }
   }
 
+  {
+    lock_guard<std::mutex> lk(m_done);
+    render_stats.add(BVHAccel::thread_stats());
+  }
+
   workerDoneCount++;
   if (!continueRaytracing && workerDoneCount == numWorkerThreads) {
     timer.stop();
@@ -678,9 +903,7 @@ void RaytracedRenderer::worker_thread() {
   if (continueRaytracing && workerDoneCount == numWorkerThreads) {
     timer.stop();
     fprintf(stdout, "\r[PathTracer] Rendering... 100%%! (%.4fs)\n", timer.duration());
-    fprintf(stdout, "[PathTracer] BVH traced %llu rays.\n", bvh->total_rays);
-    fprintf(stdout, "[PathTracer] Average speed %.4f million rays per second.\n", (double)bvh->total_rays / timer.duration() * 1e-6);
-    fprintf(stdout, "[PathTracer] Averaged %f intersection tests per ray.\n", (((double)bvh->total_isects)/bvh->total_rays));
+    report_stats(timer.duration());
 
     lock_guard<std::mutex> lk(m_done);
     state = DONE;
@@ -688,6 +911,112 @@ void RaytracedRenderer::worker_thread() {
   }
 }
 
+/**
+ * Name of an accelerator in the log.
+ */
+static const char* accelerator_title(AcceleratorType type) {
+  switch (type) {
+  case SceneObjects::ACCEL_KDTREE:
+    return "Kd-tree";
+  case SceneObjects::ACCEL_GRID:
+    return "Grid";
+  default:
+    return "BVH";
+  }
+}
+
+/**
+ * Smallest depth below which at least the given fraction of the queries in
+ * a depth histogram stopped.
+ */
+static int depth_percentile(const BVHTraversalStats& stats, double fraction) {
+  double count = 0;
+  for (int d = 0; d < BVH_MAX_DEPTH; d++) {
+    count += stats.depth_histogram[d];
+    if (count >= fraction * stats.rays)
+      return d;
+  }
+  return BVH_MAX_DEPTH - 1;
+}
+
+void RaytracedRenderer::report_stats(double seconds) const {
+  const BVHTraversalStats& s = render_stats;
+  double rays = s.rays ? (double)s.rays : 1.0;
+  double depth_sum = 0;
+  int max_depth = 0;
+  for (int d = 0; d < BVH_MAX_DEPTH; d++) {
+    depth_sum += (double)d * s.depth_histogram[d];
+    if (s.depth_histogram[d])
+      max_depth = d;
+  }
+
+  fprintf(stdout, "[PathTracer] %s traced %llu rays.\n",
+          accelerator_title(accelerator), s.rays);
+  fprintf(stdout, "[PathTracer] Average speed %.4f million rays per second.\n", (double)s.rays / seconds * 1e-6);
+  fprintf(stdout, "[PathTracer] Averaged %f intersection tests per ray.\n", s.primitive_tests / rays);
+  fprintf(stdout, "[PathTracer] Averaged %f node visits and %f box tests per ray.\n", s.node_visits / rays, s.box_tests / rays);
+  fprintf(stdout, "[PathTracer] Averaged %f node visits saved per ray by ordered traversal.\n", s.culled / rays);
+  // grid cells have no depth
+  if (accelerator != SceneObjects::ACCEL_GRID) {
+    fprintf(stdout, "[PathTracer] Traversal depth mean %.2f, median %d, 95th percentile %d, max %d.\n",
+            depth_sum / rays, depth_percentile(s, 0.5),
+            depth_percentile(s, 0.95), max_depth);
+  }
+
+  if (stats_filename.empty()) return;
+  FILE* file = fopen(stats_filename.c_str(), "w");
+  if (!file) {
+    fprintf(stderr, "[PathTracer] Could not write statistics to %s\n",
+            stats_filename.c_str());
+    return;
+  }
+  const BVHQualityReport& q = bvh_report;
+  fprintf(file, "{\n");
+  fprintf(file, "  \"accelerator\": {\n");
+  fprintf(file, "    \"type\": \"%s\",\n", accelerator_type_name(accelerator));
+  fprintf(file, "    \"build_seconds\": %.6f,\n", accel_build_time);
+  fprintf(file, "    \"memory_bytes\": %lu\n", accel->memory_bytes());
+  fprintf(file, "  },\n");
+  if (bvh) {
+    fprintf(file, "  \"bvh\": {\n");
+    fprintf(file, "    \"builder\": \"%s\",\n", bvh_build_method_name(bvh_options.method));
+    fprintf(file, "    \"width\": \"%s\",\n", bvh_node_format_name(bvh_options.node_format));
+    fprintf(file, "    \"layout\": \"%s\",\n", bvh_node_layout_name(bvh_options.node_layout));
+    fprintf(file, "    \"build_seconds\": %.6f,\n", accel_build_time);
+    fprintf(file, "    \"sah_cost\": %.6f,\n", q.sah_cost);
+    fprintf(file, "    \"nodes\": %lu,\n", q.num_nodes);
+    fprintf(file, "    \"leaves\": %lu,\n", q.num_leaves);
+    fprintf(file, "    \"references\": %lu,\n", q.num_references);
+    fprintf(file, "    \"max_depth\": %lu,\n", q.max_depth);
+    fprintf(file, "    \"mean_leaf_depth\": %.6f,\n", q.mean_leaf_depth);
+    fprintf(file, "    \"mean_leaf_size\": %.6f,\n", q.mean_leaf_size);
+    fprintf(file, "    \"mean_overlap\": %.6f,\n", q.mean_overlap);
+    fprintf(file, "    \"max_overlap\": %.6f,\n", q.max_overlap);
+    fprintf(file, "    \"primitives\": %lu,\n", q.num_primitives);
+    fprintf(file, "    \"node_bytes\": %lu,\n", q.node_bytes);
+    fprintf(file, "    \"tree_bytes\": %lu,\n", q.tree_bytes);
+    fprintf(file, "    \"reference_bytes\": %lu,\n", q.reference_bytes);
+    fprintf(file, "    \"leaf_sizes\": [");
+    for (size_t i = 0; i < q.leaf_sizes.size(); i++)
+      fprintf(file, "%s%lu", i ? ", " : "", q.leaf_sizes[i]);
+    fprintf(file, "]\n  },\n");
+  }
+  fprintf(file, "  \"traversal\": {\n");
+  fprintf(file, "    \"render_seconds\": %.6f,\n", seconds);
+  fprintf(file, "    \"rays\": %llu,\n", s.rays);
+  fprintf(file, "    \"rays_per_second\": %.1f,\n", s.rays / seconds);
+  fprintf(file, "    \"node_visits\": %llu,\n", s.node_visits);
+  fprintf(file, "    \"box_tests\": %llu,\n", s.box_tests);
+  fprintf(file, "    \"primitive_tests\": %llu,\n", s.primitive_tests);
+  fprintf(file, "    \"culled\": %llu,\n", s.culled);
+  fprintf(file, "    \"depth_histogram\": [");
+  for (int d = 0; d <= max_depth; d++)
+    fprintf(file, "%s%llu", d ? ", " : "", s.depth_histogram[d]);
+  fprintf(file, "]\n  }\n}\n");
+  fclose(file);
+  fprintf(stdout, "[PathTracer] Wrote statistics to %s\n", stats_filename.c_str());
+}
+
 void RaytracedRenderer::save_image(string filename, ImageBuffer* buffer) {
 
   if (state != DONE) return;
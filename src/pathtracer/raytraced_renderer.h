@@ -7,11 +7,16 @@
 #include <mutex>
 #include <condition_variable>
 #include <vector>
+#include <map>
 #include <algorithm>
 
 #include "CGL/timer.h"
 
 #include "scene/bvh.h"
+#include "scene/grid.h"
+#include "scene/kdtree.h"
+#include "scene/instance.h"
+#include "scene/object.h"
 #include "pathtracer/camera.h"
 #include "pathtracer/sampler.h"
 #include "util/image.h"
@@ -26,8 +31,16 @@ using CGL::SceneObjects::Scene;
 #include "scene/environment_light.h"
 using CGL::SceneObjects::EnvironmentLight;
 
+using CGL::SceneObjects::AcceleratorType;
+using CGL::SceneObjects::Aggregate;
 using CGL::SceneObjects::BVHNode;
 using CGL::SceneObjects::BVHAccel;
+using CGL::SceneObjects::BVHBuildOptions;
+using CGL::SceneObjects::BVHQualityReport;
+using CGL::SceneObjects::BVHTraversalStats;
+using CGL::SceneObjects::BVHInstance;
+using CGL::SceneObjects::Mesh;
+using CGL::SceneObjects::Primitive;
 
 #include "pathtracer.h"
 
@@ -74,7 +87,12 @@ public:
              bool direct_hemisphere_sample = false,
              string filename = "",
              double lensRadius = 0.25,
-             double focalDistance = 4.7);
+             double focalDistance = 4.7,
+             BVHBuildOptions bvh_options = BVHBuildOptions(),
+             string stats_filename = "",
+             size_t packet_size = 0,
+             bool stream_rays = false,
+             AcceleratorType accelerator = SceneObjects::ACCEL_BVH);
 
   /**
    * Destructor.
@@ -134,8 +152,10 @@ public:
 
   /**
    * If the pathtracer is in READY, transition to VISUALIZE.
+   * \return true if the renderer is now visualizing, false if it was not
+   *         READY or the accelerator is not a BVH
    */
-  void start_visualizing();
+  bool start_visualizing();
 
   /**
    * If the pathtracer is in READY, transition to RENDERING.
@@ -170,9 +190,35 @@ public:
 
   /**
    * Build acceleration structures.
+   * Meshes placed by MeshInstance objects get one shared BVH each, which the
+   * top level accelerator references through BVHInstance primitives. The top
+   * level is a BVH, kd-tree or grid depending on the accelerator setting.
    */
   void build_accel();
 
+  /**
+   * Build the kd-tree or grid top level accelerator over the collected
+   * primitives and report its size.
+   * \param primitives primitives of the top level, with the BVHInstances
+   */
+  void build_other_accel(const std::vector<Primitive*>& primitives);
+
+  /**
+   * Delete the acceleration structures built by build_accel.
+   */
+  void free_accel();
+
+  /**
+   * Refit the acceleration structures of the scene kept by clear() to an
+   * edited copy of it. Only possible when the edits moved vertices without
+   * changing the topology of any mesh; the new positions are copied into the
+   * kept scene.
+   * \param edited static scene converted after the edits
+   * \return true if the kept scene was updated, false if nothing was changed
+   *         and the accelerators need to be rebuilt
+   */
+  bool refit_accel(Scene *edited);
+
   /**
    * Visualize acceleration structures.
    */
@@ -191,6 +237,13 @@ public:
    */
   void worker_thread();
 
+  /**
+   * Print the traversal statistics of a finished render and write them,
+   * with the BVH quality report, to stats_filename if one was given.
+   * \param seconds render time
+   */
+  void report_stats(double seconds) const;
+
   enum State {
     INIT,               ///< to be initialized
     READY,              ///< initialized ready to do stuff
@@ -220,9 +273,22 @@ public:
 
   // Components //
 
-  BVHAccel* bvh;                 ///< BVH accelerator aggregate
+  Aggregate* accel;              ///< accelerator the rays are traced against
+  AcceleratorType accelerator;   ///< kind of accel to build
+  BVHAccel* bvh;                 ///< accel if it is a BVH, NULL otherwise;
+                                 ///< used for refitting and visualization
+  std::vector<BVHAccel*> instance_bvhs; ///< BVHs shared by mesh instances
+  std::vector<BVHInstance*> instances;  ///< placements of the shared BVHs
+  std::map<const Mesh*, std::vector<Primitive*> > mesh_primitives;
+                                 ///< triangles of each mesh, for refitting
+  Scene* previous_scene;         ///< scene kept by clear() for refitting
+  BVHBuildOptions bvh_options;   ///< BVH builder settings
   ImageBuffer frameBuffer;       ///< frame buffer
   Timer timer;                   ///< performance test timer
+  double accel_build_time;       ///< seconds spent building or refitting
+  BVHQualityReport bvh_report;   ///< quality of the current BVH
+  BVHTraversalStats render_stats; ///< traversal counters of all workers
+  std::string stats_filename;    ///< JSON statistics output, if not empty
 
   std::vector<int> sampleCountBuffer;   ///< sample count buffer
 
@@ -0,0 +1,58 @@
+#include "aggregate.h"
+
+namespace CGL {
+namespace SceneObjects {
+
+bool parse_accelerator_type(const std::string &name, AcceleratorType *type) {
+  if (name == "bvh") {
+    *type = ACCEL_BVH;
+  } else if (name == "kdtree") {
+    *type = ACCEL_KDTREE;
+  } else if (name == "grid") {
+    *type = ACCEL_GRID;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+const char *accelerator_type_name(AcceleratorType type) {
+  switch (type) {
+  case ACCEL_KDTREE:
+    return "kdtree";
+  case ACCEL_GRID:
+    return "grid";
+  default:
+    return "bvh";
+  }
+}
+
+bool Aggregate::occluded(const Ray &r, double t_max) const {
+  // primitives read the segment end from the ray itself
+  double saved_max_t = r.max_t;
+  r.max_t = t_max;
+  bool blocked = has_intersection(r);
+  r.max_t = saved_max_t;
+  return blocked;
+}
+
+void Aggregate::intersect_packet(const Ray *rays, Intersection *i, bool *hit,
+                                 size_t n) const {
+  for (size_t k = 0; k < n; k++)
+    hit[k] = intersect(rays[k], &i[k]);
+}
+
+void Aggregate::occluded_packet(const Ray *rays, bool *blocked,
+                                size_t n) const {
+  for (size_t k = 0; k < n; k++)
+    blocked[k] = occluded(rays[k], rays[k].max_t);
+}
+
+void Aggregate::intersect_stream(const Ray *rays, Intersection *i, bool *hit,
+                                 size_t n) const {
+  for (size_t k = 0; k < n; k++)
+    hit[k] = intersect(rays[k], &i[k]);
+}
+
+} // namespace SceneObjects
+} // namespace CGL
@@ -3,8 +3,32 @@
 
 #include "scene.h"
 
+#include <string>
+#include <vector>
+
 namespace CGL { namespace SceneObjects {
 
+/**
+ * Acceleration structures the renderer can trace against.
+ */
+enum AcceleratorType {
+  ACCEL_BVH,    ///< bounding volume hierarchy, BVHAccel
+  ACCEL_KDTREE, ///< SAH kd-tree, KdTreeAccel
+  ACCEL_GRID    ///< uniform grid, UniformGridAccel
+};
+
+/**
+ * Parse an accelerator name given on the command line ("bvh", "kdtree" or
+ * "grid").
+ * \return true if the name was recognized and written to type
+ */
+bool parse_accelerator_type(const std::string& name, AcceleratorType* type);
+
+/**
+ * Name of an accelerator as accepted by parse_accelerator_type.
+ */
+const char* accelerator_type_name(AcceleratorType type);
+
 /**
  * Aggregate provides an interface for grouping multiple primitives together.
  * Because Aggregate itself implements the Primitive interface, no special
@@ -17,6 +41,8 @@ namespace CGL { namespace SceneObjects {
 class Aggregate : public Primitive {
  public:
 
+  virtual ~Aggregate() { }
+
   // Implements Primitive //
 
   // NOTE (sky):
@@ -32,12 +58,69 @@ class Aggregate : public Primitive {
   /**
    * Get BSDF.
    * An aggregate should not have a surface material as it is not an actual
-   * primitive that we would want to render but an accelerator that we use to 
+   * primitive that we would want to render but an accelerator that we use to
    * speed up ray - primitive intersections. Therefore get_brdf should always
-   * return the null pointer for aggregates. 
+   * return the null pointer for aggregates.
    */
   BSDF* get_bsdf() const { return NULL; }
 
+  // Queries of the renderer //
+
+  // The renderer traces against these. The defaults answer them one ray at
+  // a time through intersect and has_intersection, accelerators override
+  // the ones they have a faster path for.
+
+  /**
+   * Ray - Aggregate occlusion query.
+   * Check if anything blocks the segment of the ray between r.min_t and
+   * t_max, without computing intersection information.
+   * \param r ray to test
+   * \param t_max end of the segment, typically the distance to the light
+   * \return true if the segment is blocked, false otherwise
+   */
+  virtual bool occluded(const Ray& r, double t_max) const;
+
+  /**
+   * Packet - Aggregate intersection.
+   * Finds the closest hits of up to RAY_PACKET_SIZE rays, the same as
+   * intersect on each ray.
+   * \param rays the rays, max_t of every ray that hits is shortened
+   * \param i address of an array of intersections, one per ray
+   * \param hit receives for every ray whether it hit
+   * \param n number of rays, at most RAY_PACKET_SIZE
+   */
+  virtual void intersect_packet(const Ray* rays, Intersection* i, bool* hit,
+                                size_t n) const;
+
+  /**
+   * Packet - Aggregate occlusion query.
+   * Checks up to RAY_PACKET_SIZE segments, each between r.min_t and r.max_t
+   * of its ray, like occluded.
+   * \param rays the rays, their max_t is the end of the segment to test
+   * \param blocked receives for every ray whether its segment is blocked
+   * \param n number of rays, at most RAY_PACKET_SIZE
+   */
+  virtual void occluded_packet(const Ray* rays, bool* blocked,
+                               size_t n) const;
+
+  /**
+   * Stream - Aggregate intersection.
+   * Finds the closest hits of a large batch of unrelated rays, the same as
+   * intersect on each ray.
+   * \param rays the rays, max_t of every ray that hits is shortened
+   * \param i address of an array of intersections, one per ray
+   * \param hit receives for every ray whether it hit
+   * \param n number of rays
+   */
+  virtual void intersect_stream(const Ray* rays, Intersection* i, bool* hit,
+                                size_t n) const;
+
+  /**
+   * Memory held by the acceleration structure, not counting the primitives.
+   * \return size in bytes
+   */
+  virtual size_t memory_bytes() const = 0;
+
 };
 
 
@@ -1,7 +1,6 @@
 #include "bbox.h"
 
 #include "GL/glew.h"
-#include <vector>
 
 #include <algorithm>
 #include <iostream>
@@ -9,26 +8,22 @@ namespace CGL {
 
 bool BBox::intersect(const Ray &r, double &t0, double &t1) const {
 
-  // TODO (Part 2.2):
-  // Implement ray - bounding box intersection test
-  // If the ray intersected the bouding box within the range given by
-  // t0, t1, update t0 and t1 with the new intersection times.
-  auto mn = std::vector<double>(3);
-  auto mx = std::vector<double>(3);
-  for (int i = 0; i < 3; i++) {
-    mn[i] = (min[i] - r.o[i]) / r.d[i];
-    mx[i] = (max[i] - r.o[i]) / r.d[i];
-    if (mn[i] > mx[i])
-      std::swap(mn[i], mx[i]);
+  // Slab test using the ray's cached inverse direction and sign bits: the
+  // entry plane on each axis is max where the direction is negative, min
+  // otherwise. A NaN slab distance (0 * inf) leaves the interval untouched.
+  const Vector3D *bounds[2] = {&min, &max};
+  double t_near = t0, t_far = t1;
+  for (int a = 0; a < 3; a++) {
+    double near = ((*bounds[r.sign[a]])[a] - r.o[a]) * r.inv_d[a];
+    double far = ((*bounds[1 - r.sign[a]])[a] - r.o[a]) * r.inv_d[a];
+    t_near = near > t_near ? near : t_near;
+    t_far = far < t_far ? far : t_far;
   }
-  auto min_t = *std::max_element(mn.begin(), mn.end());
-  auto max_t = *std::min_element(mx.begin(), mx.end());
-
-  if (min_t > max_t)
+  if (t_near > t_far)
     return false;
 
-  if (max_t < t0 || min_t > t1)
-    return false;
+  t0 = t_near;
+  t1 = t_far;
   return true;
 }
 
@@ -122,6 +122,7 @@ struct BBox {
   /**
    * Ray - bbox intersection.
    * Intersects ray with bounding box, does not store shading information.
+   * On a hit, t0 and t1 are narrowed to the entry and exit times.
    * \param r the ray to intersect with
    * \param t0 lower bound of intersection time
    * \param t1 upper bound of intersection time
@@ -2,31 +2,976 @@
 
 #include "CGL/CGL.h"
 #include "pathtracer/intersection.h"
+#include "ray_box.h"
+#include "sphere.h"
 #include "triangle.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
 #include <iostream>
 #include <stack>
+#include <thread>
 
 using namespace std;
 
 namespace CGL {
 namespace SceneObjects {
 
+bool parse_bvh_build_method(const std::string &name, BVHBuildMethod *method) {
+  if (name == "median") {
+    *method = BVH_BUILD_MEDIAN;
+  } else if (name == "sah") {
+    *method = BVH_BUILD_SAH;
+  } else if (name == "lbvh") {
+    *method = BVH_BUILD_LBVH;
+  } else if (name == "hlbvh") {
+    *method = BVH_BUILD_HLBVH;
+  } else if (name == "sbvh") {
+    *method = BVH_BUILD_SBVH;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+const char *bvh_build_method_name(BVHBuildMethod method) {
+  switch (method) {
+  case BVH_BUILD_MEDIAN:
+    return "median";
+  case BVH_BUILD_SAH:
+    return "sah";
+  case BVH_BUILD_LBVH:
+    return "lbvh";
+  case BVH_BUILD_HLBVH:
+    return "hlbvh";
+  case BVH_BUILD_SBVH:
+    return "sbvh";
+  }
+  return "unknown";
+}
+
+/**
+ * Split [start, end) into num_tasks contiguous chunks and run
+ * f(task, chunk_start, chunk_end) on each. The first chunk runs on the
+ * calling thread, every other chunk on its own std::thread.
+ */
+template <typename F>
+static void parallel_chunks(size_t start, size_t end, size_t num_tasks,
+                            const F &f) {
+  size_t size = end - start;
+  std::vector<std::thread> workers;
+  for (size_t t = 1; t < num_tasks; t++) {
+    workers.emplace_back(f, t, start + size * t / num_tasks,
+                         start + size * (t + 1) / num_tasks);
+  }
+  f(0, start, start + size / num_tasks);
+  for (std::thread &w : workers) {
+    w.join();
+  }
+}
+
+/**
+ * Number of chunks a range should be processed in so that every chunk holds
+ * at least parallel_cutoff primitives.
+ */
+static size_t chunk_count(size_t size, size_t threads, size_t cutoff) {
+  size_t tasks = std::min(threads, size / std::max<size_t>(cutoff, 1));
+  return std::max<size_t>(tasks, 1);
+}
+
+/**
+ * Threads given to the left child when forking, proportional to its share
+ * of the primitives. Both children get at least one.
+ */
+static size_t left_threads(size_t threads, size_t left_size, size_t size) {
+  size_t t = (size_t)(threads * (double)left_size / size + 0.5);
+  return std::min(std::max<size_t>(t, 1), threads - 1);
+}
+
+/**
+ * Bounds of the primitives and of their centroids over [start, end).
+ * Box union is exact, so the result does not depend on the chunking.
+ */
+static void compute_bounds(const std::vector<BVHBuildPrim> &refs, size_t start,
+                           size_t end, size_t num_tasks, BBox *bbox,
+                           BBox *centroid_box) {
+  std::vector<BBox> boxes(num_tasks), centroids(num_tasks);
+  parallel_chunks(start, end, num_tasks,
+                  [&](size_t t, size_t begin, size_t finish) {
+                    for (size_t i = begin; i < finish; i++) {
+                      boxes[t].expand(refs[i].bb);
+                      centroids[t].expand(refs[i].centroid);
+                    }
+                  });
+  for (size_t t = 0; t < num_tasks; t++) {
+    bbox->expand(boxes[t]);
+    centroid_box->expand(centroids[t]);
+  }
+}
+
+/**
+ * Stable partition of refs[start, end) by pred, in parallel chunks.
+ * Each chunk counts its left elements, and the prefix sums of these counts
+ * give every chunk its own output ranges, so the result is the same as
+ * std::stable_partition.
+ * \return index of the first element for which pred is false
+ */
+template <typename Pred>
+static size_t partition_refs(std::vector<BVHBuildPrim> &refs, size_t start,
+                             size_t end, size_t num_tasks, const Pred &pred) {
+  if (num_tasks <= 1) {
+    return std::stable_partition(refs.begin() + start, refs.begin() + end,
+                                 pred) -
+           refs.begin();
+  }
+
+  std::vector<size_t> left_count(num_tasks);
+  parallel_chunks(start, end, num_tasks,
+                  [&](size_t t, size_t begin, size_t finish) {
+                    size_t count = 0;
+                    for (size_t i = begin; i < finish; i++) {
+                      count += pred(refs[i]);
+                    }
+                    left_count[t] = count;
+                  });
+
+  size_t total_left = 0;
+  std::vector<size_t> left_before(num_tasks);
+  for (size_t t = 0; t < num_tasks; t++) {
+    left_before[t] = total_left;
+    total_left += left_count[t];
+  }
+
+  std::vector<BVHBuildPrim> out(end - start);
+  parallel_chunks(start, end, num_tasks,
+                  [&](size_t t, size_t begin, size_t finish) {
+                    size_t l = left_before[t];
+                    size_t r = total_left + (begin - start) - left_before[t];
+                    for (size_t i = begin; i < finish; i++) {
+                      if (pred(refs[i])) {
+                        out[l++] = refs[i];
+                      } else {
+                        out[r++] = refs[i];
+                      }
+                    }
+                  });
+  parallel_chunks(start, end, num_tasks,
+                  [&](size_t, size_t begin, size_t finish) {
+                    std::copy(out.begin() + (begin - start),
+                              out.begin() + (finish - start),
+                              refs.begin() + begin);
+                  });
+  return start + total_left;
+}
+
+bool parse_bvh_node_format(const std::string &width, BVHNodeFormat *format) {
+  if (width == "2") {
+    *format = BVH_NODE_BINARY;
+  } else if (width == "4") {
+    *format = BVH_NODE_WIDE4;
+  } else if (width == "8") {
+    *format = BVH_NODE_WIDE8;
+  } else if (width == "4q") {
+    *format = BVH_NODE_QUANTIZED4;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+const char *bvh_node_format_name(BVHNodeFormat format) {
+  switch (format) {
+  case BVH_NODE_BINARY:
+    return "2";
+  case BVH_NODE_WIDE4:
+    return "4";
+  case BVH_NODE_WIDE8:
+    return "8";
+  case BVH_NODE_QUANTIZED4:
+    return "4q";
+  }
+  return "unknown";
+}
+
+size_t bvh_node_size(BVHNodeFormat format) {
+  switch (format) {
+  case BVH_NODE_WIDE4:
+    return sizeof(WideBVHNode<4>);
+  case BVH_NODE_WIDE8:
+    return sizeof(WideBVHNode<8>);
+  case BVH_NODE_QUANTIZED4:
+    return sizeof(QuantizedBVHNode4);
+  default:
+    return sizeof(LinearBVHNode);
+  }
+}
+
+bool parse_bvh_node_layout(const std::string &name, BVHNodeLayout *layout) {
+  if (name == "dfs") {
+    *layout = BVH_LAYOUT_DEPTH_FIRST;
+  } else if (name == "treelet") {
+    *layout = BVH_LAYOUT_TREELET;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+const char *bvh_node_layout_name(BVHNodeLayout layout) {
+  switch (layout) {
+  case BVH_LAYOUT_DEPTH_FIRST:
+    return "dfs";
+  case BVH_LAYOUT_TREELET:
+    return "treelet";
+  }
+  return "unknown";
+}
+
 BVHAccel::BVHAccel(const std::vector<Primitive *> &_primitives,
-                   size_t max_leaf_size) {
+                   size_t max_leaf_size)
+    : num_nodes(0), all_triangles(true),
+      cache_mapping(NULL), from_cache(false) {
+  options.max_leaf_size = max_leaf_size;
+  build(_primitives);
+}
+
+BVHAccel::BVHAccel(const std::vector<Primitive *> &_primitives,
+                   const BVHBuildOptions &options)
+    : options(options), num_nodes(0), all_triangles(true),
+      cache_mapping(NULL), from_cache(false) {
+  build(_primitives);
+}
+
+void BVHAccel::build(const std::vector<Primitive *> &_primitives) {
+  num_input_primitives = _primitives.size();
+  size_t threads = std::max<size_t>(options.num_threads, 1);
+
+  std::string cache_path;
+  uint64_t cache_key = 0;
+  if (!options.cache_dir.empty() && !_primitives.empty()) {
+    cache_key = bvh_cache_key(_primitives, options);
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.bvh",
+             (unsigned long long)cache_key);
+    cache_path = options.cache_dir + name;
+    if (load_cache(cache_path, cache_key, _primitives))
+      return;
+  }
+
+  // cache bounds and centroids once instead of querying them per comparison
+  std::vector<BVHBuildPrim> refs(_primitives.size());
+  parallel_chunks(0, refs.size(),
+                  chunk_count(refs.size(), threads, options.parallel_cutoff),
+                  [&](size_t, size_t begin, size_t end) {
+                    for (size_t i = begin; i < end; i++) {
+                      refs[i].prim = _primitives[i];
+                      refs[i].bb = _primitives[i]->get_bbox();
+                      refs[i].centroid = refs[i].bb.centroid();
+                    }
+                  });
+
+  if (refs.empty()) {
+    root = make_leaf(new BVHNode(BBox()), 0, 0);
+  } else if (options.method == BVH_BUILD_SBVH) {
+    // spatial splits duplicate references and leaves append them as they
+    // are created, so the whole budget is reserved up front: nodes keep
+    // iterators into this vector and it must not reallocate
+    size_t budget = refs.size() * options.sbvh_duplication_budget;
+    primitives.reserve(refs.size() + budget);
+    BBox bbox;
+    for (const BVHBuildPrim &ref : refs) {
+      bbox.expand(ref.bb);
+    }
+    root = construct_sbvh(refs, 0, bbox.surface_area(), &budget);
+  } else {
+    // nodes keep iterators into this vector, so it is sized before building
+    // and filled in leaf order afterwards
+    primitives.resize(refs.size());
+    if (options.method == BVH_BUILD_SAH) {
+      root = construct_bvh_sah(refs, 0, refs.size(), 0, threads);
+    } else if (options.method == BVH_BUILD_LBVH ||
+               options.method == BVH_BUILD_HLBVH) {
+      root = construct_lbvh(refs, threads);
+    } else {
+      root = construct_bvh(refs, 0, refs.size(), options.max_leaf_size, 0,
+                           threads);
+    }
+    for (size_t i = 0; i < refs.size(); i++) {
+      primitives[i] = refs[i].prim;
+    }
+  }
+
+  if (primitives.empty())
+    return;
+  update_subtree(root, 0, false, NULL);
+  linearize();
+
+  if (!cache_path.empty())
+    save_cache(cache_path, cache_key, _primitives);
+}
+
+// Surface area of the box in one lane of a wide node.
+template <int N>
+static float lane_area(const RayBoxSoA<N> &boxes, int lane) {
+  float d[3];
+  for (int a = 0; a < 3; a++)
+    d[a] = boxes.bounds[1][a][lane] - boxes.bounds[0][a][lane];
+  return 2 * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+}
+
+// Reorder collapsed nodes into treelets of treelet_bytes, chosen and placed
+// the same way as in BVHAccel::flatten, and renumber the child references.
+template <int N>
+static void treelet_order(
+    std::vector<WideBVHNode<N>, AlignedAllocator<WideBVHNode<N> > > &nodes,
+    size_t treelet_bytes) {
+  size_t per_treelet = std::max<size_t>(treelet_bytes / sizeof(nodes[0]), 1);
+  // interior children are the slots without primitives, except for unused
+  // slots which point at the root
+  auto interior = [](const WideBVHNode<N> &node, int c) {
+    return !node.count[c] && node.child[c];
+  };
+  typedef std::pair<float, uint32_t> Open; // box area, node index
+  std::vector<uint32_t> order;
+  order.reserve(nodes.size());
+  std::vector<Open> treelets(1, Open(0, 0));
+  while (!treelets.empty()) {
+    Open treelet = treelets.back();
+    treelets.pop_back();
+
+    std::vector<uint32_t> chosen;
+    std::vector<Open> open(1, treelet);
+    while (chosen.size() < per_treelet && !open.empty()) {
+      std::pop_heap(open.begin(), open.end());
+      uint32_t index = open.back().second;
+      open.pop_back();
+      chosen.push_back(index);
+      const WideBVHNode<N> &node = nodes[index];
+      for (int c = 0; c < N; c++) {
+        if (interior(node, c)) {
+          open.push_back(Open(lane_area(node.bounds, c), node.child[c]));
+          std::push_heap(open.begin(), open.end());
+        }
+      }
+    }
+    std::sort(chosen.begin(), chosen.end());
+
+    std::vector<Open> stack(1, treelet), left_over;
+    while (!stack.empty()) {
+      Open e = stack.back();
+      stack.pop_back();
+      if (!std::binary_search(chosen.begin(), chosen.end(), e.second)) {
+        left_over.push_back(e);
+        continue;
+      }
+      order.push_back(e.second);
+      const WideBVHNode<N> &node = nodes[e.second];
+      for (int c = N - 1; c >= 0; c--) {
+        if (interior(node, c))
+          stack.push_back(Open(lane_area(node.bounds, c), node.child[c]));
+      }
+    }
+    std::sort(left_over.begin(), left_over.end());
+    treelets.insert(treelets.end(), left_over.begin(), left_over.end());
+  }
+
+  std::vector<uint32_t> renumbered(nodes.size());
+  for (size_t i = 0; i < order.size(); i++)
+    renumbered[order[i]] = i;
+  std::vector<WideBVHNode<N>, AlignedAllocator<WideBVHNode<N> > > out(
+      nodes.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    out[i] = nodes[order[i]];
+    for (int c = 0; c < N; c++) {
+      if (interior(out[i], c))
+        out[i].child[c] = renumbered[out[i].child[c]];
+    }
+  }
+  nodes.swap(out);
+}
+
+// Bit pattern of the float 2^exponent, for a normal exponent.
+static inline float exp2_float(int exponent) {
+  uint32_t bits = (uint32_t)(exponent + 127) << 23;
+  float f;
+  memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+// Quantize the child boxes of a collapsed node against their union. Every
+// decoded bound, origin + q * 2^exponent, is checked in float so rounding can
+// only move it outwards. Returns false if a leaf has too many primitives for
+// the 16 bit count.
+static bool quantize(const WideBVHNode<4> &in, QuantizedBVHNode4 *out) {
+  const RayBox4 &b = in.bounds;
+  out->used = 0;
+  for (int c = 0; c < 4; c++) {
+    // unused slots hold an empty box
+    if (b.bounds[0][0][c] <= b.bounds[1][0][c])
+      out->used |= 1 << c;
+    if (in.count[c] > UINT16_MAX)
+      return false;
+    out->child[c] = in.child[c];
+    out->count[c] = in.count[c];
+  }
+
+  for (int a = 0; a < 3; a++) {
+    float lo = INFINITY, hi = -INFINITY;
+    for (int c = 0; c < 4; c++) {
+      if (out->used & (1 << c)) {
+        lo = std::min(lo, b.bounds[0][a][c]);
+        hi = std::max(hi, b.bounds[1][a][c]);
+      }
+    }
+    if (!out->used)
+      lo = hi = 0;
+
+    // smallest step that spans the box in 255 steps
+    int exponent = -126;
+    if (hi > lo) {
+      std::frexp((hi - lo) / 255, &exponent);
+      exponent = std::max(exponent, -126);
+    }
+    while (exponent < 127 && lo + 255 * exp2_float(exponent) < hi)
+      exponent++;
+    float step = exp2_float(exponent);
+    out->origin[a] = lo;
+    out->exponent[a] = exponent;
+
+    for (int c = 0; c < 4; c++) {
+      out->lo[a][c] = out->hi[a][c] = 0;
+      if (!(out->used & (1 << c)))
+        continue;
+      float cmin = b.bounds[0][a][c], cmax = b.bounds[1][a][c];
+      int qlo = std::min(std::max((int)std::floor((cmin - lo) / step), 0), 255);
+      while (qlo > 0 && lo + qlo * step > cmin)
+        qlo--;
+      int qhi = std::min(std::max((int)std::ceil((cmax - lo) / step), 0), 255);
+      while (qhi < 255 && lo + qhi * step < cmax)
+        qhi++;
+      out->lo[a][c] = qlo;
+      out->hi[a][c] = qhi;
+    }
+  }
+  return true;
+}
+
+void BVHAccel::linearize() {
+  // a refit replaces the nodes of a cached BVH with its own
+  release_cache();
+  nodes.clear();
+  nodes4.clear();
+  nodes8.clear();
+  nodes4q.clear();
+  switch (options.node_format) {
+  case BVH_NODE_QUANTIZED4:
+    collapse(root, nodes4);
+    if (options.node_layout == BVH_LAYOUT_TREELET)
+      treelet_order(nodes4, options.treelet_bytes);
+    nodes4q.resize(nodes4.size());
+    for (size_t i = 0; i < nodes4.size(); i++) {
+      if (!quantize(nodes4[i], &nodes4q[i])) {
+        std::cerr << "BVH leaf too large to quantize, "
+                  << "using 4 wide nodes instead" << std::endl;
+        options.node_format = BVH_NODE_WIDE4;
+        nodes4q.clear();
+        break;
+      }
+    }
+    if (options.node_format == BVH_NODE_QUANTIZED4) {
+      nodes4.clear();
+      nodes4.shrink_to_fit();
+    }
+    break;
+  case BVH_NODE_WIDE4:
+    collapse(root, nodes4);
+    if (options.node_layout == BVH_LAYOUT_TREELET)
+      treelet_order(nodes4, options.treelet_bytes);
+    break;
+  case BVH_NODE_WIDE8:
+    collapse(root, nodes8);
+    if (options.node_layout == BVH_LAYOUT_TREELET)
+      treelet_order(nodes8, options.treelet_bytes);
+    break;
+  default:
+    nodes.reserve(2 * primitives.size() + 2);
+    flatten();
+    break;
+  }
+  num_nodes = nodes.size() + nodes4.size() + nodes8.size() + nodes4q.size();
+  node_data = nodes.data();
+  node4_data = nodes4.data();
+  node8_data = nodes8.data();
+  node4q_data = nodes4q.data();
+  pack_primitives();
+}
+
+static BVHPrimitiveKind primitive_kind(const Primitive *p) {
+  if (dynamic_cast<const Triangle *>(p))
+    return BVH_PRIMITIVE_TRIANGLE;
+  if (dynamic_cast<const Sphere *>(p))
+    return BVH_PRIMITIVE_SPHERE;
+  return BVH_PRIMITIVE_OTHER;
+}
+
+void BVHAccel::pack_primitives() {
+  kinds.resize(primitives.size());
+  bool has_spheres = false;
+  all_triangles = true;
+  for (size_t i = 0; i < primitives.size(); i++) {
+    kinds[i] = primitive_kind(primitives[i]);
+    has_spheres |= kinds[i] == BVH_PRIMITIVE_SPHERE;
+    all_triangles &= kinds[i] == BVH_PRIMITIVE_TRIANGLE;
+  }
+
+  // sort the references of every leaf by kind, which keeps the leaf ranges
+  // of the traversal nodes valid
+  if (!all_triangles) {
+    std::vector<std::pair<uint8_t, Primitive *> > leaf;
+    std::stack<const BVHNode *> todo;
+    todo.push(root);
+    while (!todo.empty()) {
+      const BVHNode *node = todo.top();
+      todo.pop();
+      if (!node->isLeaf()) {
+        todo.push(node->l);
+        todo.push(node->r);
+        continue;
+      }
+      size_t start = node->start - primitives.cbegin();
+      size_t end = node->end - primitives.cbegin();
+      leaf.clear();
+      for (size_t i = start; i < end; i++)
+        leaf.push_back(std::make_pair(kinds[i], primitives[i]));
+      std::stable_sort(leaf.begin(), leaf.end(),
+                       [](const std::pair<uint8_t, Primitive *> &a,
+                          const std::pair<uint8_t, Primitive *> &b) {
+                         return a.first < b.first;
+                       });
+      for (size_t i = start; i < end; i++) {
+        kinds[i] = leaf[i - start].first;
+        primitives[i] = leaf[i - start].second;
+      }
+    }
+  }
+
+  triangles.resize(primitives.size());
+  spheres.assign(has_spheres ? primitives.size() : 0, BVHSphere());
+  for (size_t i = 0; i < primitives.size(); i++) {
+    if (kinds[i] == BVH_PRIMITIVE_TRIANGLE) {
+      const Triangle *tri = static_cast<const Triangle *>(primitives[i]);
+      Vector3D p[3] = {tri->vertex(0), tri->vertex(1), tri->vertex(2)};
+      triangles.set(i, p);
+    } else if (kinds[i] == BVH_PRIMITIVE_SPHERE) {
+      const Sphere *sphere = static_cast<const Sphere *>(primitives[i]);
+      spheres[i].o = sphere->o;
+      spheres[i].r2 = sphere->r2;
+    }
+  }
+}
+
+size_t BVHAccel::refit() {
+  if (primitives.empty())
+    return 0;
+
+  std::vector<std::pair<BVHNode *, int> > degraded;
+  update_subtree(root, 0, true, &degraded);
+
+  size_t rebuilt = 0;
+  for (const auto &d : degraded) {
+    rebuilt += rebuild_subtree(d.first, d.second);
+  }
+  // rebuilt subtrees may have tightened, pass their bounds up the tree
+  if (rebuilt)
+    update_subtree(root, 0, true, NULL);
+
+  linearize();
+  return rebuilt;
+}
+
+// Returns the SAH cost of the subtree in the units of sah_cost(). Without
+// refit, records the cost of every node relative to its area as the build
+// time value. With refit, first recomputes the bounds from the primitives and
+// collects the outermost nodes whose relative cost has grown past the
+// rebuild threshold.
+double BVHAccel::update_subtree(
+    BVHNode *node, int depth, bool refit,
+    std::vector<std::pair<BVHNode *, int> > *degraded) {
+  size_t mark = degraded ? degraded->size() : 0;
+  double cost;
+  if (node->isLeaf()) {
+    if (refit) {
+      BBox bb;
+      for (auto p = node->start; p != node->end; p++) {
+        bb.expand((*p)->get_bbox());
+      }
+      node->bb = bb;
+    }
+    cost = node->bb.surface_area() * options.sah_intersection_cost *
+           std::distance(node->start, node->end);
+  } else {
+    BBox bb;
+    double below = 0;
+    for (BVHNode *child : {node->l, node->r}) {
+      if (child) {
+        below += update_subtree(child, depth + 1, refit, degraded);
+        bb.expand(child->bb);
+      }
+    }
+    if (refit)
+      node->bb = bb;
+    cost = node->bb.surface_area() * options.sah_traversal_cost + below;
+  }
+
+  double area = node->bb.surface_area();
+  double relative = area > 0 ? cost / area : 0;
+  if (!refit) {
+    node->cost = relative;
+  } else if (degraded && options.refit_rebuild_threshold > 0 &&
+             relative > node->cost * options.refit_rebuild_threshold) {
+    // replaces any degraded nodes found below this one
+    degraded->resize(mark);
+    degraded->push_back(std::make_pair(node, depth));
+  }
+  return cost;
+}
+
+bool BVHAccel::rebuild_subtree(BVHNode *node, int depth) {
+  // the SAH builder needs the leaves below node to cover one contiguous
+  // range of primitives
+  size_t begin = primitives.size(), end = 0, count = 0;
+  std::vector<BVHNode *> stack(1, node);
+  while (!stack.empty()) {
+    BVHNode *n = stack.back();
+    stack.pop_back();
+    if (n->isLeaf()) {
+      size_t s = n->start - primitives.cbegin();
+      size_t e = n->end - primitives.cbegin();
+      begin = std::min(begin, s);
+      end = std::max(end, e);
+      count += e - s;
+    } else {
+      if (n->l) stack.push_back(n->l);
+      if (n->r) stack.push_back(n->r);
+    }
+  }
+  if (count == 0 || end - begin != count)
+    return false;
+
+  std::vector<BVHBuildPrim> refs(count);
+  for (size_t i = 0; i < count; i++) {
+    refs[i].prim = primitives[begin + i];
+    refs[i].bb = refs[i].prim->get_bbox();
+    refs[i].centroid = refs[i].bb.centroid();
+  }
+  BVHNode *fresh = construct_bvh_sah(refs, 0, count, depth,
+                                     std::max<size_t>(options.num_threads, 1));
+  for (size_t i = 0; i < count; i++) {
+    primitives[begin + i] = refs[i].prim;
+  }
+
+  // leaves were made relative to the start of refs
+  stack.assign(1, fresh);
+  while (!stack.empty()) {
+    BVHNode *n = stack.back();
+    stack.pop_back();
+    if (n->isLeaf()) {
+      n->start += begin;
+      n->end += begin;
+    } else {
+      if (n->l) stack.push_back(n->l);
+      if (n->r) stack.push_back(n->r);
+    }
+  }
+
+  // swap the new subtree in place so the parent keeps pointing at node
+  delete node->l;
+  delete node->r;
+  *node = *fresh;
+  fresh->l = fresh->r = NULL;
+  delete fresh;
+
+  update_subtree(node, depth, false, NULL);
+  return true;
+}
+
+// Round a bound to float, outwards, so the float box contains the double one.
+// One extra ulp absorbs the error of converting ray origins to float.
+static inline float round_down(double x) {
+  float f = (float)x;
+  if (f > x)
+    f = std::nextafter(f, -INFINITY);
+  return std::nextafter(f, -INFINITY);
+}
+
+static inline float round_up(double x) {
+  float f = (float)x;
+  if (f < x)
+    f = std::nextafter(f, INFINITY);
+  return std::nextafter(f, INFINITY);
+}
+
+static_assert(sizeof(LinearBVHNode) == 32, "BVH nodes should be 32 bytes");
+
+// A median split may leave a node with a single child, skip over it.
+static const BVHNode *skip_single_child(const BVHNode *node) {
+  while (!node->isLeaf() && (!node->l || !node->r))
+    node = node->l ? node->l : node->r;
+  return node;
+}
+
+// Bounds and, for leaves, the primitive range of a flattened node. The first
+// child of an interior node is filled in when its children are placed.
+static void set_linear_node(LinearBVHNode &out, const BVHNode *node,
+                            std::vector<Primitive *>::const_iterator first) {
+  for (int a = 0; a < 3; a++) {
+    out.min[a] = round_down(node->bb.min[a]);
+    out.max[a] = round_up(node->bb.max[a]);
+  }
+  out.offset = node->isLeaf() ? std::distance(first, node->start) : 0;
+  out.count = node->isLeaf() ? std::distance(node->start, node->end) : 0;
+}
+
+void BVHAccel::flatten() {
+  std::vector<Primitive *>::const_iterator first = primitives.begin();
+  const BVHNode *top = skip_single_child(root);
+  nodes.resize(2);
+  set_linear_node(nodes[0], top, first);
+  // the unused slot after the root aligns the child pairs to cache lines
+  for (int a = 0; a < 3; a++) {
+    nodes[1].min[a] = INFINITY;
+    nodes[1].max[a] = -INFINITY;
+  }
+  nodes[1].offset = nodes[1].count = 0;
 
-  primitives = std::vector<Primitive *>(_primitives);
-  root = construct_bvh(primitives.begin(), primitives.end(), max_leaf_size);
+  // A treelet takes the children of up to pairs_per_treelet nodes, chosen
+  // from its root down by largest box since rays are most likely to enter
+  // those. The chosen pairs are then placed depth-first so a pair tends to
+  // follow its parent's, and nodes that were not chosen start treelets of
+  // their own. With one pair per treelet this is a depth-first order.
+  size_t pairs_per_treelet = 1;
+  if (options.node_layout == BVH_LAYOUT_TREELET) {
+    pairs_per_treelet =
+        std::max<size_t>(options.treelet_bytes / (2 * sizeof(LinearBVHNode)), 1);
+  }
+  typedef std::pair<const BVHNode *, uint32_t> Placed;
+  auto smaller = [](const Placed &a, const Placed &b) {
+    return a.first->bb.surface_area() < b.first->bb.surface_area();
+  };
+  std::vector<Placed> treelets;
+  if (!top->isLeaf())
+    treelets.push_back(Placed(top, 0));
+  while (!treelets.empty()) {
+    Placed treelet = treelets.back();
+    treelets.pop_back();
+
+    std::vector<const BVHNode *> chosen;
+    std::vector<Placed> open(1, treelet);
+    while (chosen.size() < pairs_per_treelet && !open.empty()) {
+      std::pop_heap(open.begin(), open.end(), smaller);
+      const BVHNode *node = open.back().first;
+      open.pop_back();
+      chosen.push_back(node);
+      const BVHNode *children[2] = {skip_single_child(node->l),
+                                    skip_single_child(node->r)};
+      for (int c = 0; c < 2; c++) {
+        if (!children[c]->isLeaf()) {
+          open.push_back(Placed(children[c], 0));
+          std::push_heap(open.begin(), open.end(), smaller);
+        }
+      }
+    }
+    std::sort(chosen.begin(), chosen.end());
+
+    std::vector<Placed> stack(1, treelet), left_over;
+    while (!stack.empty()) {
+      Placed parent = stack.back();
+      stack.pop_back();
+      if (!std::binary_search(chosen.begin(), chosen.end(), parent.first)) {
+        left_over.push_back(parent);
+        continue;
+      }
+      uint32_t pair = nodes.size();
+      nodes.resize(pair + 2);
+      nodes[parent.second].offset = pair;
+      const BVHNode *children[2] = {skip_single_child(parent.first->l),
+                                    skip_single_child(parent.first->r)};
+      for (int c = 1; c >= 0; c--) {
+        set_linear_node(nodes[pair + c], children[c], first);
+        if (!children[c]->isLeaf())
+          stack.push_back(Placed(children[c], pair + c));
+      }
+    }
+    // the largest left over node is placed next, right after this treelet
+    std::sort(left_over.begin(), left_over.end(), smaller);
+    treelets.insert(treelets.end(), left_over.begin(), left_over.end());
+  }
+}
+
+template <int N>
+uint32_t BVHAccel::collapse(
+    const BVHNode *node,
+    std::vector<WideBVHNode<N>, AlignedAllocator<WideBVHNode<N> > > &out) {
+  // pull grandchildren up into this node, opening the interior child with
+  // the largest area first, until all N slots are used
+  const BVHNode *children[N];
+  int n = 1;
+  children[0] = node;
+  while (true) {
+    int open = -1;
+    for (int i = 0; i < n; i++) {
+      const BVHNode *c = children[i];
+      if (c->isLeaf() || (c->l && c->r && n == N))
+        continue;
+      if (open < 0 ||
+          c->bb.surface_area() > children[open]->bb.surface_area())
+        open = i;
+    }
+    if (open < 0)
+      break;
+    const BVHNode *c = children[open];
+    // a median split may leave a node with a single child
+    if (c->l && c->r) {
+      children[open] = c->l;
+      children[n++] = c->r;
+    } else {
+      children[open] = c->l ? c->l : c->r;
+    }
+  }
+
+  uint32_t index = out.size();
+  out.emplace_back();
+  out[index].bounds.clear();
+  for (int i = 0; i < N; i++) {
+    out[index].child[i] = 0;
+    out[index].count[i] = 0;
+  }
+  for (int i = 0; i < n; i++) {
+    const BVHNode *c = children[i];
+    float box[8];
+    for (int a = 0; a < 3; a++) {
+      box[a] = round_down(c->bb.min[a]);
+      box[4 + a] = round_up(c->bb.max[a]);
+    }
+    out[index].bounds.set(i, box);
+    if (c->isLeaf()) {
+      out[index].child[i] = std::distance(
+          std::vector<Primitive *>::const_iterator(primitives.begin()),
+          c->start);
+      out[index].count[i] = std::distance(c->start, c->end);
+    } else {
+      // out may reallocate while the child is collapsed
+      uint32_t child = collapse(c, out);
+      out[index].child[i] = child;
+    }
+  }
+  return index;
 }
 
 BVHAccel::~BVHAccel() {
   if (root)
     delete root;
   primitives.clear();
+  release_cache();
 }
 
 BBox BVHAccel::get_bbox() const { return root->bb; }
 
+/**
+ * Intersection of two boxes, empty if they do not overlap.
+ */
+static BBox overlap(const BBox &a, const BBox &b) {
+  BBox r;
+  for (int axis = 0; axis < 3; axis++) {
+    r.min[axis] = std::max(a.min[axis], b.min[axis]);
+    r.max[axis] = std::min(a.max[axis], b.max[axis]);
+  }
+  r.extent = r.max - r.min;
+  return r;
+}
+
+static double sah_cost(const BVHNode *node, double traversal_cost,
+                       double intersection_cost) {
+  double area = node->bb.surface_area();
+  if (node->isLeaf()) {
+    return area * intersection_cost * std::distance(node->start, node->end);
+  }
+  double cost = area * traversal_cost;
+  if (node->l)
+    cost += sah_cost(node->l, traversal_cost, intersection_cost);
+  if (node->r)
+    cost += sah_cost(node->r, traversal_cost, intersection_cost);
+  return cost;
+}
+
+double BVHAccel::sah_cost() const {
+  double root_area = root->bb.surface_area();
+  double cost = SceneObjects::sah_cost(root, options.sah_traversal_cost,
+                                       options.sah_intersection_cost);
+  // degenerate (flat) scenes have no area to normalize by
+  return root_area > 0 ? cost / root_area : cost;
+}
+
+/**
+ * Accumulate the quality measures of a subtree. The leaf depth and overlap
+ * are summed and divided by the counts in quality_report().
+ */
+static void quality_report(const BVHNode *node, size_t depth,
+                           BVHQualityReport &report, double &depth_sum,
+                           double &overlap_sum) {
+  report.num_nodes++;
+  if (node->isLeaf()) {
+    size_t size = node->end - node->start;
+    report.num_leaves++;
+    report.num_references += size;
+    report.max_depth = std::max(report.max_depth, depth);
+    depth_sum += depth;
+    if (report.leaf_sizes.size() <= size)
+      report.leaf_sizes.resize(size + 1, 0);
+    report.leaf_sizes[size]++;
+    return;
+  }
+
+  double area = node->bb.surface_area();
+  BBox both = overlap(node->l->bb, node->r->bb);
+  double relative = area > 0 && !both.empty() ? both.surface_area() / area
+                                              : 0.0;
+  overlap_sum += relative;
+  report.max_overlap = std::max(report.max_overlap, relative);
+  quality_report(node->l, depth + 1, report, depth_sum, overlap_sum);
+  quality_report(node->r, depth + 1, report, depth_sum, overlap_sum);
+}
+
+BVHQualityReport BVHAccel::quality_report() const {
+  BVHQualityReport report;
+  report.sah_cost = sah_cost();
+  report.num_nodes = report.num_leaves = report.num_references = 0;
+  report.max_depth = 0;
+  report.max_overlap = 0;
+  double depth_sum = 0, overlap_sum = 0;
+  SceneObjects::quality_report(root, 0, report, depth_sum, overlap_sum);
+
+  size_t interior = report.num_nodes - report.num_leaves;
+  report.mean_leaf_depth = depth_sum / report.num_leaves;
+  report.mean_leaf_size = (double)report.num_references / report.num_leaves;
+  report.mean_overlap = interior ? overlap_sum / interior : 0.0;
+
+  report.num_primitives = num_input_primitives;
+  report.node_bytes = num_nodes * bvh_node_size(options.node_format);
+  report.tree_bytes = report.num_nodes * sizeof(BVHNode);
+  report.reference_bytes = primitives.size() * sizeof(Primitive *) +
+                           triangles.memory_bytes() + kinds.capacity() +
+                           spheres.capacity() * sizeof(BVHSphere);
+  return report;
+}
+
+size_t BVHAccel::memory_bytes() const {
+  BVHQualityReport report = quality_report();
+  return report.node_bytes + report.tree_bytes + report.reference_bytes;
+}
+
 void BVHAccel::draw(BVHNode *node, const Color &c, float alpha) const {
   if (node->isLeaf()) {
     for (auto p = node->start; p != node->end; p++) {
@@ -49,24 +994,27 @@ void BVHAccel::drawOutline(BVHNode *node, const Color &c, float alpha) const {
   }
 }
 
-BVHNode *BVHAccel::construct_bvh(std::vector<Primitive *>::iterator start,
-                                 std::vector<Primitive *>::iterator end,
-                                 size_t max_leaf_size) {
+BVHNode *BVHAccel::make_leaf(BVHNode *node, size_t start, size_t end) {
+  node->start = primitives.begin() + start;
+  node->end = primitives.begin() + end;
+  return node;
+}
 
-  BBox bbox;
+BVHNode *BVHAccel::construct_bvh(std::vector<BVHBuildPrim> &refs,
+                                 size_t start, size_t end,
+                                 size_t max_leaf_size, int depth,
+                                 size_t threads) {
 
-  for (auto p = start; p != end; p++) {
-    BBox bb = (*p)->get_bbox();
-    bbox.expand(bb);
-  }
+  BBox bbox, centroid_box;
+  compute_bounds(refs, start, end,
+                 chunk_count(end - start, threads, options.parallel_cutoff),
+                 &bbox, &centroid_box);
 
   BVHNode *node = new BVHNode(bbox);
-  size_t size = std::distance(start, end);
+  size_t size = end - start;
 
-  if (size <= max_leaf_size) {
-    node->start = start;
-    node->end = end;
-    return node;
+  if (size <= max_leaf_size || depth == BVH_MAX_DEPTH - 1) {
+    return make_leaf(node, start, end);
   } else {
     // determine the longest axis
     int longest_axis = 0;
@@ -79,91 +1027,1791 @@ BVHNode *BVHAccel::construct_bvh(std::vector<Primitive *>::iterator start,
       longest_axis = 2;
     }
     // sort primitives based on centroid.longestaxis
-    std::sort(start, end,
-              [longest_axis](const Primitive *a, const Primitive *b) {
-                return a->get_bbox().centroid()[longest_axis] <
-                       b->get_bbox().centroid()[longest_axis];
+    std::sort(refs.begin() + start, refs.begin() + end,
+              [longest_axis](const BVHBuildPrim &a, const BVHBuildPrim &b) {
+                return a.centroid[longest_axis] < b.centroid[longest_axis];
               });
-    std::vector<Primitive *>::iterator mid =
-        start + std::distance(start, end) / 2;
-    if (start != mid) {
-      node->l = construct_bvh(start, next(mid), max_leaf_size);
-    } else {
-      node->l = NULL;
-    }
-    if (next(mid) != end) {
-      node->r = construct_bvh(next(mid), end, max_leaf_size);
+    size_t mid = start + size / 2;
+    node->l = NULL;
+    node->r = NULL;
+    if (start == mid || mid + 1 == end) {
+      if (start != mid) {
+        node->l = construct_bvh(refs, start, mid + 1, max_leaf_size,
+                                depth + 1, threads);
+      }
+      if (mid + 1 != end) {
+        node->r = construct_bvh(refs, mid + 1, end, max_leaf_size, depth + 1,
+                                threads);
+      }
+    } else if (threads > 1 && size >= options.parallel_cutoff) {
+      size_t l_threads = left_threads(threads, mid + 1 - start, size);
+      std::thread left([&] {
+        node->l = construct_bvh(refs, start, mid + 1, max_leaf_size,
+                                depth + 1, l_threads);
+      });
+      node->r = construct_bvh(refs, mid + 1, end, max_leaf_size, depth + 1,
+                              threads - l_threads);
+      left.join();
     } else {
-      node->r = NULL;
+      node->l = construct_bvh(refs, start, mid + 1, max_leaf_size, depth + 1);
+      node->r = construct_bvh(refs, mid + 1, end, max_leaf_size, depth + 1);
     }
     return node;
   }
 }
 
-bool BVHAccel::has_intersection(const Ray &ray, BVHNode *node) const {
-  // TODO (Part 2.3):
-  // Fill in the intersect function.
-  // Take note that this function has a short-circuit that the
-  // Intersection version cannot, since it returns as soon as it finds
-  // a hit, it doesn't actually have to find the closest hit.
-  double t0 = ray.min_t;
-  double t1 = ray.max_t;
-  if (!node->bb.intersect(ray, t0, t1)) // If the ray doesn't intersect
-                                               // the bounding box, return false
-  {
+BVHNode *BVHAccel::construct_bvh_sah(std::vector<BVHBuildPrim> &refs,
+                                     size_t start, size_t end, int depth,
+                                     size_t threads) {
+
+  size_t size = end - start;
+  size_t num_tasks = chunk_count(size, threads, options.parallel_cutoff);
+
+  BBox bbox, centroid_box;
+  compute_bounds(refs, start, end, num_tasks, &bbox, &centroid_box);
+
+  BVHNode *node = new BVHNode(bbox);
+  if (size == 1 || depth == BVH_MAX_DEPTH - 1) {
+    return make_leaf(node, start, end);
+  }
+
+  const size_t num_bins = std::max<size_t>(options.sah_bins, 2);
+  const double node_area = bbox.surface_area();
+  const double leaf_cost = options.sah_intersection_cost * size;
+
+  // bin centroids on all three axes in one pass, per chunk, then merge
+  Vector3D scale;
+  for (int axis = 0; axis < 3; axis++) {
+    double extent = centroid_box.extent[axis];
+    scale[axis] = extent > 0 ? num_bins / extent : 0;
+  }
+  std::vector<BBox> bin_bounds(num_tasks * 3 * num_bins);
+  std::vector<size_t> bin_counts(num_tasks * 3 * num_bins);
+  parallel_chunks(
+      start, end, num_tasks, [&](size_t t, size_t begin, size_t finish) {
+        BBox *bounds = &bin_bounds[t * 3 * num_bins];
+        size_t *counts = &bin_counts[t * 3 * num_bins];
+        for (size_t i = begin; i < finish; i++) {
+          for (int axis = 0; axis < 3; axis++) {
+            size_t b = (size_t)((refs[i].centroid[axis] -
+                                 centroid_box.min[axis]) *
+                                scale[axis]);
+            b = axis * num_bins + std::min(b, num_bins - 1);
+            counts[b]++;
+            bounds[b].expand(refs[i].bb);
+          }
+        }
+      });
+  for (size_t t = 1; t < num_tasks; t++) {
+    for (size_t b = 0; b < 3 * num_bins; b++) {
+      bin_bounds[b].expand(bin_bounds[t * 3 * num_bins + b]);
+      bin_counts[b] += bin_counts[t * 3 * num_bins + b];
+    }
+  }
+
+  // evaluate every bin boundary on all three axes
+  double best_cost = INF_D;
+  int best_axis = -1;
+  size_t best_split = 0;
+
+  std::vector<double> right_area(num_bins);
+  std::vector<size_t> right_count(num_bins);
+
+  for (int axis = 0; axis < 3; axis++) {
+    if (centroid_box.extent[axis] <= 0)
+      continue;
+    const BBox *bounds = &bin_bounds[axis * num_bins];
+    const size_t *counts = &bin_counts[axis * num_bins];
+
+    // sweep from the right to get the area and count right of each boundary
+    BBox acc;
+    size_t count = 0;
+    for (size_t b = num_bins - 1; b > 0; b--) {
+      acc.expand(bounds[b]);
+      count += counts[b];
+      right_area[b] = acc.surface_area();
+      right_count[b] = count;
+    }
+
+    // sweep from the left, boundary b separates bins [0, b) and [b, num_bins)
+    acc = BBox();
+    count = 0;
+    for (size_t b = 1; b < num_bins; b++) {
+      acc.expand(bounds[b - 1]);
+      count += counts[b - 1];
+      if (count == 0 || right_count[b] == 0)
+        continue;
+      double cost = options.sah_traversal_cost +
+                    options.sah_intersection_cost *
+                        (acc.surface_area() * count +
+                         right_area[b] * right_count[b]) /
+                        node_area;
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_axis = axis;
+        best_split = b;
+      }
+    }
+  }
+
+  size_t mid;
+  if (best_axis < 0 || node_area <= 0) {
+    // all centroids coincide, SAH cannot separate these primitives
+    if (size <= options.sah_max_leaf_size) {
+      return make_leaf(node, start, end);
+    }
+    mid = start + size / 2;
+  } else {
+    if (best_cost >= leaf_cost && size <= options.sah_max_leaf_size) {
+      return make_leaf(node, start, end);
+    }
+    double axis_scale = scale[best_axis];
+    double axis_min = centroid_box.min[best_axis];
+    mid = partition_refs(refs, start, end, num_tasks,
+                         [&](const BVHBuildPrim &p) {
+                           size_t b = (size_t)((p.centroid[best_axis] -
+                                                axis_min) *
+                                               axis_scale);
+                           return std::min(b, num_bins - 1) < best_split;
+                         });
+  }
+
+  if (threads > 1 && size >= options.parallel_cutoff) {
+    size_t l_threads = left_threads(threads, mid - start, size);
+    std::thread left([&] {
+      node->l = construct_bvh_sah(refs, start, mid, depth + 1, l_threads);
+    });
+    node->r =
+        construct_bvh_sah(refs, mid, end, depth + 1, threads - l_threads);
+    left.join();
+  } else {
+    node->l = construct_bvh_sah(refs, start, mid, depth + 1);
+    node->r = construct_bvh_sah(refs, mid, end, depth + 1);
+  }
+  return node;
+}
+
+// Spread the low 10 bits of x so that there are two zero bits between each.
+static inline uint32_t left_shift3(uint32_t x) {
+  x &= 0x3ff;
+  x = (x | (x << 16)) & 0x30000ff;
+  x = (x | (x << 8)) & 0x300f00f;
+  x = (x | (x << 4)) & 0x30c30c3;
+  x = (x | (x << 2)) & 0x9249249;
+  return x;
+}
+
+/**
+ * 30 bit Morton code of a point with coordinates in [0, 1024).
+ */
+static inline uint32_t encode_morton3(const Vector3D &v) {
+  return (left_shift3((uint32_t)v.z) << 2) | (left_shift3((uint32_t)v.y) << 1) |
+         left_shift3((uint32_t)v.x);
+}
+
+static inline int highest_bit(uint32_t x) {
+  int bit = -1;
+  while (x) {
+    x >>= 1;
+    bit++;
+  }
+  return bit;
+}
+
+/**
+ * Morton code of a primitive together with its position before sorting.
+ */
+struct MortonPrim {
+  uint32_t code;
+  uint32_t index;
+};
+
+/**
+ * Least significant digit radix sort of Morton codes, 8 bits per pass.
+ * Every chunk builds a digit histogram, prefix sums over (digit, chunk)
+ * give each chunk its output slots, and the scatter is stable, so the
+ * order does not depend on the number of chunks.
+ */
+static void radix_sort(std::vector<MortonPrim> &prims, size_t num_tasks) {
+  const int bits_per_pass = 8;
+  const int num_buckets = 1 << bits_per_pass;
+  std::vector<MortonPrim> scratch(prims.size());
+  std::vector<MortonPrim> *in = &prims, *out = &scratch;
+  std::vector<size_t> offsets(num_tasks * num_buckets);
+
+  for (int shift = 0; shift < 32; shift += bits_per_pass) {
+    std::fill(offsets.begin(), offsets.end(), 0);
+    parallel_chunks(0, in->size(), num_tasks,
+                    [&](size_t t, size_t begin, size_t end) {
+                      size_t *hist = &offsets[t * num_buckets];
+                      for (size_t i = begin; i < end; i++) {
+                        hist[((*in)[i].code >> shift) & (num_buckets - 1)]++;
+                      }
+                    });
+
+    size_t sum = 0;
+    for (int b = 0; b < num_buckets; b++) {
+      for (size_t t = 0; t < num_tasks; t++) {
+        size_t count = offsets[t * num_buckets + b];
+        offsets[t * num_buckets + b] = sum;
+        sum += count;
+      }
+    }
+
+    parallel_chunks(0, in->size(), num_tasks,
+                    [&](size_t t, size_t begin, size_t end) {
+                      size_t *next = &offsets[t * num_buckets];
+                      for (size_t i = begin; i < end; i++) {
+                        int b = ((*in)[i].code >> shift) & (num_buckets - 1);
+                        (*out)[next[b]++] = (*in)[i];
+                      }
+                    });
+    std::swap(in, out);
+  }
+  // an even number of passes leaves the result in prims
+}
+
+/**
+ * A run of primitives sharing the leading Morton bits, built as one LBVH
+ * and placed under the SAH top level of an HLBVH.
+ */
+struct LBVHTreelet {
+  size_t start, end; ///< range of the treelet in the sorted primitives
+  BBox bb;           ///< bounds of the treelet primitives
+  Vector3D centroid; ///< centroid of bb, used to bin the treelet
+  int depth;         ///< depth at which the treelet root is placed
+  BVHNode **slot;    ///< where the treelet root is stored once built
+};
+
+/**
+ * Build the top levels of an HLBVH over treelets with a binned SAH.
+ * Treelet roots are not built yet: every treelet records the child pointer
+ * that should receive its root and the depth it will sit at.
+ */
+static void construct_upper_sah(std::vector<LBVHTreelet> &treelets,
+                                size_t start, size_t end, int depth,
+                                const BVHBuildOptions &options,
+                                BVHNode **out) {
+  size_t size = end - start;
+  if (size == 1) {
+    treelets[start].depth = depth;
+    treelets[start].slot = out;
+    return;
+  }
+
+  BBox bbox, centroid_box;
+  for (size_t i = start; i < end; i++) {
+    bbox.expand(treelets[i].bb);
+    centroid_box.expand(treelets[i].centroid);
+  }
+  BVHNode *node = new BVHNode(bbox);
+  *out = node;
+
+  const size_t num_bins = std::max<size_t>(options.sah_bins, 2);
+  const double node_area = bbox.surface_area();
+  double best_cost = INF_D;
+  int best_axis = -1;
+  size_t best_split = 0;
+
+  // the top level is small, so bins are weighted by primitive count and
+  // evaluated directly instead of with sweeps
+  for (int axis = 0; axis < 3 && depth < BVH_MAX_DEPTH / 2; axis++) {
+    double extent = centroid_box.extent[axis];
+    if (extent <= 0)
+      continue;
+    double scale = num_bins / extent;
+    std::vector<BBox> bin_bounds(num_bins);
+    std::vector<size_t> bin_counts(num_bins);
+    for (size_t i = start; i < end; i++) {
+      size_t b = (size_t)((treelets[i].centroid[axis] -
+                           centroid_box.min[axis]) *
+                          scale);
+      b = std::min(b, num_bins - 1);
+      bin_bounds[b].expand(treelets[i].bb);
+      bin_counts[b] += treelets[i].end - treelets[i].start;
+    }
+    for (size_t split = 1; split < num_bins; split++) {
+      BBox left, right;
+      size_t left_count = 0, right_count = 0;
+      for (size_t b = 0; b < split; b++) {
+        left.expand(bin_bounds[b]);
+        left_count += bin_counts[b];
+      }
+      for (size_t b = split; b < num_bins; b++) {
+        right.expand(bin_bounds[b]);
+        right_count += bin_counts[b];
+      }
+      if (left_count == 0 || right_count == 0)
+        continue;
+      double cost = options.sah_traversal_cost +
+                    options.sah_intersection_cost *
+                        (left.surface_area() * left_count +
+                         right.surface_area() * right_count) /
+                        node_area;
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_axis = axis;
+        best_split = split;
+      }
+    }
+  }
+
+  size_t mid;
+  if (best_axis < 0 || node_area <= 0) {
+    // no usable split (or the top level got too deep), halve the list
+    mid = start + size / 2;
+  } else {
+    double scale = num_bins / centroid_box.extent[best_axis];
+    double axis_min = centroid_box.min[best_axis];
+    auto it = std::partition(
+        treelets.begin() + start, treelets.begin() + end,
+        [&](const LBVHTreelet &t) {
+          size_t b = (size_t)((t.centroid[best_axis] - axis_min) * scale);
+          return std::min(b, num_bins - 1) < best_split;
+        });
+    mid = it - treelets.begin();
+  }
+
+  construct_upper_sah(treelets, start, mid, depth + 1, options, &node->l);
+  construct_upper_sah(treelets, mid, end, depth + 1, options, &node->r);
+}
+
+BVHNode *BVHAccel::construct_lbvh(std::vector<BVHBuildPrim> &refs,
+                                  size_t threads) {
+  size_t size = refs.size();
+  size_t num_tasks = chunk_count(size, threads, options.parallel_cutoff);
+
+  BBox bbox, centroid_box;
+  compute_bounds(refs, 0, size, num_tasks, &bbox, &centroid_box);
+
+  // quantize centroids to a 1024^3 grid over the centroid bounds
+  const int morton_scale = 1 << 10;
+  Vector3D scale;
+  for (int axis = 0; axis < 3; axis++) {
+    double extent = centroid_box.extent[axis];
+    scale[axis] = extent > 0 ? (morton_scale - 1) / extent : 0;
+  }
+  std::vector<MortonPrim> morton(size);
+  parallel_chunks(0, size, num_tasks, [&](size_t, size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      Vector3D p = (refs[i].centroid - centroid_box.min) * scale;
+      morton[i].code = encode_morton3(p);
+      morton[i].index = i;
+    }
+  });
+  radix_sort(morton, num_tasks);
+
+  std::vector<BVHBuildPrim> sorted(size);
+  std::vector<uint32_t> codes(size);
+  parallel_chunks(0, size, num_tasks, [&](size_t, size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      sorted[i] = refs[morton[i].index];
+      codes[i] = morton[i].code;
+    }
+  });
+  refs.swap(sorted);
+
+  if (options.method == BVH_BUILD_LBVH) {
+    return emit_lbvh(refs, codes, 0, size, 0, threads);
+  }
+
+  // HLBVH: cut the sorted list into treelets sharing the leading bits
+  int treelet_shift =
+      30 - (int)std::min<size_t>(options.hlbvh_treelet_bits, 30);
+  std::vector<LBVHTreelet> treelets;
+  for (size_t start = 0, end = 1; end <= size; end++) {
+    if (end == size ||
+        (codes[start] >> treelet_shift) != (codes[end] >> treelet_shift)) {
+      LBVHTreelet t;
+      t.start = start;
+      t.end = end;
+      t.slot = NULL;
+      t.depth = 0;
+      treelets.push_back(t);
+      start = end;
+    }
+  }
+  parallel_chunks(0, treelets.size(), std::min(num_tasks, treelets.size()),
+                  [&](size_t, size_t begin, size_t end) {
+                    for (size_t i = begin; i < end; i++) {
+                      LBVHTreelet &t = treelets[i];
+                      for (size_t p = t.start; p < t.end; p++) {
+                        t.bb.expand(refs[p].bb);
+                      }
+                      t.centroid = t.bb.centroid();
+                    }
+                  });
+
+  BVHNode *root = NULL;
+  construct_upper_sah(treelets, 0, treelets.size(), 0, options, &root);
+
+  // treelets vary a lot in size, so threads take them largest first from
+  // a shared counter instead of in fixed chunks
+  std::vector<size_t> order(treelets.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return treelets[a].end - treelets[a].start >
+           treelets[b].end - treelets[b].start;
+  });
+  std::atomic<size_t> next(0);
+  size_t workers = std::min(num_tasks, treelets.size());
+  parallel_chunks(0, workers, workers, [&](size_t, size_t, size_t) {
+    for (size_t i = next++; i < order.size(); i = next++) {
+      LBVHTreelet &t = treelets[order[i]];
+      *t.slot = emit_lbvh(refs, codes, t.start, t.end, t.depth);
+    }
+  });
+  return root;
+}
+
+BVHNode *BVHAccel::emit_lbvh(const std::vector<BVHBuildPrim> &refs,
+                             const std::vector<uint32_t> &codes, size_t start,
+                             size_t end, int depth, size_t threads) {
+  size_t size = end - start;
+  if (size <= options.max_leaf_size || depth == BVH_MAX_DEPTH - 1) {
+    BBox bbox;
+    for (size_t i = start; i < end; i++) {
+      bbox.expand(refs[i].bb);
+    }
+    return make_leaf(new BVHNode(bbox), start, end);
+  }
+
+  // codes are sorted, so the highest bit where the first and last code
+  // differ is the highest bit that differs anywhere in the range
+  uint32_t diff = codes[start] ^ codes[end - 1];
+  size_t mid;
+  if (diff == 0) {
+    // identical codes carry no more spatial information, halve the range
+    mid = start + size / 2;
+  } else {
+    uint32_t bit = 1u << highest_bit(diff);
+    mid = std::partition_point(codes.begin() + start, codes.begin() + end,
+                               [bit](uint32_t c) { return !(c & bit); }) -
+          codes.begin();
+  }
+
+  BVHNode *node = new BVHNode(BBox());
+  if (threads > 1 && size >= options.parallel_cutoff) {
+    size_t l_threads = left_threads(threads, mid - start, size);
+    std::thread left([&] {
+      node->l = emit_lbvh(refs, codes, start, mid, depth + 1, l_threads);
+    });
+    node->r = emit_lbvh(refs, codes, mid, end, depth + 1, threads - l_threads);
+    left.join();
+  } else {
+    node->l = emit_lbvh(refs, codes, start, mid, depth + 1);
+    node->r = emit_lbvh(refs, codes, mid, end, depth + 1);
+  }
+  node->bb = node->l->bb;
+  node->bb.expand(node->r->bb);
+  return node;
+}
+
+/**
+ * Split a reference at the plane axis = pos.
+ * Triangles are clipped edge by edge, so both halves get the exact bounds
+ * of the part of the triangle on their side. Other primitives are split by
+ * cutting their box. Both halves stay within the reference's current box,
+ * which may already have been clipped by earlier splits.
+ */
+static void split_reference(const BVHBuildPrim &ref, int axis, double pos,
+                            BVHBuildPrim *left, BVHBuildPrim *right) {
+  BBox l, r;
+  const Triangle *tri = dynamic_cast<const Triangle *>(ref.prim);
+  if (tri) {
+    Vector3D v[3] = {tri->vertex(0), tri->vertex(1), tri->vertex(2)};
+    for (int i = 0; i < 3; i++) {
+      const Vector3D &a = v[i], &b = v[(i + 1) % 3];
+      if (a[axis] <= pos)
+        l.expand(a);
+      if (a[axis] >= pos)
+        r.expand(a);
+      if ((a[axis] < pos && b[axis] > pos) ||
+          (a[axis] > pos && b[axis] < pos)) {
+        Vector3D p = a + (b - a) * ((pos - a[axis]) / (b[axis] - a[axis]));
+        p[axis] = pos;
+        l.expand(p);
+        r.expand(p);
+      }
+    }
+  } else {
+    l = r = ref.bb;
+  }
+
+  BBox left_bound = ref.bb, right_bound = ref.bb;
+  left_bound.max[axis] = pos;
+  right_bound.min[axis] = pos;
+  left->prim = right->prim = ref.prim;
+  left->bb = overlap(l, left_bound);
+  right->bb = overlap(r, right_bound);
+  left->centroid = left->bb.centroid();
+  right->centroid = right->bb.centroid();
+}
+
+/**
+ * Best binned SAH split of a node, by object partition or by space.
+ */
+struct SBVHSplit {
+  double cost;         ///< SAH cost, INF_D if no split was found
+  int axis;            ///< split axis
+  size_t bin;          ///< first bin of the right child
+  BBox left, right;    ///< bounds of the two children
+  size_t left_count;   ///< references in the left child
+  size_t right_count;  ///< references in the right child
+};
+
+static SBVHSplit find_object_split(const std::vector<BVHBuildPrim> &refs,
+                                   const BBox &centroid_box, double node_area,
+                                   size_t num_bins,
+                                   const BVHBuildOptions &options) {
+  SBVHSplit best;
+  best.cost = INF_D;
+  best.axis = -1;
+  for (int axis = 0; axis < 3; axis++) {
+    double extent = centroid_box.extent[axis];
+    if (extent <= 0)
+      continue;
+    double scale = num_bins / extent;
+    std::vector<BBox> bounds(num_bins);
+    std::vector<size_t> counts(num_bins);
+    for (const BVHBuildPrim &ref : refs) {
+      size_t b = (size_t)((ref.centroid[axis] - centroid_box.min[axis]) *
+                          scale);
+      b = std::min(b, num_bins - 1);
+      counts[b]++;
+      bounds[b].expand(ref.bb);
+    }
+
+    std::vector<BBox> right_bounds(num_bins);
+    std::vector<size_t> right_counts(num_bins);
+    BBox acc;
+    size_t count = 0;
+    for (size_t b = num_bins - 1; b > 0; b--) {
+      acc.expand(bounds[b]);
+      count += counts[b];
+      right_bounds[b] = acc;
+      right_counts[b] = count;
+    }
+
+    acc = BBox();
+    count = 0;
+    for (size_t b = 1; b < num_bins; b++) {
+      acc.expand(bounds[b - 1]);
+      count += counts[b - 1];
+      if (count == 0 || right_counts[b] == 0)
+        continue;
+      double cost = options.sah_traversal_cost +
+                    options.sah_intersection_cost *
+                        (acc.surface_area() * count +
+                         right_bounds[b].surface_area() * right_counts[b]) /
+                        node_area;
+      if (cost < best.cost) {
+        best.cost = cost;
+        best.axis = axis;
+        best.bin = b;
+        best.left = acc;
+        best.right = right_bounds[b];
+        best.left_count = count;
+        best.right_count = right_counts[b];
+      }
+    }
+  }
+  return best;
+}
+
+static SBVHSplit find_spatial_split(const std::vector<BVHBuildPrim> &refs,
+                                    const BBox &bbox, double node_area,
+                                    size_t num_bins,
+                                    const BVHBuildOptions &options) {
+  SBVHSplit best;
+  best.cost = INF_D;
+  best.axis = -1;
+  for (int axis = 0; axis < 3; axis++) {
+    double extent = bbox.extent[axis];
+    if (extent <= 0)
+      continue;
+    double width = extent / num_bins;
+    std::vector<BBox> bounds(num_bins);
+    std::vector<size_t> entries(num_bins), exits(num_bins);
+    for (const BVHBuildPrim &ref : refs) {
+      size_t first = (size_t)((ref.bb.min[axis] - bbox.min[axis]) / width);
+      size_t last = (size_t)((ref.bb.max[axis] - bbox.min[axis]) / width);
+      first = std::min(first, num_bins - 1);
+      last = std::min(std::max(last, first), num_bins - 1);
+      entries[first]++;
+      exits[last]++;
+      // chop the reference into the bins it spans
+      BVHBuildPrim rest = ref;
+      for (size_t b = first; b < last; b++) {
+        BVHBuildPrim l, r;
+        split_reference(rest, axis, bbox.min[axis] + width * (b + 1), &l, &r);
+        bounds[b].expand(l.bb);
+        rest = r;
+      }
+      bounds[last].expand(rest.bb);
+    }
+
+    std::vector<BBox> right_bounds(num_bins);
+    std::vector<size_t> right_counts(num_bins);
+    BBox acc;
+    size_t count = 0;
+    for (size_t b = num_bins - 1; b > 0; b--) {
+      acc.expand(bounds[b]);
+      count += exits[b];
+      right_bounds[b] = acc;
+      right_counts[b] = count;
+    }
+
+    acc = BBox();
+    count = 0;
+    for (size_t b = 1; b < num_bins; b++) {
+      acc.expand(bounds[b - 1]);
+      count += entries[b - 1];
+      if (count == 0 || right_counts[b] == 0)
+        continue;
+      double cost = options.sah_traversal_cost +
+                    options.sah_intersection_cost *
+                        (acc.surface_area() * count +
+                         right_bounds[b].surface_area() * right_counts[b]) /
+                        node_area;
+      if (cost < best.cost) {
+        best.cost = cost;
+        best.axis = axis;
+        best.bin = b;
+        best.left = acc;
+        best.right = right_bounds[b];
+        best.left_count = count;
+        best.right_count = right_counts[b];
+      }
+    }
+  }
+  return best;
+}
+
+BVHNode *BVHAccel::construct_sbvh(std::vector<BVHBuildPrim> &refs, int depth,
+                                  double root_area, size_t *budget) {
+  BBox bbox, centroid_box;
+  for (const BVHBuildPrim &ref : refs) {
+    bbox.expand(ref.bb);
+    centroid_box.expand(ref.centroid);
+  }
+
+  BVHNode *node = new BVHNode(bbox);
+  size_t size = refs.size();
+  if (size > 1 && depth < BVH_MAX_DEPTH - 1) {
+    const size_t num_bins = std::max<size_t>(options.sah_bins, 2);
+    const double node_area = bbox.surface_area();
+    const double leaf_cost = options.sah_intersection_cost * size;
+
+    SBVHSplit object = find_object_split(refs, centroid_box, node_area,
+                                         num_bins, options);
+    SBVHSplit spatial;
+    spatial.cost = INF_D;
+    // spatial splits only pay off where object split children overlap
+    if (*budget > 0 && object.axis >= 0 && node_area > 0 &&
+        overlap(object.left, object.right).surface_area() >
+            options.sbvh_alpha * root_area) {
+      spatial = find_spatial_split(refs, bbox, node_area, num_bins, options);
+    }
+
+    std::vector<BVHBuildPrim> left, right;
+    double best_cost = std::min(object.cost, spatial.cost);
+    bool make_leaf_here =
+        best_cost >= leaf_cost && size <= options.sah_max_leaf_size;
+
+    if (!make_leaf_here && spatial.cost < object.cost) {
+      int axis = spatial.axis;
+      double pos = bbox.min[axis] + bbox.extent[axis] / num_bins * spatial.bin;
+      BBox lb = spatial.left, rb = spatial.right;
+      size_t nl = spatial.left_count, nr = spatial.right_count;
+      size_t duplicated = 0;
+      for (const BVHBuildPrim &ref : refs) {
+        if (ref.bb.max[axis] <= pos) {
+          left.push_back(ref);
+          continue;
+        }
+        if (ref.bb.min[axis] >= pos) {
+          right.push_back(ref);
+          continue;
+        }
+        // reference unsplitting: keep the whole reference on one side when
+        // that is cheaper than duplicating it
+        BBox lu = lb, ru = rb;
+        lu.expand(ref.bb);
+        ru.expand(ref.bb);
+        double split_cost = lb.surface_area() * nl + rb.surface_area() * nr;
+        double left_cost =
+            lu.surface_area() * nl + rb.surface_area() * (nr - 1);
+        double right_cost =
+            lb.surface_area() * (nl - 1) + ru.surface_area() * nr;
+        if (duplicated < *budget && split_cost < left_cost &&
+            split_cost < right_cost) {
+          BVHBuildPrim l, r;
+          split_reference(ref, axis, pos, &l, &r);
+          // a clipped reference may turn out not to reach one side at all
+          if (!l.bb.empty())
+            left.push_back(l);
+          if (!r.bb.empty())
+            right.push_back(r);
+          duplicated += !l.bb.empty() && !r.bb.empty();
+        } else if (left_cost < right_cost) {
+          left.push_back(ref);
+          lb = lu;
+          nr--;
+        } else {
+          right.push_back(ref);
+          rb = ru;
+          nl--;
+        }
+      }
+      if (left.empty() || right.empty()) {
+        left.clear();
+        right.clear();
+      } else {
+        *budget -= duplicated;
+      }
+    }
+
+    if (!make_leaf_here && left.empty() && object.axis >= 0) {
+      double scale = num_bins / centroid_box.extent[object.axis];
+      for (const BVHBuildPrim &ref : refs) {
+        size_t b = (size_t)((ref.centroid[object.axis] -
+                             centroid_box.min[object.axis]) *
+                            scale);
+        if (std::min(b, num_bins - 1) < object.bin) {
+          left.push_back(ref);
+        } else {
+          right.push_back(ref);
+        }
+      }
+    } else if (left.empty() && size > options.sah_max_leaf_size) {
+      // all centroids coincide, SAH cannot separate these primitives
+      left.assign(refs.begin(), refs.begin() + size / 2);
+      right.assign(refs.begin() + size / 2, refs.end());
+    }
+
+    if (!left.empty() && !right.empty()) {
+      // release this level's references before descending
+      std::vector<BVHBuildPrim>().swap(refs);
+      node->l = construct_sbvh(left, depth + 1, root_area, budget);
+      std::vector<BVHBuildPrim>().swap(left);
+      node->r = construct_sbvh(right, depth + 1, root_area, budget);
+      return node;
+    }
+  }
+
+  size_t start = primitives.size();
+  for (const BVHBuildPrim &ref : refs) {
+    primitives.push_back(ref.prim);
+  }
+  return make_leaf(node, start, primitives.size());
+}
+
+/**
+ * Slab test against the bounds of a flattened node.
+ */
+static inline bool intersect_node(const LinearBVHNode &node,
+                                  const RayBoxData &r, float t_max,
+                                  float *t_entry = NULL) {
+  return ray_box_intersect(node.min, r, t_max, t_entry);
+}
+
+void BVHTraversalStats::clear() {
+  rays = node_visits = box_tests = primitive_tests = culled = 0;
+  for (int d = 0; d < BVH_MAX_DEPTH; d++)
+    depth_histogram[d] = 0;
+}
+
+void BVHTraversalStats::add(const BVHTraversalStats &other) {
+  rays += other.rays;
+  node_visits += other.node_visits;
+  box_tests += other.box_tests;
+  primitive_tests += other.primitive_tests;
+  culled += other.culled;
+  for (int d = 0; d < BVH_MAX_DEPTH; d++)
+    depth_histogram[d] += other.depth_histogram[d];
+}
+
+BVHTraversalStats &BVHAccel::thread_stats() {
+  static thread_local BVHTraversalStats stats;
+  return stats;
+}
+
+/**
+ * Count a finished query in the depth histogram.
+ */
+static inline void record_depth(BVHTraversalStats &stats, int depth) {
+  stats.depth_histogram[std::min(depth, BVH_MAX_DEPTH - 1)]++;
+}
+
+bool BVHAccel::occluded(const Ray &ray, double t_max) const {
+  BVHTraversalStats &stats = thread_stats();
+  stats.rays++;
+  if (primitives.empty())
     return false;
+
+  // primitives read the segment end from the ray itself
+  double saved_max_t = ray.max_t;
+  ray.max_t = t_max;
+
+  bool blocked;
+  switch (options.node_format) {
+  case BVH_NODE_WIDE4:
+    blocked = occluded_wide(node4_data, ray, stats);
+    break;
+  case BVH_NODE_WIDE8:
+    blocked = occluded_wide(node8_data, ray, stats);
+    break;
+  case BVH_NODE_QUANTIZED4:
+    blocked = occluded_wide(node4q_data, ray, stats);
+    break;
+  default:
+    blocked = occluded_binary(ray, stats);
+    break;
   }
-  if (node->isLeaf()) {
-    for (auto p = node->start; p != node->end; p++) {
-      total_isects++;
-      if ((*p)->has_intersection(ray)) {
 
+  ray.max_t = saved_max_t;
+  return blocked;
+}
+
+bool BVHAccel::intersect(const Ray &ray, Intersection *i) const {
+  BVHTraversalStats &stats = thread_stats();
+  stats.rays++;
+  if (primitives.empty())
+    return false;
+
+  bool hit;
+  switch (options.node_format) {
+  case BVH_NODE_WIDE4:
+    hit = intersect_wide(node4_data, ray, i, stats);
+    break;
+  case BVH_NODE_WIDE8:
+    hit = intersect_wide(node8_data, ray, i, stats);
+    break;
+  case BVH_NODE_QUANTIZED4:
+    hit = intersect_wide(node4q_data, ray, i, stats);
+    break;
+  default:
+    hit = intersect_binary(ray, i, stats);
+    break;
+  }
+  if (hit)
+    finalize_hit(ray, i);
+  return hit;
+}
+
+/**
+ * Shading attributes of the closest hit. Traversal only records t, the
+ * primitive and the barycentric coordinates of each candidate.
+ */
+void BVHAccel::finalize_hit(const Ray &ray, Intersection *i) const {
+  uint32_t q = i->primitive_id;
+  switch (kinds[q]) {
+  case BVH_PRIMITIVE_TRIANGLE: {
+    const Triangle *tri = static_cast<const Triangle *>(primitives[q]);
+    i->n = tri->shading_normal(i->u, i->v);
+    i->bsdf = tri->get_bsdf();
+    break;
+  }
+  case BVH_PRIMITIVE_SPHERE:
+    i->n = (ray.o + i->t * ray.d - spheres[q].o).unit();
+    i->bsdf = primitives[q]->get_bsdf();
+    break;
+  default:
+    // complete already, Primitive::intersect fills in everything
+    break;
+  }
+}
+
+/**
+ * Nearest hit of a ray with a run of triangle references. All of them go
+ * through one SIMD test.
+ */
+static inline bool intersect_triangle_run(
+    const RayTriangleSoA &triangles, const std::vector<Primitive *> &prims,
+    uint32_t start, uint32_t count, const Ray &ray, const RayTriangleData &rt,
+    Intersection *i) {
+  Real t_max = ray.max_t, u, v;
+  long q = ray_triangle_nearest(triangles, start, count, rt, ray.min_t, &t_max,
+                                &u, &v);
+  if (q < 0)
+    return false;
+  ray.max_t = t_max;
+  i->t = t_max;
+  i->primitive = prims[q];
+  i->primitive_id = q;
+  i->u = u;
+  i->v = v;
+  return true;
+}
+
+/**
+ * Ray - sphere test with the same arithmetic as Sphere::test.
+ * \param t1 start of the segment, set to the hit on return
+ * \param t2 end of the segment
+ */
+static inline bool sphere_test(const BVHSphere &sphere, const Ray &r,
+                               double &t1, double t2) {
+  Vector3D oc = r.o - sphere.o;
+  double a = dot(r.d, r.d);
+  double b = 2 * dot(oc, r.d);
+  double c = dot(oc, oc) - sphere.r2;
+  double delta = b * b - 4 * a * c;
+  if (delta < 0)
+    return false;
+  double tmp = sqrt(delta);
+  double low = (-b - tmp) / (2 * a);
+  double high = (-b + tmp) / (2 * a);
+  if (low > t1 && low < t2) {
+    t1 = low;
+    return true;
+  }
+  if (high > t1 && high < t2) {
+    t1 = high;
+    return true;
+  }
+  return false;
+}
+
+/**
+ * Nearest hit of a ray with a run of sphere references.
+ */
+static inline bool intersect_sphere_run(const std::vector<BVHSphere> &spheres,
+                                        const std::vector<Primitive *> &prims,
+                                        uint32_t start, uint32_t count,
+                                        const Ray &ray, Intersection *i) {
+  long q = -1;
+  double t = ray.min_t;
+  for (uint32_t p = start; p < start + count; p++) {
+    double t1 = ray.min_t;
+    if (sphere_test(spheres[p], ray, t1, std::min(i->t, ray.max_t))) {
+      ray.max_t = t = t1;
+      q = p;
+    }
+  }
+  if (q < 0)
+    return false;
+  i->t = t;
+  i->primitive = prims[q];
+  i->primitive_id = q;
+  return true;
+}
+
+bool BVHAccel::intersect_leaf(uint32_t start, uint32_t count, const Ray &ray,
+                              const RayTriangleData &rt,
+                              Intersection *i) const {
+  if (all_triangles)
+    return intersect_triangle_run(triangles, primitives, start, count, ray, rt,
+                                  i);
+
+  // one call per run of references of the same kind
+  bool hit = false;
+  uint32_t end = start + count;
+  for (uint32_t p = start, q; p < end; p = q) {
+    for (q = p + 1; q < end && kinds[q] == kinds[p]; q++) {
+    }
+    switch (kinds[p]) {
+    case BVH_PRIMITIVE_TRIANGLE:
+      hit = intersect_triangle_run(triangles, primitives, p, q - p, ray, rt,
+                                   i) || hit;
+      break;
+    case BVH_PRIMITIVE_SPHERE:
+      hit = intersect_sphere_run(spheres, primitives, p, q - p, ray, i) || hit;
+      break;
+    default:
+      for (uint32_t k = p; k < q; k++) {
+        if (primitives[k]->intersect(ray, i)) {
+          i->primitive_id = k;
+          hit = true;
+        }
+      }
+      break;
+    }
+  }
+  return hit;
+}
+
+bool BVHAccel::occluded_leaf(uint32_t start, uint32_t count, const Ray &ray,
+                             const RayTriangleData &rt) const {
+  Real t_max = ray.max_t, u, v;
+  if (all_triangles)
+    return ray_triangle_nearest(triangles, start, count, rt, ray.min_t, &t_max,
+                                &u, &v) >= 0;
+
+  uint32_t end = start + count;
+  for (uint32_t p = start, q; p < end; p = q) {
+    for (q = p + 1; q < end && kinds[q] == kinds[p]; q++) {
+    }
+    switch (kinds[p]) {
+    case BVH_PRIMITIVE_TRIANGLE:
+      if (ray_triangle_nearest(triangles, p, q - p, rt, ray.min_t, &t_max, &u,
+                               &v) >= 0)
         return true;
+      break;
+    case BVH_PRIMITIVE_SPHERE:
+      for (uint32_t k = p; k < q; k++) {
+        double t1 = ray.min_t;
+        if (sphere_test(spheres[k], ray, t1, ray.max_t))
+          return true;
+      }
+      break;
+    default:
+      for (uint32_t k = p; k < q; k++) {
+        if (primitives[k]->has_intersection(ray))
+          return true;
       }
+      break;
     }
+  }
+  return false;
+}
+
+bool BVHAccel::occluded_binary(const Ray &ray,
+                               BVHTraversalStats &stats) const {
+  RayBoxData r(ray);
+  RayTriangleData rt(ray);
+  float t_max = ray.max_t;
+  struct {
+    uint32_t index;
+    int depth;
+  } stack[BVH_MAX_DEPTH];
+  int sp = 0;
+  uint32_t index = 0;
+  int depth = 0, max_depth = 0;
+  bool blocked = false;
+  while (true) {
+    const LinearBVHNode &node = node_data[index];
+    stats.box_tests++;
+    if (intersect_node(node, r, t_max)) {
+      max_depth = std::max(max_depth, depth);
+      if (node.is_leaf()) {
+        stats.primitive_tests += node.count;
+        if (occluded_leaf(node.offset, node.count, ray, rt)) {
+          blocked = true;
+          break;
+        }
+      } else {
+        stats.node_visits++;
+        stack[sp].index = node.offset + 1;
+        stack[sp].depth = ++depth;
+        sp++;
+        index = node.offset;
+        continue;
+      }
+    }
+    if (sp == 0)
+      break;
+    sp--;
+    index = stack[sp].index;
+    depth = stack[sp].depth;
+  }
+  record_depth(stats, max_depth);
+  return blocked;
+}
+
+bool BVHAccel::intersect_binary(const Ray &ray, Intersection *i,
+                                BVHTraversalStats &stats) const {
+  RayBoxData r(ray);
+  RayTriangleData rt(ray);
+  stats.box_tests++;
+  if (!intersect_node(node_data[0], r, ray.max_t)) {
+    record_depth(stats, 0);
     return false;
   }
-  bool answer1 = has_intersection(ray, node->l);
 
-  bool answer2 = has_intersection(ray, node->r);
+  // far children are stacked with their entry distance so they can be
+  // dropped once a closer hit has been found
+  struct {
+    uint32_t index;
+    int depth;
+    float t;
+  } stack[BVH_MAX_DEPTH];
+  int sp = 0;
+  uint32_t index = 0;
+  int depth = 0, max_depth = 0;
+  bool hit = false;
+  while (true) {
+    const LinearBVHNode &node = node_data[index];
+    max_depth = std::max(max_depth, depth);
+    if (node.is_leaf()) {
+      // primitives shrink ray.max_t on every hit
+      stats.primitive_tests += node.count;
+      hit = intersect_leaf(node.offset, node.count, ray, rt, i) || hit;
+    } else {
+      stats.node_visits++;
+      stats.box_tests += 2;
+      uint32_t near = node.offset, far = node.offset + 1;
+      float t_near, t_far;
+      bool hit_near = intersect_node(node_data[near], r, ray.max_t, &t_near);
+      bool hit_far = intersect_node(node_data[far], r, ray.max_t, &t_far);
+      depth++;
+      if (hit_near && hit_far) {
+        if (t_far < t_near) {
+          std::swap(near, far);
+          std::swap(t_near, t_far);
+        }
+        stack[sp].index = far;
+        stack[sp].depth = depth;
+        stack[sp].t = t_far;
+        sp++;
+        index = near;
+        continue;
+      } else if (hit_near) {
+        index = near;
+        continue;
+      } else if (hit_far) {
+        index = far;
+        continue;
+      }
+    }
+
+    // pop the next subtree that can still contain a closer hit
+    while (sp > 0 && stack[sp - 1].t > ray.max_t) {
+      stats.culled++;
+      sp--;
+    }
+    if (sp == 0)
+      break;
+    sp--;
+    index = stack[sp].index;
+    depth = stack[sp].depth;
+  }
+  record_depth(stats, max_depth);
+  return hit;
+}
+
+static inline int intersect_children(const WideBVHNode<4> &node,
+                                     const RayBoxData &r, float t_max,
+                                     float *t_entry) {
+  return ray_box_intersect4(node.bounds, r, t_max, t_entry);
+}
 
-  return answer1 || answer2;
+static inline int intersect_children(const WideBVHNode<8> &node,
+                                     const RayBoxData &r, float t_max,
+                                     float *t_entry) {
+  return ray_box_intersect8(node.bounds, r, t_max, t_entry);
 }
 
-bool BVHAccel::intersect(const Ray &ray, Intersection *i, BVHNode *node) const {
-  // TODO (Part 2.3):
-  // Fill in the intersect function.
-  double t0 = ray.min_t;
-  double t1 = ray.max_t;
-  if (!node->bb.intersect(
-          ray, t0,
-          t1)) // If the ray doesn't intersect the bounding box, return false
-  {
-    return false;
+/**
+ * Decode the child boxes of a quantized node and test them. The decoded
+ * bounds are the same as the ones checked by quantize(): q * step is exact,
+ * so only the final add rounds, with or without a fused multiply-add.
+ */
+static inline int intersect_children(const QuantizedBVHNode4 &node,
+                                     const RayBoxData &r, float t_max,
+                                     float *t_entry) {
+  RayBox4 boxes;
+  for (int a = 0; a < 3; a++) {
+    float step = exp2_float(node.exponent[a]);
+#ifdef __SSE4_1__
+    __m128 origin = _mm_set1_ps(node.origin[a]);
+    __m128 scale = _mm_set1_ps(step);
+    int32_t lo, hi;
+    memcpy(&lo, node.lo[a], sizeof(lo));
+    memcpy(&hi, node.hi[a], sizeof(hi));
+    __m128 qlo = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(lo)));
+    __m128 qhi = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(hi)));
+    _mm_store_ps(boxes.bounds[0][a], _mm_add_ps(origin, _mm_mul_ps(qlo, scale)));
+    _mm_store_ps(boxes.bounds[1][a], _mm_add_ps(origin, _mm_mul_ps(qhi, scale)));
+#else
+    for (int c = 0; c < 4; c++) {
+      boxes.bounds[0][a][c] = node.origin[a] + node.lo[a][c] * step;
+      boxes.bounds[1][a][c] = node.origin[a] + node.hi[a][c] * step;
+    }
+#endif
   }
+  return ray_box_intersect4(boxes, r, t_max, t_entry) & node.used;
+}
 
+/**
+ * Traversal stack entry of the wide BVH: a node, or a leaf range when count
+ * is non-zero, together with its entry distance.
+ */
+struct WideStackEntry {
+  uint32_t index;
+  uint32_t count;
+  float t;
+  int depth;
+};
+
+template <typename Node>
+bool BVHAccel::intersect_wide(const Node *wide, const Ray &ray,
+                              Intersection *i,
+                              BVHTraversalStats &stats) const {
+  const int N = Node::width;
+  RayBoxData r(ray);
+  RayTriangleData rt(ray);
+  // every visit pops one entry and pushes at most N, and the depth is
+  // bounded by the binary tree the nodes were collapsed from
+  WideStackEntry stack[BVH_MAX_DEPTH * (N - 1) + 1];
+  int sp = 0;
+  stack[sp++] = {0, 0, r.t_min, 0};
+  alignas(32) float t_entry[N];
+  int max_depth = 0;
   bool hit = false;
-  if (node->isLeaf()) {
-    Intersection *betterI = i;
-    for (auto p = node->start; p != node->end; p++) {
-      total_isects++;
-      hit = (*p)->intersect(ray, i) || hit;
-      if (betterI->t > i->t) {
-        betterI = i;
+  while (sp > 0) {
+    WideStackEntry e = stack[--sp];
+    if (e.t > ray.max_t) {
+      stats.culled++;
+      continue;
+    }
+    max_depth = std::max(max_depth, e.depth);
+    if (e.count) {
+      // primitives shrink ray.max_t on every hit
+      stats.primitive_tests += e.count;
+      hit = intersect_leaf(e.index, e.count, ray, rt, i) || hit;
+      continue;
+    }
+
+    const Node &node = wide[e.index];
+    stats.node_visits++;
+    stats.box_tests += N;
+    int mask = intersect_children(node, r, ray.max_t, t_entry);
+
+    // push hit children far to near so the nearest is visited next
+    WideStackEntry hits[N];
+    int n = 0;
+    for (int c = 0; c < N; c++) {
+      if (!(mask & (1 << c)))
+        continue;
+      WideStackEntry h = {node.child[c], node.count[c], t_entry[c],
+                          e.depth + 1};
+      int k = n++;
+      for (; k > 0 && hits[k - 1].t < h.t; k--)
+        hits[k] = hits[k - 1];
+      hits[k] = h;
+    }
+    for (int k = 0; k < n; k++)
+      stack[sp++] = hits[k];
+  }
+  record_depth(stats, max_depth);
+  return hit;
+}
+
+template <typename Node>
+bool BVHAccel::occluded_wide(const Node *wide, const Ray &ray,
+                             BVHTraversalStats &stats) const {
+  const int N = Node::width;
+  RayBoxData r(ray);
+  RayTriangleData rt(ray);
+  struct {
+    uint32_t index;
+    int depth;
+  } stack[BVH_MAX_DEPTH * (N - 1) + 1];
+  int sp = 0;
+  stack[sp].index = 0;
+  stack[sp].depth = 0;
+  sp++;
+  alignas(32) float t_entry[N];
+  int max_depth = 0;
+  while (sp > 0) {
+    sp--;
+    const Node &node = wide[stack[sp].index];
+    int depth = stack[sp].depth;
+    max_depth = std::max(max_depth, depth);
+    stats.node_visits++;
+    stats.box_tests += N;
+    int mask = intersect_children(node, r, ray.max_t, t_entry);
+    for (int c = 0; c < N; c++) {
+      if (!(mask & (1 << c)))
+        continue;
+      if (!node.count[c]) {
+        stack[sp].index = node.child[c];
+        stack[sp].depth = depth + 1;
+        sp++;
+        continue;
+      }
+      max_depth = std::max(max_depth, depth + 1);
+      stats.primitive_tests += node.count[c];
+      if (occluded_leaf(node.child[c], node.count[c], ray, rt)) {
+        record_depth(stats, max_depth);
+        return true;
       }
     }
-    i = betterI;
-    return hit;
-  } else {
-    bool answer1 = intersect(ray, i, node->l);
-    Intersection *betterI = i;
-    bool answer2 = intersect(ray, i, node->r);
-    if (betterI->t < i->t) {
-      i = betterI;
+  }
+  record_depth(stats, max_depth);
+  return false;
+}
+
+/**
+ * Number of rays in a packet mask.
+ */
+static inline int mask_count(uint64_t mask) {
+#ifdef __GNUC__
+  return __builtin_popcountll(mask);
+#else
+  int n = 0;
+  for (; mask; mask &= mask - 1)
+    n++;
+  return n;
+#endif
+}
+
+/**
+ * Index of the first ray in a non-empty packet mask.
+ */
+static inline int mask_first(uint64_t mask) {
+#ifdef __GNUC__
+  return __builtin_ctzll(mask);
+#else
+  int k = 0;
+  for (; !(mask & 1); mask >>= 1)
+    k++;
+  return k;
+#endif
+}
+
+/**
+ * Slab test of a box against the rays of a packet mask, skipping the box
+ * with a single interval test when the whole packet misses it.
+ * \param t_entry if not NULL, receives the entry time of every tested ray
+ */
+static inline uint64_t packet_box_test(const float *box,
+                                       const RayPacketData &p,
+                                       const RayPacketInterval &interval,
+                                       uint64_t mask,
+                                       BVHTraversalStats &stats,
+                                       float *t_entry = NULL) {
+  if (interval.valid && (mask & (mask - 1))) {
+    stats.box_tests++;
+    if (!ray_box_intersect_interval(box, interval)) {
+      stats.culled++;
+      return 0;
+    }
+  }
+  stats.box_tests += mask_count(mask);
+  return ray_box_intersect_packet(box, p, mask, t_entry);
+}
+
+void BVHAccel::intersect_packet(const Ray *rays, Intersection *i, bool *hit,
+                                size_t n) const {
+  BVHTraversalStats &stats = thread_stats();
+  stats.rays += n;
+  for (size_t k = 0; k < n; k++)
+    hit[k] = false;
+  if (primitives.empty() || n == 0)
+    return;
+
+  RayPacketData p;
+  for (size_t k = 0; k < n; k++)
+    p.set(k, rays[k]);
+  uint64_t active =
+      n < RAY_PACKET_SIZE ? (uint64_t(1) << n) - 1 : ~uint64_t(0);
+
+  switch (options.node_format) {
+  case BVH_NODE_WIDE4:
+    intersect_packet_wide(node4_data, rays, i, hit, p, active, stats);
+    break;
+  case BVH_NODE_WIDE8:
+    intersect_packet_wide(node8_data, rays, i, hit, p, active, stats);
+    break;
+  case BVH_NODE_QUANTIZED4:
+    intersect_packet_wide(node4q_data, rays, i, hit, p, active, stats);
+    break;
+  default:
+    intersect_packet_binary(rays, i, hit, p, active, stats);
+    break;
+  }
+  for (size_t k = 0; k < n; k++)
+    if (hit[k])
+      finalize_hit(rays[k], &i[k]);
+}
+
+/**
+ * Intersect the rays of a packet mask with the primitives of a leaf, keeping
+ * the segment ends of the packet in sync with the rays.
+ */
+void BVHAccel::intersect_packet_leaf(uint32_t start, uint32_t count,
+                                     const Ray *rays, Intersection *i,
+                                     bool *hit, RayPacketData &p,
+                                     uint64_t mask,
+                                     BVHTraversalStats &stats) const {
+  stats.primitive_tests += (unsigned long long)count * mask_count(mask);
+  for (; mask; mask &= mask - 1) {
+    int k = mask_first(mask);
+    RayTriangleData rt(rays[k]);
+    hit[k] = intersect_leaf(start, count, rays[k], rt, &i[k]) || hit[k];
+    p.t_max[k] = rays[k].max_t;
+  }
+}
+
+void BVHAccel::intersect_packet_binary(const Ray *rays, Intersection *i,
+                                       bool *hit, RayPacketData &p,
+                                       uint64_t active,
+                                       BVHTraversalStats &stats) const {
+  // every node is retested when it is visited, which also drops the rays
+  // that found a closer hit since it was pushed
+  RayPacketInterval interval(p, active);
+  struct {
+    uint32_t index;
+    int depth;
+    uint64_t mask;
+  } stack[BVH_MAX_DEPTH + 1];
+  int sp = 0;
+  stack[sp].index = 0;
+  stack[sp].depth = 0;
+  stack[sp].mask = active;
+  sp++;
+  int max_depth = 0;
+  while (sp > 0) {
+    sp--;
+    const LinearBVHNode &node = node_data[stack[sp].index];
+    int depth = stack[sp].depth;
+    uint64_t mask =
+        packet_box_test(node.min, p, interval, stack[sp].mask, stats);
+    if (!mask)
+      continue;
+    max_depth = std::max(max_depth, depth);
+    if (node.is_leaf()) {
+      intersect_packet_leaf(node.offset, node.count, rays, i, hit,
+                            p, mask, stats);
+      continue;
+    }
+
+    // visit first the child on the side the packet comes from, judged by
+    // the first ray along the axis that separates the children most
+    stats.node_visits++;
+    const LinearBVHNode &l = node_data[node.offset];
+    const LinearBVHNode &r = node_data[node.offset + 1];
+    int axis = 0;
+    float separation = 0;
+    for (int a = 0; a < 3; a++) {
+      float d = (r.min[a] + r.max[a]) - (l.min[a] + l.max[a]);
+      if (fabsf(d) > fabsf(separation)) {
+        separation = d;
+        axis = a;
+      }
+    }
+    bool left_first =
+        (separation >= 0) == (p.inv_d[axis][mask_first(mask)] >= 0);
+    uint32_t near = left_first ? node.offset : node.offset + 1;
+    uint32_t far = left_first ? node.offset + 1 : node.offset;
+    stack[sp].index = far;
+    stack[sp].depth = depth + 1;
+    stack[sp].mask = mask;
+    sp++;
+    stack[sp].index = near;
+    stack[sp].depth = depth + 1;
+    stack[sp].mask = mask;
+    sp++;
+  }
+  for (uint64_t m = active; m; m &= m - 1)
+    record_depth(stats, max_depth);
+}
+
+/**
+ * Bounds of a child slot of a wide node in the 8 float layout.
+ * \return false if the slot is unused
+ */
+template <int N>
+static inline bool child_box(const WideBVHNode<N> &node, int c, float *box) {
+  if (!node.count[c] && !node.child[c])
+    return false;
+  for (int a = 0; a < 3; a++) {
+    box[a] = node.bounds.bounds[0][a][c];
+    box[4 + a] = node.bounds.bounds[1][a][c];
+  }
+  return true;
+}
+
+static inline bool child_box(const QuantizedBVHNode4 &node, int c,
+                             float *box) {
+  if (!(node.used & (1 << c)))
+    return false;
+  for (int a = 0; a < 3; a++) {
+    float step = exp2_float(node.exponent[a]);
+    box[a] = node.origin[a] + node.lo[a][c] * step;
+    box[4 + a] = node.origin[a] + node.hi[a][c] * step;
+  }
+  return true;
+}
+
+/**
+ * Traversal stack entry of a packet in the wide BVH: a node, or a leaf range
+ * when count is non-zero, with the rays that entered it.
+ */
+struct PacketStackEntry {
+  uint32_t index;
+  uint32_t count;
+  uint64_t mask;
+  float t;
+  int depth;
+};
+
+template <typename Node>
+void BVHAccel::intersect_packet_wide(const Node *wide, const Ray *rays,
+                                     Intersection *i, bool *hit,
+                                     RayPacketData &p, uint64_t active,
+                                     BVHTraversalStats &stats) const {
+  const int N = Node::width;
+  RayPacketInterval interval(p, active);
+  PacketStackEntry stack[BVH_MAX_DEPTH * (N - 1) + 1];
+  int sp = 0;
+  stack[sp++] = {0, 0, active, 0, 0};
+  alignas(32) float t_entry[RAY_PACKET_SIZE];
+  alignas(32) float box[8];
+  int max_depth = 0;
+  while (sp > 0) {
+    PacketStackEntry e = stack[--sp];
+    max_depth = std::max(max_depth, e.depth);
+    if (e.count) {
+      intersect_packet_leaf(e.index, e.count, rays, i, hit, p,
+                            e.mask, stats);
+      continue;
+    }
+
+    const Node &node = wide[e.index];
+    stats.node_visits++;
+
+    // push hit children far to near, ordered by the entry distance of the
+    // first ray in each, so the nearest is visited next
+    PacketStackEntry hits[N];
+    int n = 0;
+    for (int c = 0; c < N; c++) {
+      if (!child_box(node, c, box))
+        continue;
+      uint64_t mask =
+          packet_box_test(box, p, interval, e.mask, stats, t_entry);
+      if (!mask)
+        continue;
+      PacketStackEntry h = {node.child[c], node.count[c], mask,
+                            t_entry[mask_first(mask)], e.depth + 1};
+      int k = n++;
+      for (; k > 0 && hits[k - 1].t < h.t; k--)
+        hits[k] = hits[k - 1];
+      hits[k] = h;
+    }
+    for (int k = 0; k < n; k++)
+      stack[sp++] = hits[k];
+  }
+  for (uint64_t m = active; m; m &= m - 1)
+    record_depth(stats, max_depth);
+}
+
+void BVHAccel::occluded_packet(const Ray *rays, bool *blocked,
+                               size_t n) const {
+  BVHTraversalStats &stats = thread_stats();
+  stats.rays += n;
+  for (size_t k = 0; k < n; k++)
+    blocked[k] = false;
+  if (primitives.empty() || n == 0)
+    return;
+
+  RayPacketData p;
+  for (size_t k = 0; k < n; k++)
+    p.set(k, rays[k]);
+  uint64_t active =
+      n < RAY_PACKET_SIZE ? (uint64_t(1) << n) - 1 : ~uint64_t(0);
+
+  uint64_t mask;
+  switch (options.node_format) {
+  case BVH_NODE_WIDE4:
+    mask = occluded_packet_wide(node4_data, rays, p, active, stats);
+    break;
+  case BVH_NODE_WIDE8:
+    mask = occluded_packet_wide(node8_data, rays, p, active, stats);
+    break;
+  case BVH_NODE_QUANTIZED4:
+    mask = occluded_packet_wide(node4q_data, rays, p, active, stats);
+    break;
+  default:
+    mask = occluded_packet_binary(rays, p, active, stats);
+    break;
+  }
+  for (size_t k = 0; k < n; k++)
+    blocked[k] = (mask >> k) & 1;
+}
+
+/**
+ * Test the segments of the rays of a packet mask against the primitives of
+ * a leaf, each ray stopping at its first blocker.
+ * \return bit mask of the rays that are blocked
+ */
+uint64_t BVHAccel::occluded_packet_leaf(uint32_t start, uint32_t count,
+                                        const Ray *rays, uint64_t mask,
+                                        BVHTraversalStats &stats) const {
+  uint64_t blocked = 0;
+  stats.primitive_tests += (unsigned long long)count * mask_count(mask);
+  for (; mask; mask &= mask - 1) {
+    int k = mask_first(mask);
+    RayTriangleData rt(rays[k]);
+    if (occluded_leaf(start, count, rays[k], rt))
+      blocked |= uint64_t(1) << k;
+  }
+  return blocked;
+}
+
+uint64_t BVHAccel::occluded_packet_binary(const Ray *rays,
+                                          const RayPacketData &p,
+                                          uint64_t active,
+                                          BVHTraversalStats &stats) const {
+  RayPacketInterval interval(p, active);
+  struct {
+    uint32_t index;
+    int depth;
+    uint64_t mask;
+  } stack[BVH_MAX_DEPTH + 1];
+  int sp = 0;
+  stack[sp].index = 0;
+  stack[sp].depth = 0;
+  stack[sp].mask = active;
+  sp++;
+  int max_depth = 0;
+  uint64_t blocked = 0;
+  while (sp > 0 && blocked != active) {
+    sp--;
+    const LinearBVHNode &node = node_data[stack[sp].index];
+    int depth = stack[sp].depth;
+    // rays blocked since the node was pushed are done
+    uint64_t mask = packet_box_test(node.min, p, interval,
+                                    stack[sp].mask & ~blocked, stats);
+    if (!mask)
+      continue;
+    max_depth = std::max(max_depth, depth);
+    if (node.is_leaf()) {
+      blocked |= occluded_packet_leaf(node.offset, node.count,
+                                      rays, mask, stats);
+      continue;
+    }
+    stats.node_visits++;
+    stack[sp].index = node.offset + 1;
+    stack[sp].depth = depth + 1;
+    stack[sp].mask = mask;
+    sp++;
+    stack[sp].index = node.offset;
+    stack[sp].depth = depth + 1;
+    stack[sp].mask = mask;
+    sp++;
+  }
+  for (uint64_t m = active; m; m &= m - 1)
+    record_depth(stats, max_depth);
+  return blocked;
+}
+
+template <typename Node>
+uint64_t BVHAccel::occluded_packet_wide(const Node *wide, const Ray *rays,
+                                        const RayPacketData &p,
+                                        uint64_t active,
+                                        BVHTraversalStats &stats) const {
+  const int N = Node::width;
+  RayPacketInterval interval(p, active);
+  struct {
+    uint32_t index;
+    int depth;
+    uint64_t mask;
+  } stack[BVH_MAX_DEPTH * (N - 1) + 1];
+  int sp = 0;
+  stack[sp].index = 0;
+  stack[sp].depth = 0;
+  stack[sp].mask = active;
+  sp++;
+  alignas(32) float box[8];
+  int max_depth = 0;
+  uint64_t blocked = 0;
+  while (sp > 0 && blocked != active) {
+    sp--;
+    uint64_t mask = stack[sp].mask & ~blocked;
+    if (!mask)
+      continue;
+    const Node &node = wide[stack[sp].index];
+    int depth = stack[sp].depth;
+    max_depth = std::max(max_depth, depth);
+    stats.node_visits++;
+    for (int c = 0; c < N && mask; c++) {
+      if (!child_box(node, c, box))
+        continue;
+      uint64_t child = packet_box_test(box, p, interval, mask, stats);
+      if (!child)
+        continue;
+      if (!node.count[c]) {
+        stack[sp].index = node.child[c];
+        stack[sp].depth = depth + 1;
+        stack[sp].mask = child;
+        sp++;
+        continue;
+      }
+      max_depth = std::max(max_depth, depth + 1);
+      uint64_t b = occluded_packet_leaf(node.child[c],
+                                        node.count[c], rays, child, stats);
+      blocked |= b;
+      mask &= ~b;
+    }
+  }
+  for (uint64_t m = active; m; m &= m - 1)
+    record_depth(stats, max_depth);
+  return blocked;
+}
+
+/**
+ * Sort key of a ray in a stream: the octant of its direction above the 27 bit
+ * Morton code of its origin, so rays of one octant are ordered along the
+ * Morton curve. The leading stream_cell_bits bits of each axis name the bin.
+ */
+struct StreamKey {
+  uint32_t key;
+  uint32_t index;
+  bool operator<(const StreamKey &other) const { return key < other.key; }
+};
+
+static const int stream_cell_bits = 4;
+
+void BVHAccel::intersect_stream(const Ray *rays, Intersection *i, bool *hit,
+                                size_t n) const {
+  if (primitives.empty()) {
+    BVHTraversalStats &stats = thread_stats();
+    stats.rays += n;
+    for (size_t k = 0; k < n; k++)
+      hit[k] = false;
+    return;
+  }
+
+  // origins are placed on a 512^3 grid over the bounds, origins outside
+  // (e.g. the camera) are clamped to the nearest cell
+  BBox bb = get_bbox();
+  Vector3D scale;
+  for (int a = 0; a < 3; a++)
+    scale[a] = bb.extent[a] > 0 ? 512 / bb.extent[a] : 0;
+  std::vector<StreamKey> keys(n);
+  for (size_t k = 0; k < n; k++) {
+    Vector3D c = rays[k].o - bb.min;
+    for (int a = 0; a < 3; a++)
+      c[a] = std::min(std::max(c[a] * scale[a], 0.0), 511.0);
+    uint32_t octant = rays[k].sign[0] | rays[k].sign[1] << 1 |
+                      rays[k].sign[2] << 2;
+    keys[k].key = octant << 27 | encode_morton3(c);
+    keys[k].index = k;
+  }
+  std::sort(keys.begin(), keys.end());
+
+  const int bin_shift = 3 * (9 - stream_cell_bits);
+  std::vector<Ray> packet;
+  packet.reserve(RAY_PACKET_SIZE);
+  for (size_t start = 0; start < n;) {
+    uint32_t bin = keys[start].key >> bin_shift;
+    size_t end = start;
+    packet.clear();
+    while (end < n && end - start < RAY_PACKET_SIZE &&
+           keys[end].key >> bin_shift == bin) {
+      packet.push_back(rays[keys[end].index]);
+      end++;
+    }
+
+    Intersection isects[RAY_PACKET_SIZE];
+    bool hits[RAY_PACKET_SIZE];
+    intersect_packet(packet.data(), isects, hits, packet.size());
+    for (size_t k = 0; k < packet.size(); k++) {
+      uint32_t index = keys[start + k].index;
+      hit[index] = hits[k];
+      if (hits[k]) {
+        rays[index].max_t = packet[k].max_t;
+        i[index] = isects[k];
+      }
     }
-    return answer1 || answer2;
+    start = end;
   }
 }
 
 } // namespace SceneObjects
-} // namespace CGL
\ No newline at end of file
+} // namespace CGL
@@ -3,11 +3,186 @@
 
 #include "scene.h"
 #include "aggregate.h"
+#include "ray_box.h"
+#include "ray_triangle.h"
 
+#include <cstdint>
+#include <new>
+#include <string>
+#include <utility>
 #include <vector>
 
 namespace CGL { namespace SceneObjects {
 
+/**
+ * Strategy used to partition primitives while building the BVH.
+ */
+enum BVHBuildMethod {
+  BVH_BUILD_MEDIAN, ///< split at the median centroid along the longest axis
+  BVH_BUILD_SAH,    ///< binned surface area heuristic over all three axes
+  BVH_BUILD_LBVH,   ///< linear BVH emitted from sorted Morton codes
+  BVH_BUILD_HLBVH,  ///< LBVH treelets joined by a SAH-built top level
+  BVH_BUILD_SBVH    ///< SAH with spatial splits that clip references
+};
+
+/**
+ * Layout of the tree used for traversal, named by the number of children
+ * per node.
+ */
+enum BVHNodeFormat {
+  BVH_NODE_BINARY = 2, ///< 32 byte binary nodes, one box test per visit
+  BVH_NODE_WIDE4 = 4,  ///< 4 child boxes per node tested with SSE
+  BVH_NODE_WIDE8 = 8,  ///< 8 child boxes per node tested with AVX
+  BVH_NODE_QUANTIZED4 = 5 ///< 4 child boxes quantized to 8 bits, 64 bytes
+};
+
+/**
+ * Order of the traversal nodes in memory.
+ */
+enum BVHNodeLayout {
+  BVH_LAYOUT_DEPTH_FIRST, ///< preorder, a subtree follows its root
+  BVH_LAYOUT_TREELET      ///< top-down treelets of treelet_bytes each, so
+                          ///< the upper levels of a subtree share pages
+};
+
+/**
+ * Parameters controlling BVH construction.
+ */
+struct BVHBuildOptions {
+
+  BVHBuildOptions() {
+    method = BVH_BUILD_MEDIAN;
+    max_leaf_size = 4;
+    sah_bins = 16;
+    sah_max_leaf_size = 16;
+    sah_traversal_cost = 1.0;
+    sah_intersection_cost = 1.0;
+    num_threads = 1;
+    parallel_cutoff = 4096;
+    hlbvh_treelet_bits = 12;
+    node_format = BVH_NODE_BINARY;
+    sbvh_alpha = 1e-5;
+    sbvh_duplication_budget = 0.3;
+    refit_rebuild_threshold = 1.5;
+    node_layout = BVH_LAYOUT_DEPTH_FIRST;
+    treelet_bytes = 4096;
+  }
+
+  BVHBuildMethod method;        ///< partitioning strategy
+  size_t max_leaf_size;         ///< leaf size of the median and LBVH builders
+  size_t sah_bins;              ///< number of centroid bins per axis
+  size_t sah_max_leaf_size;     ///< hard cap on SAH leaves
+  double sah_traversal_cost;    ///< relative cost of visiting a node
+  double sah_intersection_cost; ///< relative cost of a primitive test
+  size_t num_threads;           ///< threads the builder may use
+  size_t parallel_cutoff;       ///< smallest range worth handing to a thread
+  size_t hlbvh_treelet_bits;    ///< leading Morton bits shared by a treelet
+  BVHNodeFormat node_format;    ///< traversal tree layout
+  double sbvh_alpha;            ///< child overlap (relative to the root
+                                ///< area) above which spatial splits are tried
+  double sbvh_duplication_budget; ///< extra references allowed, as a
+                                  ///< fraction of the primitive count
+  double refit_rebuild_threshold; ///< growth of a subtree's relative SAH
+                                  ///< cost at which refit rebuilds it,
+                                  ///< 0 to only update bounds
+  std::string cache_dir;        ///< directory of the on-disk BVH cache,
+                                ///< empty to always build
+  BVHNodeLayout node_layout;    ///< order of the traversal nodes
+  size_t treelet_bytes;         ///< size of a treelet, one page by default
+};
+
+/**
+ * Parse a builder name given on the command line ("median", "sah", "lbvh",
+ * "hlbvh" or "sbvh").
+ * \return true if the name was recognized and written to method
+ */
+bool parse_bvh_build_method(const std::string& name, BVHBuildMethod* method);
+
+/**
+ * Human readable name of a builder, used in logging.
+ */
+const char* bvh_build_method_name(BVHBuildMethod method);
+
+/**
+ * Parse a BVH width given on the command line ("2", "4", "8", or "4q" for
+ * quantized 4 wide nodes).
+ * \return true if the width is supported and was written to format
+ */
+bool parse_bvh_node_format(const std::string& width, BVHNodeFormat* format);
+
+/**
+ * Name of a node format as accepted by parse_bvh_node_format.
+ */
+const char* bvh_node_format_name(BVHNodeFormat format);
+
+/**
+ * Size in bytes of one traversal node of the given format.
+ */
+size_t bvh_node_size(BVHNodeFormat format);
+
+/**
+ * Parse a node layout given on the command line ("dfs" or "treelet").
+ * \return true if the name was recognized and written to layout
+ */
+bool parse_bvh_node_layout(const std::string& name, BVHNodeLayout* layout);
+
+/**
+ * Name of a node layout as accepted by parse_bvh_node_layout.
+ */
+const char* bvh_node_layout_name(BVHNodeLayout layout);
+
+/**
+ * Allocator aligning the traversal node arrays to cache lines, so that a
+ * node pair or a wide node starts a line instead of straddling two.
+ */
+template <typename T, size_t Align = 64>
+struct AlignedAllocator {
+  typedef T value_type;
+
+  template <typename U>
+  struct rebind { typedef AlignedAllocator<U, Align> other; };
+
+  AlignedAllocator() { }
+  template <typename U>
+  AlignedAllocator(const AlignedAllocator<U, Align>&) { }
+
+  T* allocate(size_t n) {
+    return static_cast<T*>(
+        ::operator new(n * sizeof(T), std::align_val_t(Align)));
+  }
+
+  void deallocate(T* p, size_t) {
+    ::operator delete(p, std::align_val_t(Align));
+  }
+
+  template <typename U>
+  bool operator==(const AlignedAllocator<U, Align>&) const { return true; }
+  template <typename U>
+  bool operator!=(const AlignedAllocator<U, Align>&) const { return false; }
+};
+
+/**
+ * Key of a BVH in the on-disk cache.
+ * Hashes the primitive bounds, triangle vertices and every build option that
+ * changes the tree, so a cached BVH is only reused for identical input. The
+ * thread count is left out since parallel builds produce the same tree.
+ * \param primitives primitives the BVH is built from, in input order
+ * \param options build options
+ * \return 64 bit hash of geometry and options
+ */
+uint64_t bvh_cache_key(const std::vector<Primitive*>& primitives,
+                       const BVHBuildOptions& options);
+
+/**
+ * Per-primitive data cached for the duration of a build so that the builders
+ * do not have to call the virtual get_bbox() in their inner loops.
+ */
+struct BVHBuildPrim {
+  BBox bb;            ///< bounding box of the primitive
+  Vector3D centroid;  ///< centroid of the bounding box
+  Primitive* prim;    ///< the primitive itself
+};
+
 
 /**
  * A node in the BVH accelerator aggregate.
@@ -21,7 +196,7 @@ namespace CGL { namespace SceneObjects {
  */
 struct BVHNode {
 
-  BVHNode(BBox bb): bb(bb), l(NULL), r(NULL) { }
+  BVHNode(BBox bb): bb(bb), l(NULL), r(NULL), cost(0) { }
 
   ~BVHNode() {
     if (l) delete l;
@@ -33,11 +208,146 @@ struct BVHNode {
   BBox bb;        ///< bounding box of the node
   BVHNode* l;     ///< left child node
   BVHNode* r;     ///< right child node
+  double cost;    ///< SAH cost of the subtree relative to its area, as built
 
   std::vector<Primitive*>::const_iterator start;
   std::vector<Primitive*>::const_iterator end;
 };
 
+/**
+ * Maximum depth of a BVH. Builders turn nodes at this depth into leaves so
+ * that traversal can use a fixed-size stack.
+ */
+#define BVH_MAX_DEPTH 64
+
+/**
+ * Traversal counters of one thread.
+ * Every thread counts into its own copy (see BVHAccel::thread_stats), so
+ * traversal never writes to memory shared with other threads; the renderer
+ * sums the copies of its workers once a render is done. Queries that reach
+ * the BVH of an instance are counted by that BVH as rays of their own.
+ */
+struct BVHTraversalStats {
+
+  BVHTraversalStats() { clear(); }
+
+  /**
+   * Reset all counters to zero.
+   */
+  void clear();
+
+  /**
+   * Add the counters of another thread.
+   */
+  void add(const BVHTraversalStats& other);
+
+  unsigned long long rays;            ///< closest hit and occlusion queries
+  unsigned long long node_visits;     ///< interior nodes visited, once
+                                      ///< for a whole packet of rays
+  unsigned long long box_tests;       ///< ray - box slab tests
+  unsigned long long primitive_tests; ///< ray - primitive tests
+  unsigned long long culled;          ///< far subtrees skipped by intersect
+                                      ///< and subtrees skipped by the
+                                      ///< interval test of a ray packet
+  unsigned long long depth_histogram[BVH_MAX_DEPTH];
+                                      ///< queries by the deepest level of
+                                      ///< the traversal tree they reached
+};
+
+/**
+ * Quality measures of a built BVH, computed from its binary tree.
+ */
+struct BVHQualityReport {
+  double sah_cost;           ///< see BVHAccel::sah_cost
+  size_t num_nodes;          ///< interior and leaf nodes
+  size_t num_leaves;         ///< leaf nodes
+  size_t num_references;     ///< primitives in leaves, with SBVH duplicates
+  size_t max_depth;          ///< deepest leaf, the root is at depth 0
+  double mean_leaf_depth;    ///< leaf depth averaged over leaves
+  double mean_leaf_size;     ///< primitives per leaf
+  std::vector<size_t> leaf_sizes; ///< number of leaves by primitive count
+  double mean_overlap;       ///< surface area of the overlap of the two
+                             ///< children relative to their parent,
+                             ///< averaged over interior nodes
+  double max_overlap;        ///< largest relative overlap
+  size_t num_primitives;     ///< primitives the BVH was built from
+  size_t node_bytes;         ///< traversal nodes
+  size_t tree_bytes;         ///< pointer tree, kept for refitting, drawing
+                             ///< and the cache
+  size_t reference_bytes;    ///< primitive pointers in leaf order
+};
+
+/**
+ * Kind of a primitive reference, which selects the intersector of the run
+ * of references it belongs to. Leaves keep their references sorted by kind,
+ * so a leaf holds at most one run of each kind.
+ */
+enum BVHPrimitiveKind {
+  BVH_PRIMITIVE_TRIANGLE,  ///< Triangle, tested by ray_triangle_nearest
+  BVH_PRIMITIVE_SPHERE,    ///< Sphere, tested inline in double precision
+  BVH_PRIMITIVE_OTHER      ///< anything else, through the Primitive interface
+};
+
+/**
+ * A sphere reference of a BVH, stored by value so the leaf loop does not
+ * need to go through the Primitive.
+ */
+struct BVHSphere {
+  Vector3D o;  ///< center
+  double r2;   ///< radius squared
+};
+
+/**
+ * A node of the flattened BVH used for traversal.
+ * The two children of an interior node are stored next to each other at an
+ * even index, so only the index of the first one is kept and both boxes are
+ * read from the same cache line. The root is at index 0 followed by an
+ * unused slot. Bounds are single precision and rounded outwards, which makes
+ * a node exactly 32 bytes.
+ */
+struct alignas(32) LinearBVHNode {
+
+  inline bool is_leaf() const { return count > 0; }
+
+  float min[3];     ///< min corner of the node bounds
+  uint32_t offset;  ///< first primitive (leaf) or first child (interior)
+  float max[3];     ///< max corner of the node bounds
+  uint32_t count;   ///< number of primitives, 0 for interior nodes
+};
+
+/**
+ * A node of the wide BVH, collapsed from the binary tree.
+ * The bounds of all N children are stored together as SoA so that a single
+ * SIMD slab test covers them. Leaf children are stored inline as a primitive
+ * range; unused slots hold an empty box that no ray can hit.
+ */
+template <int N>
+struct WideBVHNode {
+  static const int width = N;
+  RayBoxSoA<N> bounds; ///< child bounds, one lane per child
+  uint32_t child[N];   ///< first primitive (leaf) or node index (interior)
+  uint32_t count[N];   ///< number of primitives, 0 for interior children
+};
+
+/**
+ * A 4 wide node with child bounds quantized to 8 bits, BVH_NODE_QUANTIZED4.
+ * Child boxes are stored as whole steps from the min corner of the node's
+ * own box. The step is a power of two on each axis, so decoding a bound is a
+ * single exact multiply-add, and bounds are rounded outwards so the decoded
+ * box always contains the child. The node fills one cache line, half the
+ * size of WideBVHNode<4>.
+ */
+struct alignas(64) QuantizedBVHNode4 {
+  static const int width = 4;
+  float origin[3];    ///< min corner of the node bounds
+  int8_t exponent[3]; ///< log2 of the quantization step on each axis
+  uint8_t used;       ///< bit mask of the occupied child slots
+  uint8_t lo[3][4];   ///< child min corners, in steps from origin
+  uint8_t hi[3][4];   ///< child max corners, in steps from origin
+  uint32_t child[4];  ///< first primitive (leaf) or node index (interior)
+  uint16_t count[4];  ///< number of primitives, 0 for interior children
+};
+
 /**
  * Bounding Volume Hierarchy for fast Ray - Primitive intersection.
  * Note that the BVHAccel is an Aggregate (A Primitive itself) that contains
@@ -48,7 +358,7 @@ struct BVHNode {
 class BVHAccel : public Aggregate {
  public:
 
-  BVHAccel () { }
+  BVHAccel () : root(NULL), cache_mapping(NULL), from_cache(false) { }
 
   /**
    * Parameterized Constructor.
@@ -60,6 +370,15 @@ class BVHAccel : public Aggregate {
    */
   BVHAccel(const std::vector<Primitive*>& primitives, size_t max_leaf_size = 4);
 
+  /**
+   * Parameterized Constructor.
+   * Create BVH from a list of primitives using the given build options.
+   * \param primitives primitives to build from
+   * \param options builder selection and its parameters
+   */
+  BVHAccel(const std::vector<Primitive*>& primitives,
+           const BVHBuildOptions& options);
+
   /**
    * Destructor.
    * The destructor only destroys the Aggregate itself, the primitives that
@@ -73,6 +392,52 @@ class BVHAccel : public Aggregate {
    */
   BBox get_bbox() const;
 
+  /**
+   * Surface area heuristic cost of the built tree, normalized by the area of
+   * the root so that trees built by different builders can be compared.
+   * Uses the traversal and intersection costs of the build options.
+   */
+  double sah_cost() const;
+
+  /**
+   * Refit the BVH to primitives that moved.
+   * Recomputes the node bounds bottom up from the current bounds of the
+   * primitives, keeping the shape of the tree. The outermost subtrees whose
+   * SAH cost relative to their area grew by more than the refit rebuild
+   * threshold since they were built are then rebuilt with the SAH builder.
+   * The primitives must not have been added or removed.
+   * \return number of subtrees that were rebuilt
+   */
+  size_t refit();
+
+  /**
+   * Compute tree statistics: node counts, leaf sizes and depths and the
+   * overlap of sibling nodes.
+   */
+  BVHQualityReport quality_report() const;
+
+  /**
+   * Traversal nodes, build tree and primitive references of the BVH, as
+   * broken down by quality_report.
+   */
+  size_t memory_bytes() const;
+
+  /**
+   * Traversal counters of the calling thread, shared by all BVHs and the
+   * other accelerators.
+   */
+  static BVHTraversalStats& thread_stats();
+
+  /**
+   * Check if the BVH was read from the on-disk cache instead of built.
+   */
+  bool loaded_from_cache() const { return from_cache; }
+
+  /**
+   * Options the BVH was built with.
+   */
+  const BVHBuildOptions& get_options() const { return options; }
+
   /**
    * Ray - Aggregate intersection.
    * Check if the given ray intersects with the aggregate (any primitive in
@@ -81,12 +446,19 @@ class BVHAccel : public Aggregate {
    * \return true if the given ray intersects with the aggregate,
              false otherwise
    */
-  bool has_intersection(const Ray& r) const {
-    ++total_rays;
-    return has_intersection(r, root);
-  }
+  bool has_intersection(const Ray& r) const { return occluded(r, r.max_t); }
 
-  bool has_intersection(const Ray& r, BVHNode *node) const;
+  /**
+   * Ray - Aggregate occlusion query.
+   * Check if anything blocks the segment of the ray between r.min_t and
+   * t_max. Traversal stops at the first hit found, in any order, and no
+   * intersection information (normal, BSDF) is computed. Intended for shadow
+   * rays, which only need a visibility answer.
+   * \param r ray to test
+   * \param t_max end of the segment, typically the distance to the light
+   * \return true if the segment is blocked, false otherwise
+   */
+  bool occluded(const Ray& r, double t_max) const;
 
   /**
    * Ray - Aggregate intersection 2.
@@ -95,18 +467,67 @@ class BVHAccel : public Aggregate {
    * intersection information for the point of intersection. Note that the
    * intersected primitive entry in the intersection should be updated to
    * the actual primitive in the aggregate that the ray intersected with and
-   * not the aggregate itself.
+   * not the aggregate itself. Candidates only record t, the primitive and
+   * its barycentric coordinates, the normal and BSDF are evaluated once for
+   * the closest hit.
    * \param r ray to test intersection with
    * \param i address to store intersection info
    * \return true if the given ray intersects with the aggregate,
              false otherwise
    */
-  bool intersect(const Ray& r, Intersection* i) const {
-    ++total_rays;
-    return intersect(r, i, root);
-  }
+  bool intersect(const Ray& r, Intersection* i) const;
 
-  bool intersect(const Ray& r, Intersection* i, BVHNode *node) const;
+  /**
+   * Packet - Aggregate intersection.
+   * Finds the closest hits of up to RAY_PACKET_SIZE rays traced together.
+   * Nodes are visited once for the whole packet with a mask of the rays that
+   * are still inside them, so coherent rays such as the camera rays of a
+   * block of pixels share node loads, and each box is tested against eight
+   * rays at once. Packets whose rays share their origin also get the
+   * interval test of occluded_packet. The hits are the same as those of
+   * intersect on each ray.
+   * \param rays the rays, max_t of every ray that hits is shortened as by
+   *             intersect
+   * \param i address of an array of intersections, one per ray, updated for
+   *          the rays that hit
+   * \param hit receives for every ray whether it hit
+   * \param n number of rays, at most RAY_PACKET_SIZE
+   */
+  void intersect_packet(const Ray* rays, Intersection* i, bool* hit,
+                        size_t n) const;
+
+  /**
+   * Packet - Aggregate occlusion query.
+   * Checks up to RAY_PACKET_SIZE segments at once, each between r.min_t and
+   * r.max_t of its ray, like occluded. When the rays share their origin,
+   * e.g. shadow rays from one point to an area light, nodes are first
+   * tested against interval bounds of the whole packet, so subtrees outside
+   * the packet cost a single test. A ray leaves the packet as soon as it is
+   * blocked.
+   * \param rays the rays, their max_t is the end of the segment to test
+   * \param blocked receives for every ray whether its segment is blocked
+   * \param n number of rays, at most RAY_PACKET_SIZE
+   */
+  void occluded_packet(const Ray* rays, bool* blocked, size_t n) const;
+
+  /**
+   * Stream - Aggregate intersection.
+   * Finds the closest hits of a large batch of unrelated rays, such as the
+   * next bounces of all paths of a tile. The rays are binned by the octant
+   * of their direction and by the cell of their origin along a Morton curve
+   * over the bounds of the BVH, and each bin is traced as packets, so rays
+   * that walk the same part of the tree are traced together instead of in
+   * the order they were generated. The hits are the same as those of
+   * intersect on each ray.
+   * \param rays the rays, max_t of every ray that hits is shortened as by
+   *             intersect
+   * \param i address of an array of intersections, one per ray, updated for
+   *          the rays that hit
+   * \param hit receives for every ray whether it hit
+   * \param n number of rays
+   */
+  void intersect_stream(const Ray* rays, Intersection* i, bool* hit,
+                        size_t n) const;
 
   /**
    * Get BSDF of the surface material
@@ -117,7 +538,8 @@ class BVHAccel : public Aggregate {
   BSDF* get_bsdf() const { return NULL; }
 
   /**
-   * Get entry point (root) - used in visualizer
+   * Get entry point (root) of the pointer tree - used in visualizer only,
+   * ray traversal runs over the flattened node array.
    */
   BVHNode* get_root() const { return root; }
 
@@ -133,12 +555,101 @@ class BVHAccel : public Aggregate {
   void drawOutline(const Color& c, float alpha) const { }
   void drawOutline(BVHNode *node, const Color& c, float alpha) const;
 
-  mutable unsigned long long total_rays, total_isects;
-
 private:
   std::vector<Primitive*> primitives;
   BVHNode* root; ///< root node of the BVH
-  BVHNode *construct_bvh(std::vector<Primitive*>::iterator start, std::vector<Primitive*>::iterator end, size_t max_leaf_size);
+  BVHBuildOptions options;
+  std::vector<LinearBVHNode, AlignedAllocator<LinearBVHNode> > nodes;
+                                 ///< flattened binary tree
+  std::vector<WideBVHNode<4>, AlignedAllocator<WideBVHNode<4> > > nodes4;
+                                 ///< collapsed tree, BVH_NODE_WIDE4
+  std::vector<WideBVHNode<8>, AlignedAllocator<WideBVHNode<8> > > nodes8;
+                                 ///< collapsed tree, BVH_NODE_WIDE8
+  std::vector<QuantizedBVHNode4, AlignedAllocator<QuantizedBVHNode4> >
+      nodes4q;                   ///< quantized tree, BVH_NODE_QUANTIZED4
+  size_t num_nodes;              ///< traversal nodes of the active format
+  size_t num_input_primitives;   ///< primitives the BVH was built from
+
+  // traversal reads the nodes through these, which point either into the
+  // vectors above or into the read-only mapping of a cache file
+  const LinearBVHNode* node_data;
+  const WideBVHNode<4>* node4_data;
+  const WideBVHNode<8>* node8_data;
+  const QuantizedBVHNode4* node4q_data;
+  RayTriangleSoA triangles;      ///< triangle vertices in primitive order
+  std::vector<BVHSphere> spheres; ///< sphere data in primitive order, empty
+                                 ///< without spheres
+  std::vector<uint8_t> kinds;    ///< BVHPrimitiveKind of each primitive
+  bool all_triangles;            ///< leaves are single triangle runs
+  void* cache_mapping;        ///< mapped cache file, NULL if built
+  size_t cache_mapping_size;  ///< length of the mapping in bytes
+  bool from_cache;            ///< loaded from the cache file
+
+  bool load_cache(const std::string& path, uint64_t key,
+                  const std::vector<Primitive*>& prims);
+  void save_cache(const std::string& path, uint64_t key,
+                  const std::vector<Primitive*>& prims) const;
+  void release_cache();
+
+  void build(const std::vector<Primitive*>& prims);
+  BVHNode *construct_bvh(std::vector<BVHBuildPrim>& refs, size_t start,
+                         size_t end, size_t max_leaf_size, int depth = 0,
+                         size_t threads = 1);
+  BVHNode *construct_bvh_sah(std::vector<BVHBuildPrim>& refs, size_t start,
+                             size_t end, int depth = 0, size_t threads = 1);
+  BVHNode *construct_lbvh(std::vector<BVHBuildPrim>& refs, size_t threads);
+  BVHNode *emit_lbvh(const std::vector<BVHBuildPrim>& refs,
+                     const std::vector<uint32_t>& codes, size_t start,
+                     size_t end, int depth, size_t threads = 1);
+  BVHNode *construct_sbvh(std::vector<BVHBuildPrim>& refs, int depth,
+                          double root_area, size_t *budget);
+  double update_subtree(BVHNode *node, int depth, bool refit,
+                        std::vector<std::pair<BVHNode*, int> > *degraded);
+  bool rebuild_subtree(BVHNode *node, int depth);
+  void linearize();
+  void flatten();
+  template <int N>
+  uint32_t collapse(const BVHNode *node,
+                    std::vector<WideBVHNode<N>,
+                                AlignedAllocator<WideBVHNode<N> > >& out);
+  BVHNode *make_leaf(BVHNode *node, size_t start, size_t end);
+  void pack_primitives();
+
+  bool intersect_leaf(uint32_t start, uint32_t count, const Ray& r,
+                      const RayTriangleData& rt, Intersection* i) const;
+  void finalize_hit(const Ray& r, Intersection* i) const;
+  bool occluded_leaf(uint32_t start, uint32_t count, const Ray& r,
+                     const RayTriangleData& rt) const;
+  void intersect_packet_leaf(uint32_t start, uint32_t count, const Ray* rays,
+                             Intersection* i, bool* hit, RayPacketData& p,
+                             uint64_t mask, BVHTraversalStats& stats) const;
+  uint64_t occluded_packet_leaf(uint32_t start, uint32_t count,
+                                const Ray* rays, uint64_t mask,
+                                BVHTraversalStats& stats) const;
+
+  bool intersect_binary(const Ray& r, Intersection* i,
+                        BVHTraversalStats& stats) const;
+  bool occluded_binary(const Ray& r, BVHTraversalStats& stats) const;
+  template <typename Node>
+  bool intersect_wide(const Node* wide, const Ray& r, Intersection* i,
+                      BVHTraversalStats& stats) const;
+  template <typename Node>
+  bool occluded_wide(const Node* wide, const Ray& r,
+                     BVHTraversalStats& stats) const;
+  void intersect_packet_binary(const Ray* rays, Intersection* i, bool* hit,
+                               RayPacketData& p, uint64_t active,
+                               BVHTraversalStats& stats) const;
+  template <typename Node>
+  void intersect_packet_wide(const Node* wide, const Ray* rays,
+                             Intersection* i, bool* hit, RayPacketData& p,
+                             uint64_t active, BVHTraversalStats& stats) const;
+  uint64_t occluded_packet_binary(const Ray* rays, const RayPacketData& p,
+                                  uint64_t active,
+                                  BVHTraversalStats& stats) const;
+  template <typename Node>
+  uint64_t occluded_packet_wide(const Node* wide, const Ray* rays,
+                                const RayPacketData& p, uint64_t active,
+                                BVHTraversalStats& stats) const;
 };
 
 } // namespace SceneObjects
@@ -0,0 +1,455 @@
+#include "bvh.h"
+#include "triangle.h"
+
+#include <cstdio>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <unordered_map>
+
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace CGL { namespace SceneObjects {
+
+/**
+ * Version of the cache file layout. Bump it on any change to the file, the
+ * nodes or the builders so that stale caches are rebuilt instead of misread.
+ */
+static const uint32_t bvh_cache_version = 3;
+
+static const char bvh_cache_magic[8] = {'C', 'G', 'L', 'B', 'V', 'H', 0, 0};
+
+// sections start at multiples of this so mapped nodes keep their alignment
+static const size_t bvh_cache_alignment = 64;
+
+/**
+ * Header at the start of a cache file, followed by the primitive order, the
+ * pointer tree and the traversal nodes at the given offsets.
+ */
+struct BVHCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t node_format;     ///< BVHNodeFormat of the traversal nodes
+  uint32_t node_size;       ///< bytes per traversal node
+  uint32_t tree_node_size;  ///< bytes per BVHCacheTreeNode
+  uint64_t key;             ///< bvh_cache_key of the input
+  uint64_t num_primitives;  ///< primitives the BVH was built from
+  uint64_t num_refs;        ///< length of the primitive order
+  uint64_t num_tree_nodes;  ///< nodes of the pointer tree
+  uint64_t num_nodes;       ///< traversal nodes
+  uint64_t refs_offset;
+  uint64_t tree_offset;
+  uint64_t nodes_offset;
+  uint64_t file_size;
+};
+
+/**
+ * A node of the pointer tree, stored in preorder.
+ */
+struct BVHCacheTreeNode {
+  double min[3];
+  double max[3];
+  double cost;        ///< BVHNode::cost
+  uint32_t start;     ///< first entry of the primitive order (leaves)
+  uint32_t count;     ///< number of primitives (leaves)
+  uint32_t children;  ///< bit 0: a left subtree follows, bit 1: a right one
+  uint32_t pad;
+};
+
+static inline void fnv1a(uint64_t *h, const void *data, size_t size) {
+  const unsigned char *p = (const unsigned char *)data;
+  for (size_t i = 0; i < size; i++) {
+    *h ^= p[i];
+    *h *= 1099511628211ull;
+  }
+}
+
+template <typename T>
+static inline void fnv1a(uint64_t *h, T value) {
+  fnv1a(h, &value, sizeof(T));
+}
+
+uint64_t bvh_cache_key(const std::vector<Primitive *> &primitives,
+                       const BVHBuildOptions &options) {
+  uint64_t h = 14695981039346656037ull;
+  fnv1a(&h, bvh_cache_version);
+  fnv1a(&h, (uint32_t)options.method);
+  fnv1a(&h, (uint32_t)options.node_format);
+  fnv1a(&h, (uint64_t)options.max_leaf_size);
+  fnv1a(&h, (uint64_t)options.sah_bins);
+  fnv1a(&h, (uint64_t)options.sah_max_leaf_size);
+  fnv1a(&h, options.sah_traversal_cost);
+  fnv1a(&h, options.sah_intersection_cost);
+  fnv1a(&h, (uint64_t)options.hlbvh_treelet_bits);
+  fnv1a(&h, options.sbvh_alpha);
+  fnv1a(&h, options.sbvh_duplication_budget);
+  fnv1a(&h, (uint32_t)options.node_layout);
+  fnv1a(&h, (uint64_t)options.treelet_bytes);
+  fnv1a(&h, (uint64_t)primitives.size());
+  for (const Primitive *p : primitives) {
+    BBox bb = p->get_bbox();
+    double v[6] = {bb.min.x, bb.min.y, bb.min.z, bb.max.x, bb.max.y, bb.max.z};
+    fnv1a(&h, v, sizeof(v));
+    // spatial splits clip triangles, which depends on more than the bounds
+    if (const Triangle *t = dynamic_cast<const Triangle *>(p)) {
+      Vector3D p1 = t->vertex(0), p2 = t->vertex(1), p3 = t->vertex(2);
+      double w[9] = {p1.x, p1.y, p1.z, p2.x, p2.y, p2.z, p3.x, p3.y, p3.z};
+      fnv1a(&h, w, sizeof(w));
+    }
+  }
+  return h;
+}
+
+static inline size_t align_up(size_t offset) {
+  return (offset + bvh_cache_alignment - 1) / bvh_cache_alignment *
+         bvh_cache_alignment;
+}
+
+static void write_tree(const BVHNode *node,
+                       std::vector<Primitive *>::const_iterator first,
+                       std::vector<BVHCacheTreeNode> *out) {
+  BVHCacheTreeNode t;
+  memset(&t, 0, sizeof(t));
+  for (int a = 0; a < 3; a++) {
+    t.min[a] = node->bb.min[a];
+    t.max[a] = node->bb.max[a];
+  }
+  t.cost = node->cost;
+  if (node->isLeaf()) {
+    t.start = node->start - first;
+    t.count = node->end - node->start;
+  } else {
+    t.children = (node->l ? 1 : 0) | (node->r ? 2 : 0);
+  }
+  out->push_back(t);
+  if (node->l)
+    write_tree(node->l, first, out);
+  if (node->r)
+    write_tree(node->r, first, out);
+}
+
+// Returns NULL if the serialized tree is malformed.
+static BVHNode *read_tree(const BVHCacheTreeNode *tree, size_t num_tree_nodes,
+                          size_t *next,
+                          std::vector<Primitive *>::const_iterator first,
+                          size_t num_refs, int depth) {
+  if (*next >= num_tree_nodes || depth >= BVH_MAX_DEPTH)
+    return NULL;
+  const BVHCacheTreeNode &t = tree[(*next)++];
+  BVHNode *node =
+      new BVHNode(BBox(Vector3D(t.min[0], t.min[1], t.min[2]),
+                       Vector3D(t.max[0], t.max[1], t.max[2])));
+  node->cost = t.cost;
+  if (t.children == 0) {
+    if ((size_t)t.start + t.count > num_refs) {
+      delete node;
+      return NULL;
+    }
+    node->start = first + t.start;
+    node->end = first + t.start + t.count;
+    return node;
+  }
+  if (t.children & 1) {
+    node->l = read_tree(tree, num_tree_nodes, next, first, num_refs, depth + 1);
+    if (!node->l) {
+      delete node;
+      return NULL;
+    }
+  }
+  if (t.children & 2) {
+    node->r = read_tree(tree, num_tree_nodes, next, first, num_refs, depth + 1);
+    if (!node->r) {
+      delete node;
+      return NULL;
+    }
+  }
+  return node;
+}
+
+void BVHAccel::save_cache(const std::string &path, uint64_t key,
+                          const std::vector<Primitive *> &prims) const {
+  std::unordered_map<const Primitive *, uint32_t> index;
+  index.reserve(prims.size());
+  for (size_t i = 0; i < prims.size(); i++) {
+    index[prims[i]] = i;
+  }
+  std::vector<uint32_t> refs(primitives.size());
+  for (size_t i = 0; i < primitives.size(); i++) {
+    refs[i] = index[primitives[i]];
+  }
+  std::vector<BVHCacheTreeNode> tree;
+  write_tree(root, primitives.cbegin(), &tree);
+
+  const void *node_bytes;
+  switch (options.node_format) {
+  case BVH_NODE_WIDE4:
+    node_bytes = nodes4.data();
+    break;
+  case BVH_NODE_WIDE8:
+    node_bytes = nodes8.data();
+    break;
+  case BVH_NODE_QUANTIZED4:
+    node_bytes = nodes4q.data();
+    break;
+  default:
+    node_bytes = nodes.data();
+    break;
+  }
+
+  BVHCacheHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, bvh_cache_magic, sizeof(h.magic));
+  h.version = bvh_cache_version;
+  h.node_format = options.node_format;
+  h.node_size = bvh_node_size(options.node_format);
+  h.tree_node_size = sizeof(BVHCacheTreeNode);
+  h.key = key;
+  h.num_primitives = prims.size();
+  h.num_refs = refs.size();
+  h.num_tree_nodes = tree.size();
+  h.num_nodes = num_nodes;
+  h.refs_offset = align_up(sizeof(h));
+  h.tree_offset = align_up(h.refs_offset + refs.size() * sizeof(uint32_t));
+  h.nodes_offset =
+      align_up(h.tree_offset + tree.size() * sizeof(BVHCacheTreeNode));
+  h.file_size = h.nodes_offset + num_nodes * h.node_size;
+
+  std::vector<char> file(h.file_size, 0);
+  memcpy(&file[0], &h, sizeof(h));
+  memcpy(&file[h.refs_offset], refs.data(), refs.size() * sizeof(uint32_t));
+  memcpy(&file[h.tree_offset], tree.data(),
+         tree.size() * sizeof(BVHCacheTreeNode));
+  memcpy(&file[h.nodes_offset], node_bytes, num_nodes * h.node_size);
+
+  // written under a private name and renamed, so that concurrent renders
+  // never map a partially written file
+  std::string tmp = path + "." + std::to_string(getpid()) + ".tmp";
+  FILE *f = fopen(tmp.c_str(), "wb");
+  if (!f) {
+    fprintf(stderr, "[PathTracer] Could not write BVH cache %s\n",
+            path.c_str());
+    return;
+  }
+  bool ok = fwrite(file.data(), 1, file.size(), f) == file.size();
+  ok = fclose(f) == 0 && ok;
+  if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+    fprintf(stderr, "[PathTracer] Could not write BVH cache %s\n",
+            path.c_str());
+    remove(tmp.c_str());
+  }
+}
+
+// Whether a child slot of a wide node is unused. Unused slots of the float
+// layout point at the root, so they only count as unused with the empty box
+// no ray can enter.
+template <int N>
+static bool empty_slot(const WideBVHNode<N> &node, int c) {
+  if (node.count[c] || node.child[c])
+    return false;
+  for (int a = 0; a < 3; a++) {
+    if (!(node.bounds.bounds[0][a][c] == INFINITY &&
+          node.bounds.bounds[1][a][c] == -INFINITY))
+      return false;
+  }
+  return true;
+}
+
+static bool empty_slot(const QuantizedBVHNode4 &node, int c) {
+  return !(node.used & (1 << c));
+}
+
+// Mapped traversal nodes are used as they are, so every node reachable from
+// the root must only reference primitives and nodes that exist. Children
+// are always placed after their parent, which rules out cycles, and no node
+// may be deeper than the traversal stacks allow.
+static bool valid_nodes(const LinearBVHNode *nodes, size_t num_nodes,
+                        size_t num_refs) {
+  std::vector<int> depth(num_nodes, -1);
+  depth[0] = 0;
+  for (size_t i = 0; i < num_nodes; i++) {
+    const LinearBVHNode &node = nodes[i];
+    if (depth[i] < 0)
+      continue;
+    if (node.is_leaf()) {
+      if ((size_t)node.offset + node.count > num_refs)
+        return false;
+      continue;
+    }
+    if (node.offset <= i || (size_t)node.offset + 1 >= num_nodes ||
+        depth[i] + 1 >= BVH_MAX_DEPTH)
+      return false;
+    depth[node.offset] = depth[node.offset + 1] = depth[i] + 1;
+  }
+  return true;
+}
+
+template <typename Node>
+static bool valid_wide_nodes(const Node *nodes, size_t num_nodes,
+                             size_t num_refs) {
+  std::vector<int> depth(num_nodes, -1);
+  depth[0] = 0;
+  for (size_t i = 0; i < num_nodes; i++) {
+    const Node &node = nodes[i];
+    if (depth[i] < 0)
+      continue;
+    for (int c = 0; c < Node::width; c++) {
+      if (empty_slot(node, c))
+        continue;
+      if (node.count[c]) {
+        if ((size_t)node.child[c] + node.count[c] > num_refs)
+          return false;
+        continue;
+      }
+      if (node.child[c] <= i || node.child[c] >= num_nodes ||
+          depth[i] + 1 >= BVH_MAX_DEPTH)
+        return false;
+      depth[node.child[c]] = depth[i] + 1;
+    }
+  }
+  return true;
+}
+
+bool BVHAccel::load_cache(const std::string &path, uint64_t key,
+                          const std::vector<Primitive *> &prims) {
+#ifdef _WIN32
+  // no mapping here, the file is read into memory instead
+  FILE *f = fopen(path.c_str(), "rb");
+  if (!f)
+    return false;
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  if (size < (long)sizeof(BVHCacheHeader)) {
+    fclose(f);
+    return false;
+  }
+  cache_mapping = malloc(size);
+  cache_mapping_size = size;
+  bool read = fread(cache_mapping, 1, size, f) == (size_t)size;
+  fclose(f);
+  if (!read) {
+    release_cache();
+    return false;
+  }
+#else
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(BVHCacheHeader)) {
+    close(fd);
+    return false;
+  }
+  // shared and read-only: every process rendering the scene uses the same
+  // pages of the page cache
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return false;
+  cache_mapping = map;
+  cache_mapping_size = st.st_size;
+#endif
+
+  const char *data = (const char *)cache_mapping;
+  const BVHCacheHeader &h = *(const BVHCacheHeader *)data;
+  bool valid =
+      memcmp(h.magic, bvh_cache_magic, sizeof(h.magic)) == 0 &&
+      h.version == bvh_cache_version &&
+      h.node_format == (uint32_t)options.node_format &&
+      h.node_size == bvh_node_size(options.node_format) &&
+      h.tree_node_size == sizeof(BVHCacheTreeNode) && h.key == key &&
+      h.num_primitives == prims.size() && h.file_size == cache_mapping_size &&
+      h.num_refs < UINT32_MAX && h.num_tree_nodes < UINT32_MAX &&
+      h.num_nodes < UINT32_MAX && h.num_nodes > 0 &&
+      h.refs_offset % bvh_cache_alignment == 0 &&
+      h.tree_offset % bvh_cache_alignment == 0 &&
+      h.nodes_offset % bvh_cache_alignment == 0 &&
+      h.refs_offset + h.num_refs * sizeof(uint32_t) <= h.file_size &&
+      h.tree_offset + h.num_tree_nodes * sizeof(BVHCacheTreeNode) <=
+          h.file_size &&
+      h.nodes_offset + h.num_nodes * h.node_size <= h.file_size;
+  if (!valid) {
+    release_cache();
+    return false;
+  }
+
+  const uint32_t *refs = (const uint32_t *)(data + h.refs_offset);
+  primitives.resize(h.num_refs);
+  for (size_t i = 0; i < h.num_refs; i++) {
+    if (refs[i] >= prims.size()) {
+      primitives.clear();
+      release_cache();
+      return false;
+    }
+    primitives[i] = prims[refs[i]];
+  }
+
+  size_t next = 0;
+  root = read_tree((const BVHCacheTreeNode *)(data + h.tree_offset),
+                   h.num_tree_nodes, &next, primitives.cbegin(), h.num_refs,
+                   0);
+  if (!root) {
+    primitives.clear();
+    release_cache();
+    return false;
+  }
+
+  const char *node_bytes = data + h.nodes_offset;
+  bool nodes_valid = false;
+  switch (options.node_format) {
+  case BVH_NODE_BINARY:
+    nodes_valid = valid_nodes((const LinearBVHNode *)node_bytes, h.num_nodes,
+                              h.num_refs);
+    break;
+  case BVH_NODE_WIDE4:
+    nodes_valid = valid_wide_nodes((const WideBVHNode<4> *)node_bytes,
+                                   h.num_nodes, h.num_refs);
+    break;
+  case BVH_NODE_WIDE8:
+    nodes_valid = valid_wide_nodes((const WideBVHNode<8> *)node_bytes,
+                                   h.num_nodes, h.num_refs);
+    break;
+  case BVH_NODE_QUANTIZED4:
+    nodes_valid = valid_wide_nodes((const QuantizedBVHNode4 *)node_bytes,
+                                   h.num_nodes, h.num_refs);
+    break;
+  }
+  if (!nodes_valid) {
+    delete root;
+    root = NULL;
+    primitives.clear();
+    release_cache();
+    return false;
+  }
+
+  node_data = (const LinearBVHNode *)(data + h.nodes_offset);
+  node4_data = (const WideBVHNode<4> *)(data + h.nodes_offset);
+  node8_data = (const WideBVHNode<8> *)(data + h.nodes_offset);
+  node4q_data = (const QuantizedBVHNode4 *)(data + h.nodes_offset);
+  num_nodes = h.num_nodes;
+  from_cache = true;
+  pack_primitives();
+  return true;
+}
+
+void BVHAccel::release_cache() {
+  if (!cache_mapping)
+    return;
+#ifdef _WIN32
+  free(cache_mapping);
+#else
+  munmap(cache_mapping, cache_mapping_size);
+#endif
+  cache_mapping = NULL;
+}
+
+} // namespace SceneObjects
+} // namespace CGL
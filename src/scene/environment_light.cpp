@@ -31,7 +31,7 @@ namespace CGL { namespace SceneObjects {
     double sum = 0;
     for (int j = 0; j < h; ++j) {
       for (int i = 0; i < w; ++i) {
-        pdf_envmap[w * j + i] = envMap->data[w * j + i].illum() * sin(PI * (j + .5) / h);
+        pdf_envmap[w * j + i] = envMap->pixel(w * j + i).illum() * sin(PI * (j + .5) / h);
         sum += pdf_envmap[w * j + i];
       }
     }
@@ -117,8 +117,8 @@ namespace CGL { namespace SceneObjects {
     else v1 = v - xy.y + .5;
     auto bottom = envMap->w * v, top = bottom - envMap->w;
     auto u0 = 1 - u1;
-    return (envMap->data[top + left] * u1 + envMap->data[top + right] * u0) * v1 +
-      (envMap->data[bottom + left] * u1 + envMap->data[bottom + right] * u0) * (1 - v1);
+    return (envMap->pixel(top + left) * u1 + envMap->pixel(top + right) * u0) * v1 +
+      (envMap->pixel(bottom + left) * u1 + envMap->pixel(bottom + right) * u0) * (1 - v1);
   }
 
 
@@ -19,7 +19,8 @@ static const double low_threshold  = .1;
 static const double mid_threshold  = .2;
 static const double high_threshold = 1.0 - low_threshold;
 
-Mesh::Mesh(Collada::PolymeshInfo& polyMesh, const Matrix4x4& transform) {
+Mesh::Mesh(Collada::PolymeshInfo& polyMesh, const Matrix4x4& transform)
+    : prototype(nullptr), edited(false), static_mesh(nullptr) {
 
   // Build halfedge mesh from polygon soup
   vector< vector<size_t> > polygons;
@@ -386,6 +387,7 @@ void Mesh::drag_selection(float dx, float dy, const Matrix4x4& worldTo3DH) {
   pos = worldTo3DH.inv() * pos;
 
   v->position = pos.to3D();
+  edited = true;
 }
 
 void Mesh::collapse_selected_edge() {
@@ -394,6 +396,7 @@ void Mesh::collapse_selected_edge() {
   Edge *edge = element->getEdge();
   if (edge == nullptr) return;
   mesh.collapseEdge(edge->halfedge()->edge());
+  edited = true;
   invalidate_selection();
 }
 
@@ -403,6 +406,7 @@ void Mesh::flip_selected_edge() {
   Edge *edge = element->getEdge();
   if (edge == nullptr) return;
   mesh.flipEdge(edge->halfedge()->edge());
+  edited = true;
   invalidate_selection();
 }
 
@@ -412,21 +416,25 @@ void Mesh::split_selected_edge() {
   Edge *edge = element->getEdge();
   if (edge == nullptr) return;
   mesh.splitEdge(edge->halfedge()->edge());
+  edited = true;
   invalidate_selection();
 }
 
 void Mesh::upsample() {
   resampler.upsample(mesh);
+  edited = true;
   invalidate_selection();
 }
 
 void Mesh::downsample() {
   resampler.downsample(mesh);
+  edited = true;
   invalidate_selection();
 }
 
 void Mesh::resample() {
   resampler.resample(mesh);
+  edited = true;
   invalidate_selection();
 }
 
@@ -531,8 +539,21 @@ BSDF* Mesh::get_bsdf() {
   return bsdf;
 }
 
+void Mesh::set_instance_of(const Mesh* prototype, const Matrix4x4& transform) {
+  this->prototype = prototype;
+  instance_transform = transform;
+}
+
 SceneObjects::SceneObject *Mesh::get_static_object() {
-  return new SceneObjects::Mesh(mesh, bsdf);
+  // copies of an unedited mesh share its static mesh; the scene converts
+  // objects in order, so the prototype has already produced it
+  if (prototype && prototype->static_mesh && !edited && !prototype->edited) {
+    static_mesh = nullptr;
+    return new SceneObjects::MeshInstance(prototype->static_mesh,
+                                          instance_transform, bsdf);
+  }
+  static_mesh = new SceneObjects::Mesh(mesh, bsdf);
+  return static_mesh;
 }
 
 
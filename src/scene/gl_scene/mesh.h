@@ -3,6 +3,7 @@
 
 #include "scene.h"
 
+#include "scene/object.h"
 #include "scene/collada/polymesh_info.h"
 #include "util/halfEdgeMesh.h"
 #include "application/meshEdit.h"
@@ -66,6 +67,17 @@ class Mesh : public SceneObject, public MeshView {
   BSDF *get_bsdf();
   SceneObjects::SceneObject *get_static_object();
 
+  /**
+   * Mark the mesh as a copy of another mesh loaded from the same geometry.
+   * As long as neither of them is edited, the static object of the copy is a
+   * SceneObjects::MeshInstance sharing the static mesh of the prototype, so
+   * the renderer builds its BVH only once. The prototype must come before
+   * the copy in the scene.
+   * \param prototype the first mesh loaded from the geometry
+   * \param transform transform from the prototype to this mesh
+   */
+  void set_instance_of(const Mesh* prototype, const Matrix4x4& transform);
+
   // MeshView methods
   void collapse_selected_edge();
   void flip_selected_edge();
@@ -115,6 +127,12 @@ class Mesh : public SceneObject, public MeshView {
 
   // material
   BSDF* bsdf;
+
+  // instancing
+  const Mesh* prototype;          ///< mesh this is a copy of, or null
+  Matrix4x4 instance_transform;   ///< prototype to this mesh transform
+  bool edited;                    ///< modified since it was loaded
+  SceneObjects::Mesh* static_mesh; ///< last static mesh produced, or null
 };
 
 } // namespace GLScene
@@ -0,0 +1,171 @@
+#include "grid.h"
+
+#include "CGL/CGL.h"
+#include "pathtracer/intersection.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+namespace CGL {
+namespace SceneObjects {
+
+UniformGridAccel::UniformGridAccel(const std::vector<Primitive *> &_primitives,
+                                   const GridBuildOptions &options)
+    : options(options) {
+
+  primitives = _primitives;
+  size_t n = primitives.size();
+  res[0] = res[1] = res[2] = 1;
+  if (n == 0) {
+    cell_start.assign(2, 0);
+    return;
+  }
+
+  vector<BBox> prim_bounds(n);
+  for (size_t p = 0; p < n; p++) {
+    prim_bounds[p] = primitives[p]->get_bbox();
+    bounds.expand(prim_bounds[p]);
+  }
+
+  // cells are close to cubes, about density^3 of them per primitive when the
+  // scene is a cube
+  Vector3D extent = bounds.max - bounds.min;
+  double longest = max(extent.x, max(extent.y, extent.z));
+  double cells_per_unit =
+      longest > 0 ? options.density * cbrt((double)n) / longest : 0;
+  for (int a = 0; a < 3; a++) {
+    double cells = round(extent[a] * cells_per_unit);
+    res[a] = (int)min<double>(max(cells, 1.0), options.max_resolution);
+    cell_size[a] = extent[a] / res[a];
+    inv_cell_size[a] = cell_size[a] > 0 ? 1 / cell_size[a] : 0;
+  }
+
+  // count the references of each cell, turn the counts into offsets, then
+  // fill the cells in a second pass
+  size_t num_cells = (size_t)res[0] * res[1] * res[2];
+  cell_start.assign(num_cells + 1, 0);
+  vector<int> lo(3 * n), hi(3 * n);
+  for (size_t p = 0; p < n; p++) {
+    for (int a = 0; a < 3; a++) {
+      lo[3 * p + a] = cell_of(prim_bounds[p].min[a], a);
+      hi[3 * p + a] = cell_of(prim_bounds[p].max[a], a);
+    }
+    for (int z = lo[3 * p + 2]; z <= hi[3 * p + 2]; z++)
+      for (int y = lo[3 * p + 1]; y <= hi[3 * p + 1]; y++)
+        for (int x = lo[3 * p]; x <= hi[3 * p]; x++)
+          cell_start[x + res[0] * (y + (size_t)res[1] * z) + 1]++;
+  }
+  for (size_t c = 0; c < num_cells; c++)
+    cell_start[c + 1] += cell_start[c];
+
+  references.resize(cell_start[num_cells]);
+  vector<uint32_t> fill(cell_start.begin(), cell_start.end() - 1);
+  for (size_t p = 0; p < n; p++) {
+    for (int z = lo[3 * p + 2]; z <= hi[3 * p + 2]; z++)
+      for (int y = lo[3 * p + 1]; y <= hi[3 * p + 1]; y++)
+        for (int x = lo[3 * p]; x <= hi[3 * p]; x++)
+          references[fill[x + res[0] * (y + (size_t)res[1] * z)]++] = p;
+  }
+}
+
+size_t UniformGridAccel::memory_bytes() const {
+  return cell_start.capacity() * sizeof(uint32_t) +
+         references.capacity() * sizeof(uint32_t) +
+         primitives.capacity() * sizeof(Primitive *);
+}
+
+template <typename Visit>
+void UniformGridAccel::walk(const Ray &ray, double t_min, double t_max,
+                            Visit visit) const {
+  BVHTraversalStats &stats = BVHAccel::thread_stats();
+  stats.box_tests++;
+  if (!bounds.intersect(ray, t_min, t_max))
+    return;
+
+  // the cell of the entry point, and the distance along the ray to the next
+  // cell boundary and between boundaries on each axis
+  Vector3D p = ray.o + t_min * ray.d;
+  int cell[3], step[3], out[3];
+  double next_t[3], delta_t[3];
+  for (int a = 0; a < 3; a++) {
+    cell[a] = cell_of(p[a], a);
+    if (ray.d[a] > 0) {
+      next_t[a] = t_min + (bounds.min[a] + (cell[a] + 1) * cell_size[a] - p[a]) *
+                              ray.inv_d[a];
+      delta_t[a] = cell_size[a] * ray.inv_d[a];
+      step[a] = 1;
+      out[a] = res[a];
+    } else if (ray.d[a] < 0) {
+      next_t[a] =
+          t_min + (bounds.min[a] + cell[a] * cell_size[a] - p[a]) * ray.inv_d[a];
+      delta_t[a] = -cell_size[a] * ray.inv_d[a];
+      step[a] = -1;
+      out[a] = -1;
+    } else {
+      next_t[a] = INF_D;
+      delta_t[a] = INF_D;
+      step[a] = 0;
+      out[a] = -1;
+    }
+  }
+
+  while (true) {
+    stats.node_visits++;
+    int a = next_t[0] < next_t[1] ? (next_t[0] < next_t[2] ? 0 : 2)
+                                  : (next_t[1] < next_t[2] ? 1 : 2);
+    size_t c = cell[0] + res[0] * (cell[1] + (size_t)res[1] * cell[2]);
+    uint32_t start = cell_start[c], end = cell_start[c + 1];
+    if (start != end && visit(&references[start], end - start, next_t[a]))
+      return;
+    if (next_t[a] > t_max)
+      return;
+    cell[a] += step[a];
+    if (cell[a] == out[a])
+      return;
+    next_t[a] += delta_t[a];
+  }
+}
+
+bool UniformGridAccel::intersect(const Ray &ray, Intersection *i) const {
+  BVHTraversalStats &stats = BVHAccel::thread_stats();
+  stats.rays++;
+
+  bool hit = false;
+  walk(ray, ray.min_t, ray.max_t,
+       [&](const uint32_t *refs, uint32_t count, double t_exit) {
+         for (uint32_t k = 0; k < count; k++) {
+           stats.primitive_tests++;
+           if (primitives[refs[k]]->intersect(ray, i))
+             hit = true;
+         }
+         // primitives spanning several cells can hit beyond this one, where
+         // a closer hit may still be found in the next cells
+         return ray.max_t <= t_exit;
+       });
+  return hit;
+}
+
+bool UniformGridAccel::occluded(const Ray &ray, double t_max) const {
+  BVHTraversalStats &stats = BVHAccel::thread_stats();
+  stats.rays++;
+
+  // primitives read the segment end from the ray itself
+  double saved_max_t = ray.max_t;
+  ray.max_t = t_max;
+  bool blocked = false;
+  walk(ray, ray.min_t, t_max,
+       [&](const uint32_t *refs, uint32_t count, double t_exit) {
+         for (uint32_t k = 0; k < count && !blocked; k++) {
+           stats.primitive_tests++;
+           blocked = primitives[refs[k]]->has_intersection(ray);
+         }
+         return blocked;
+       });
+  ray.max_t = saved_max_t;
+  return blocked;
+}
+
+} // namespace SceneObjects
+} // namespace CGL
@@ -0,0 +1,130 @@
+#ifndef CGL_GRID_H
+#define CGL_GRID_H
+
+#include "scene.h"
+#include "aggregate.h"
+#include "bvh.h"
+
+#include <cstdint>
+#include <vector>
+
+namespace CGL { namespace SceneObjects {
+
+/**
+ * Parameters controlling the resolution of a uniform grid.
+ */
+struct GridBuildOptions {
+
+  GridBuildOptions() {
+    density = 3;
+    max_resolution = 128;
+  }
+
+  double density;        ///< cells along the longest axis per cube root of
+                         ///< the primitive count
+  size_t max_resolution; ///< cap on the number of cells along an axis
+};
+
+/**
+ * Uniform grid for fast Ray - Primitive intersection.
+ * The bounds of the scene are divided into equal cells, roughly cubic, and
+ * every cell lists the primitives whose bounding box overlaps it. The lists
+ * are stored back to back in one array indexed by the first reference of
+ * each cell. A ray walks the cells it passes through front to back with a 3D
+ * DDA and stops at the first cell that contains a hit, so the cost of a ray
+ * depends on how far it travels rather than on the depth of a tree. Suits
+ * scenes of many primitives of similar size spread evenly, like particles.
+ * Like BVHAccel it is an Aggregate holding all the primitives it was built
+ * from.
+ */
+class UniformGridAccel : public Aggregate {
+ public:
+
+  /**
+   * Parameterized Constructor.
+   * Create a grid over a list of primitives. The primitives need to be kept
+   * in memory for the aggregate to function properly.
+   * \param primitives primitives to build from
+   * \param options grid resolution
+   */
+  UniformGridAccel(const std::vector<Primitive*>& primitives,
+                   const GridBuildOptions& options = GridBuildOptions());
+
+  /**
+   * Get the world space bounding box of the aggregate.
+   */
+  BBox get_bbox() const { return bounds; }
+
+  /**
+   * Ray - Aggregate intersection.
+   * \param r ray to test intersection with
+   * \return true if the given ray intersects with the aggregate
+   */
+  bool has_intersection(const Ray& r) const { return occluded(r, r.max_t); }
+
+  /**
+   * Ray - Aggregate occlusion query, see Aggregate::occluded. Stops at the
+   * first primitive found in the segment.
+   */
+  bool occluded(const Ray& r, double t_max) const;
+
+  /**
+   * Ray - Aggregate intersection 2.
+   * Finds the closest hit of the ray and stores its intersection
+   * information in i.
+   * \param r ray to test intersection with
+   * \param i address to store intersection info
+   * \return true if the given ray intersects with the aggregate
+   */
+  bool intersect(const Ray& r, Intersection* i) const;
+
+  /**
+   * Cell offsets and primitive references.
+   */
+  size_t memory_bytes() const;
+
+  /**
+   * Number of cells along each axis.
+   */
+  const int* resolution() const { return res; }
+
+  /**
+   * Number of primitive references in the cells, a primitive is referenced
+   * by every cell its bounding box overlaps.
+   */
+  size_t num_references() const { return references.size(); }
+
+  void draw(const Color& c, float alpha) const { }
+  void drawOutline(const Color& c, float alpha) const { }
+
+ private:
+  GridBuildOptions options;
+  BBox bounds;                      ///< bounds of all primitives
+  int res[3];                       ///< number of cells along each axis
+  Vector3D cell_size;               ///< extent of a cell
+  Vector3D inv_cell_size;           ///< cells per unit length, 0 on flat axes
+  std::vector<uint32_t> cell_start; ///< first reference of each cell, x
+                                    ///< fastest, and the end of the last
+  std::vector<uint32_t> references; ///< primitive indices, cell by cell
+
+  /**
+   * Cell containing a coordinate along an axis, clamped to the grid.
+   */
+  inline int cell_of(double x, int axis) const {
+    int c = (int)((x - bounds.min[axis]) * inv_cell_size[axis]);
+    return c < 0 ? 0 : (c >= res[axis] ? res[axis] - 1 : c);
+  }
+
+  /**
+   * Walk the cells along the ray between t_min and t_max.
+   * \param visit called with the references of each cell in order until it
+   *        returns true
+   */
+  template <typename Visit>
+  void walk(const Ray& r, double t_min, double t_max, Visit visit) const;
+};
+
+} // namespace SceneObjects
+} // namespace CGL
+
+#endif // CGL_GRID_H
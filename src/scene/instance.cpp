@@ -0,0 +1,90 @@
+#include "instance.h"
+
+#include "GL/glew.h"
+
+namespace CGL { namespace SceneObjects {
+
+static Vector3D transform_point(const Matrix4x4& m, const Vector3D& p) {
+  return Vector3D(m(0, 0) * p.x + m(0, 1) * p.y + m(0, 2) * p.z + m(0, 3),
+                  m(1, 0) * p.x + m(1, 1) * p.y + m(1, 2) * p.z + m(1, 3),
+                  m(2, 0) * p.x + m(2, 1) * p.y + m(2, 2) * p.z + m(2, 3));
+}
+
+static Vector3D transform_vector(const Matrix4x4& m, const Vector3D& v) {
+  return Vector3D(m(0, 0) * v.x + m(0, 1) * v.y + m(0, 2) * v.z,
+                  m(1, 0) * v.x + m(1, 1) * v.y + m(1, 2) * v.z,
+                  m(2, 0) * v.x + m(2, 1) * v.y + m(2, 2) * v.z);
+}
+
+// normals transform by the inverse transpose, m is the inverse here
+static Vector3D transform_normal(const Matrix4x4& m, const Vector3D& n) {
+  return Vector3D(m(0, 0) * n.x + m(1, 0) * n.y + m(2, 0) * n.z,
+                  m(0, 1) * n.x + m(1, 1) * n.y + m(2, 1) * n.z,
+                  m(0, 2) * n.x + m(1, 2) * n.y + m(2, 2) * n.z);
+}
+
+BVHInstance::BVHInstance(const BVHAccel* bvh, const Matrix4x4& transform,
+                         BSDF* bsdf)
+    : bvh(bvh), object_to_world(transform),
+      world_to_object(transform.inv()), bsdf(bsdf) {
+  refit();
+}
+
+void BVHInstance::refit() {
+  BBox b = bvh->get_bbox();
+  bbox = BBox();
+  for (int i = 0; i < 8; i++) {
+    Vector3D corner(i & 1 ? b.max.x : b.min.x,
+                    i & 2 ? b.max.y : b.min.y,
+                    i & 4 ? b.max.z : b.min.z);
+    bbox.expand(transform_point(object_to_world, corner));
+  }
+}
+
+Ray BVHInstance::to_object(const Ray& r) const {
+  Ray ray(transform_point(world_to_object, r.o),
+          transform_vector(world_to_object, r.d), r.max_t, (int)r.depth);
+  ray.min_t = r.min_t;
+  return ray;
+}
+
+bool BVHInstance::has_intersection(const Ray& r) const {
+  Ray ray = to_object(r);
+  return bvh->occluded(ray, ray.max_t);
+}
+
+bool BVHInstance::intersect(const Ray& r, Intersection* i) const {
+  Ray ray = to_object(r);
+  if (!bvh->intersect(ray, i))
+    return false;
+  r.max_t = ray.max_t;
+  i->n = transform_normal(world_to_object, i->n).unit();
+  if (bsdf)
+    i->bsdf = bsdf;
+  return true;
+}
+
+void BVHInstance::draw(const Color& c, float alpha) const {
+  GLdouble m[16];
+  for (int j = 0; j < 4; j++)
+    for (int i = 0; i < 4; i++)
+      m[4 * j + i] = object_to_world(i, j);
+  glPushMatrix();
+  glMultMatrixd(m);
+  bvh->draw(bvh->get_root(), c, alpha);
+  glPopMatrix();
+}
+
+void BVHInstance::drawOutline(const Color& c, float alpha) const {
+  GLdouble m[16];
+  for (int j = 0; j < 4; j++)
+    for (int i = 0; i < 4; i++)
+      m[4 * j + i] = object_to_world(i, j);
+  glPushMatrix();
+  glMultMatrixd(m);
+  bvh->drawOutline(bvh->get_root(), c, alpha);
+  glPopMatrix();
+}
+
+} // namespace SceneObjects
+} // namespace CGL
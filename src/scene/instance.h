@@ -0,0 +1,98 @@
+#ifndef CGL_STATICSCENE_INSTANCE_H
+#define CGL_STATICSCENE_INSTANCE_H
+
+#include "CGL/matrix4x4.h"
+
+#include "bvh.h"
+
+namespace CGL { namespace SceneObjects {
+
+/**
+ * A placed copy of a bottom level BVH.
+ * Instances are the leaves of the top level BVH of a two level acceleration
+ * structure. Each one holds a transform and a pointer to a BVH that is shared
+ * by every instance of the same mesh; rays reaching an instance are moved
+ * into the space of that BVH instead of the geometry being copied to world
+ * space.
+ */
+class BVHInstance : public Primitive {
+ public:
+
+  /**
+   * Constructor.
+   * \param bvh shared bottom level BVH, must outlive the instance
+   * \param transform affine transform from the space of the BVH to world
+   * \param bsdf surface material overriding the one of the shared
+   *             primitives, or NULL to keep theirs
+   */
+  BVHInstance(const BVHAccel* bvh, const Matrix4x4& transform,
+              BSDF* bsdf = NULL);
+
+  /**
+   * Recompute the world space bounds after the shared BVH was refit.
+   */
+  void refit();
+
+  /**
+   * Get the world space bounding box of the instance.
+   * This is the box around the transformed corners of the box of the BVH.
+   * \return world space bounding box of the instance
+   */
+  BBox get_bbox() const { return bbox; }
+
+  /**
+   * Ray - Instance intersection.
+   * The ray is moved into the space of the BVH without normalizing its
+   * direction, so ray times are the same in both spaces.
+   * \param r ray to test intersection with
+   * \return true if the given ray intersects with the instance,
+             false otherwise
+   */
+  bool has_intersection(const Ray& r) const;
+
+  /**
+   * Ray - Instance intersection 2.
+   * Updates r.max_t and the intersection on a hit; the normal is returned
+   * in world space.
+   * \param r ray to test intersection with
+   * \param i address to store intersection info
+   * \return true if the given ray intersects with the instance,
+             false otherwise
+   */
+  bool intersect(const Ray& r, Intersection* i) const;
+
+  /**
+   * Get BSDF.
+   * Returns the override material, NULL if the instance uses the materials
+   * of the shared primitives.
+   */
+  BSDF* get_bsdf() const { return bsdf; }
+
+  /**
+   * Draw with OpenGL (for visualizer)
+   */
+  void draw(const Color& c, float alpha) const;
+
+  /**
+   * Draw outline with OpenGL (for visualizer)
+   */
+  void drawOutline(const Color& c, float alpha) const;
+
+ private:
+
+  /**
+   * Move a ray into the space of the BVH, keeping its segment and depth.
+   */
+  Ray to_object(const Ray& r) const;
+
+  const BVHAccel* bvh;        ///< shared bottom level BVH
+  Matrix4x4 object_to_world;  ///< instance transform
+  Matrix4x4 world_to_object;  ///< inverse instance transform
+  BSDF* bsdf;                 ///< material override, may be NULL
+  BBox bbox;                  ///< world space bounds
+};
+
+} // namespace SceneObjects
+} // namespace CGL
+
+#endif // CGL_STATICSCENE_INSTANCE_H
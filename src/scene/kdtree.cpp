@@ -0,0 +1,328 @@
+#include "kdtree.h"
+
+#include "CGL/CGL.h"
+#include "pathtracer/intersection.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+namespace CGL {
+namespace SceneObjects {
+
+/**
+ * Largest float not above x.
+ */
+static inline float round_down(double x) {
+  float f = (float)x;
+  return f > x ? nextafterf(f, -INFINITY) : f;
+}
+
+/**
+ * Smallest float not below x.
+ */
+static inline float round_up(double x) {
+  float f = (float)x;
+  return f < x ? nextafterf(f, INFINITY) : f;
+}
+
+KdTreeAccel::KdTreeAccel(const std::vector<Primitive *> &_primitives,
+                         const KdTreeBuildOptions &options)
+    : options(options) {
+
+  primitives = _primitives;
+  size_t n = primitives.size();
+  if (n == 0)
+    return;
+
+  // bounds are fetched once, the builder sorts them many times over
+  vector<Bounds> prim_bounds(n);
+  Bounds root_bounds;
+  for (int a = 0; a < 3; a++) {
+    root_bounds.min[a] = INFINITY;
+    root_bounds.max[a] = -INFINITY;
+  }
+  for (size_t p = 0; p < n; p++) {
+    BBox bb = primitives[p]->get_bbox();
+    bounds.expand(bb);
+    for (int a = 0; a < 3; a++) {
+      prim_bounds[p].min[a] = round_down(bb.min[a]);
+      prim_bounds[p].max[a] = round_up(bb.max[a]);
+      root_bounds.min[a] = std::min(root_bounds.min[a], prim_bounds[p].min[a]);
+      root_bounds.max[a] = std::max(root_bounds.max[a], prim_bounds[p].max[a]);
+    }
+  }
+
+  size_t max_depth = options.max_depth;
+  if (max_depth == 0)
+    max_depth = (size_t)lround(8 + 1.3 * log2((double)n));
+  max_depth = std::min<size_t>(max_depth, KDTREE_MAX_DEPTH - 1);
+
+  // primitives above a split are written past those of all the nodes
+  // still waiting on the path to the root, so one array per level is needed
+  vector<Edge> edges[3];
+  for (int a = 0; a < 3; a++)
+    edges[a].resize(2 * n);
+  vector<uint32_t> below(n), above((max_depth + 1) * n);
+  for (size_t p = 0; p < n; p++)
+    below[p] = p;
+  build_node(root_bounds, prim_bounds, below.data(), n, max_depth, edges,
+             below.data(), above.data(), 0);
+}
+
+void KdTreeAccel::make_leaf(const uint32_t *prims, size_t count) {
+  KdTreeNode node;
+  node.offset = references.size();
+  node.flags = 3 | (uint32_t)(count << 2);
+  references.insert(references.end(), prims, prims + count);
+  nodes.push_back(node);
+}
+
+void KdTreeAccel::build_node(const Bounds &node_bounds,
+                             const std::vector<Bounds> &prim_bounds,
+                             uint32_t *prims, size_t count, int depth,
+                             std::vector<Edge> *edges, uint32_t *below,
+                             uint32_t *above, int bad_refines) {
+  if (count <= options.max_leaf_size || depth == 0) {
+    make_leaf(prims, count);
+    return;
+  }
+
+  double d[3];
+  for (int a = 0; a < 3; a++)
+    d[a] = (double)node_bounds.max[a] - node_bounds.min[a];
+  double inv_area = 1 / (2 * (d[0] * d[1] + d[0] * d[2] + d[1] * d[2]));
+  double leaf_cost = options.intersection_cost * count;
+
+  // sweep the primitive bounds along the longest axis first and fall back to
+  // the others if no plane inside the node was found
+  int best_axis = -1;
+  size_t best_offset = 0;
+  double best_cost = INFINITY;
+  int longest = d[0] > d[1] ? (d[0] > d[2] ? 0 : 2) : (d[1] > d[2] ? 1 : 2);
+  for (int retries = 0; retries < 3 && best_axis == -1; retries++) {
+    int axis = (longest + retries) % 3;
+    Edge *e = edges[axis].data();
+    for (size_t k = 0; k < count; k++) {
+      const Bounds &b = prim_bounds[prims[k]];
+      e[2 * k] = {b.min[axis], prims[k], true};
+      e[2 * k + 1] = {b.max[axis], prims[k], false};
+    }
+    sort(e, e + 2 * count, [](const Edge &x, const Edge &y) {
+      return x.t < y.t || (x.t == y.t && x.start && !y.start);
+    });
+
+    int a1 = (axis + 1) % 3, a2 = (axis + 2) % 3;
+    size_t num_below = 0, num_above = count;
+    for (size_t k = 0; k < 2 * count; k++) {
+      if (!e[k].start)
+        num_above--;
+      float t = e[k].t;
+      if (t > node_bounds.min[axis] && t < node_bounds.max[axis]) {
+        double below_area =
+            2 * (d[a1] * d[a2] + (t - node_bounds.min[axis]) * (d[a1] + d[a2]));
+        double above_area =
+            2 * (d[a1] * d[a2] + (node_bounds.max[axis] - t) * (d[a1] + d[a2]));
+        double bonus =
+            (num_below == 0 || num_above == 0) ? options.empty_bonus : 0;
+        double cost = options.traversal_cost +
+                      options.intersection_cost * (1 - bonus) *
+                          (below_area * inv_area * num_below +
+                           above_area * inv_area * num_above);
+        if (cost < best_cost) {
+          best_cost = cost;
+          best_axis = axis;
+          best_offset = k;
+        }
+      }
+      if (e[k].start)
+        num_below++;
+    }
+  }
+
+  // splits costlier than a leaf are allowed a few times on a path, the
+  // splits below them may still pay off
+  if (best_cost > leaf_cost)
+    bad_refines++;
+  if ((best_cost > 4 * leaf_cost && count < 16) || best_axis == -1 ||
+      bad_refines == 3) {
+    make_leaf(prims, count);
+    return;
+  }
+
+  // the sweep stops at the first axis with a plane, so its edges are
+  // still sorted
+  const Edge *e = edges[best_axis].data();
+  size_t num_below = 0, num_above = 0;
+  for (size_t k = 0; k < best_offset; k++)
+    if (e[k].start)
+      below[num_below++] = e[k].prim;
+  for (size_t k = best_offset + 1; k < 2 * count; k++)
+    if (!e[k].start)
+      above[num_above++] = e[k].prim;
+  float split = e[best_offset].t;
+
+  size_t index = nodes.size();
+  nodes.push_back(KdTreeNode());
+
+  Bounds below_bounds = node_bounds, above_bounds = node_bounds;
+  below_bounds.max[best_axis] = split;
+  above_bounds.min[best_axis] = split;
+  build_node(below_bounds, prim_bounds, below, num_below, depth - 1, edges,
+             below, above + count, bad_refines);
+
+  nodes[index].split = split;
+  nodes[index].flags = best_axis | (uint32_t)(nodes.size() << 2);
+  build_node(above_bounds, prim_bounds, above, num_above, depth - 1, edges,
+             below, above + count, bad_refines);
+}
+
+size_t KdTreeAccel::memory_bytes() const {
+  return nodes.capacity() * sizeof(KdTreeNode) +
+         references.capacity() * sizeof(uint32_t) +
+         primitives.capacity() * sizeof(Primitive *);
+}
+
+/**
+ * A subtree left for later, with the segment of the ray inside it.
+ */
+struct KdTreeTodo {
+  const KdTreeNode *node;
+  double t_min, t_max;
+  int depth;
+};
+
+bool KdTreeAccel::intersect(const Ray &ray, Intersection *i) const {
+  BVHTraversalStats &stats = BVHAccel::thread_stats();
+  stats.rays++;
+  if (nodes.empty())
+    return false;
+
+  double t_min = ray.min_t, t_max = ray.max_t;
+  stats.box_tests++;
+  if (!bounds.intersect(ray, t_min, t_max))
+    return false;
+
+  KdTreeTodo todo[KDTREE_MAX_DEPTH];
+  int todo_size = 0, depth = 0, deepest = 0;
+  const KdTreeNode *node = &nodes[0];
+  bool hit = false;
+  while (true) {
+    // a hit in a leaf closer than this node ends the search
+    if (ray.max_t < t_min)
+      break;
+
+    if (!node->is_leaf()) {
+      stats.node_visits++;
+      int axis = node->axis();
+      double t_plane = (node->split - ray.o[axis]) * ray.inv_d[axis];
+      bool below_first = ray.o[axis] < node->split ||
+                         (ray.o[axis] == node->split && ray.d[axis] <= 0);
+      const KdTreeNode *below = node + 1;
+      const KdTreeNode *above = &nodes[node->above_child()];
+      const KdTreeNode *first = below_first ? below : above;
+      const KdTreeNode *second = below_first ? above : below;
+      depth++;
+
+      // a plane behind the origin, beyond the segment or parallel to the
+      // ray leaves only one child to visit
+      if (!(t_plane <= t_max) || t_plane <= 0) {
+        node = first;
+      } else if (t_plane < t_min) {
+        node = second;
+      } else {
+        todo[todo_size++] = {second, t_plane, t_max, depth};
+        node = first;
+        t_max = t_plane;
+      }
+      continue;
+    }
+
+    deepest = max(deepest, depth);
+    const uint32_t *refs = &references[node->offset];
+    for (uint32_t k = 0; k < node->count(); k++) {
+      stats.primitive_tests++;
+      if (primitives[refs[k]]->intersect(ray, i))
+        hit = true;
+    }
+
+    if (todo_size == 0)
+      break;
+    const KdTreeTodo &next = todo[--todo_size];
+    node = next.node;
+    t_min = next.t_min;
+    t_max = next.t_max;
+    depth = next.depth;
+  }
+  stats.culled += todo_size;
+  stats.depth_histogram[min(deepest, BVH_MAX_DEPTH - 1)]++;
+  return hit;
+}
+
+bool KdTreeAccel::occluded(const Ray &ray, double t_max_segment) const {
+  BVHTraversalStats &stats = BVHAccel::thread_stats();
+  stats.rays++;
+  if (nodes.empty())
+    return false;
+
+  double t_min = ray.min_t, t_max = t_max_segment;
+  stats.box_tests++;
+  if (!bounds.intersect(ray, t_min, t_max))
+    return false;
+
+  // primitives read the segment end from the ray itself
+  double saved_max_t = ray.max_t;
+  ray.max_t = t_max_segment;
+
+  KdTreeTodo todo[KDTREE_MAX_DEPTH];
+  int todo_size = 0, depth = 0, deepest = 0;
+  const KdTreeNode *node = &nodes[0];
+  bool blocked = false;
+  while (!blocked) {
+    if (!node->is_leaf()) {
+      stats.node_visits++;
+      int axis = node->axis();
+      double t_plane = (node->split - ray.o[axis]) * ray.inv_d[axis];
+      bool below_first = ray.o[axis] < node->split ||
+                         (ray.o[axis] == node->split && ray.d[axis] <= 0);
+      const KdTreeNode *below = node + 1;
+      const KdTreeNode *above = &nodes[node->above_child()];
+      const KdTreeNode *first = below_first ? below : above;
+      const KdTreeNode *second = below_first ? above : below;
+      depth++;
+
+      if (!(t_plane <= t_max) || t_plane <= 0) {
+        node = first;
+      } else if (t_plane < t_min) {
+        node = second;
+      } else {
+        todo[todo_size++] = {second, t_plane, t_max, depth};
+        node = first;
+        t_max = t_plane;
+      }
+      continue;
+    }
+
+    deepest = max(deepest, depth);
+    const uint32_t *refs = &references[node->offset];
+    for (uint32_t k = 0; k < node->count() && !blocked; k++) {
+      stats.primitive_tests++;
+      blocked = primitives[refs[k]]->has_intersection(ray);
+    }
+
+    if (todo_size == 0)
+      break;
+    const KdTreeTodo &next = todo[--todo_size];
+    node = next.node;
+    t_min = next.t_min;
+    t_max = next.t_max;
+    depth = next.depth;
+  }
+  ray.max_t = saved_max_t;
+  stats.depth_histogram[min(deepest, BVH_MAX_DEPTH - 1)]++;
+  return blocked;
+}
+
+} // namespace SceneObjects
+} // namespace CGL
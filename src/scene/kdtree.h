@@ -0,0 +1,165 @@
+#ifndef CGL_KDTREE_H
+#define CGL_KDTREE_H
+
+#include "scene.h"
+#include "aggregate.h"
+#include "bvh.h"
+
+#include <cstdint>
+#include <vector>
+
+namespace CGL { namespace SceneObjects {
+
+/**
+ * Parameters of the kd-tree surface area heuristic.
+ */
+struct KdTreeBuildOptions {
+
+  KdTreeBuildOptions() {
+    intersection_cost = 80;
+    traversal_cost = 1;
+    empty_bonus = 0.5;
+    max_leaf_size = 1;
+    max_depth = 0;
+  }
+
+  double intersection_cost; ///< relative cost of a primitive test
+  double traversal_cost;    ///< relative cost of visiting an interior node
+  double empty_bonus;       ///< fraction of the cost taken off splits that
+                            ///< leave one side empty
+  size_t max_leaf_size;     ///< nodes with this many primitives or fewer
+                            ///< are not split
+  size_t max_depth;         ///< deepest level of the tree, 0 to use
+                            ///< 8 + 1.3 log2 of the primitive count
+};
+
+/**
+ * Maximum depth of a kd-tree, which bounds the traversal stack.
+ */
+#define KDTREE_MAX_DEPTH 64
+
+/**
+ * A node of the kd-tree, 8 bytes.
+ * The low two bits of flags are the split axis of an interior node, or 3 for
+ * a leaf, the other bits the index of the child above the split or the
+ * number of primitives of the leaf. The child below the split directly
+ * follows its parent. Splits are single precision; the builder rounds the
+ * primitive bounds outwards to floats first and only splits on those, so a
+ * primitive is always on the side of the split its bounds are.
+ */
+struct KdTreeNode {
+
+  inline bool is_leaf() const { return (flags & 3) == 3; }
+  inline int axis() const { return flags & 3; }
+  inline uint32_t above_child() const { return flags >> 2; }
+  inline uint32_t count() const { return flags >> 2; }
+
+  union {
+    float split;     ///< split position, interior nodes
+    uint32_t offset; ///< first primitive reference, leaves
+  };
+  uint32_t flags;    ///< axis or leaf tag, child index or primitive count
+};
+
+/**
+ * Kd-tree for fast Ray - Primitive intersection.
+ * Nodes split space with axis aligned planes chosen by the surface area
+ * heuristic, and primitives that straddle a plane are referenced on both
+ * sides. Traversal visits the leaves along the ray front to back and stops
+ * at the first leaf that contains a hit, which suits closed architectural
+ * scenes where most rays end close to their origin. Like BVHAccel it is an
+ * Aggregate holding all the primitives it was built from.
+ */
+class KdTreeAccel : public Aggregate {
+ public:
+
+  /**
+   * Parameterized Constructor.
+   * Create a kd-tree from a list of primitives. The primitives need to be
+   * kept in memory for the aggregate to function properly.
+   * \param primitives primitives to build from
+   * \param options cost model of the builder
+   */
+  KdTreeAccel(const std::vector<Primitive*>& primitives,
+              const KdTreeBuildOptions& options = KdTreeBuildOptions());
+
+  /**
+   * Get the world space bounding box of the aggregate.
+   */
+  BBox get_bbox() const { return bounds; }
+
+  /**
+   * Ray - Aggregate intersection.
+   * \param r ray to test intersection with
+   * \return true if the given ray intersects with the aggregate
+   */
+  bool has_intersection(const Ray& r) const { return occluded(r, r.max_t); }
+
+  /**
+   * Ray - Aggregate occlusion query, see Aggregate::occluded. Stops at the
+   * first primitive found in the segment.
+   */
+  bool occluded(const Ray& r, double t_max) const;
+
+  /**
+   * Ray - Aggregate intersection 2.
+   * Finds the closest hit of the ray and stores its intersection
+   * information in i.
+   * \param r ray to test intersection with
+   * \param i address to store intersection info
+   * \return true if the given ray intersects with the aggregate
+   */
+  bool intersect(const Ray& r, Intersection* i) const;
+
+  /**
+   * Nodes and primitive references.
+   */
+  size_t memory_bytes() const;
+
+  /**
+   * Number of interior and leaf nodes.
+   */
+  size_t num_nodes() const { return nodes.size(); }
+
+  /**
+   * Number of primitive references in the leaves, with the duplicates of
+   * primitives that straddle a split.
+   */
+  size_t num_references() const { return references.size(); }
+
+  void draw(const Color& c, float alpha) const { }
+  void drawOutline(const Color& c, float alpha) const { }
+
+ private:
+  /**
+   * Start or end of the bounds of a primitive along one axis.
+   */
+  struct Edge {
+    float t;       ///< position
+    uint32_t prim; ///< primitive index
+    bool start;    ///< min side of the bounds
+  };
+
+  /**
+   * Single precision bounds of a primitive, rounded outwards.
+   */
+  struct Bounds {
+    float min[3], max[3];
+  };
+
+  KdTreeBuildOptions options;
+  BBox bounds;                      ///< bounds of all primitives
+  std::vector<KdTreeNode> nodes;    ///< the root is at index 0
+  std::vector<uint32_t> references; ///< primitive indices, leaf by leaf
+
+  void build_node(const Bounds& node_bounds,
+                  const std::vector<Bounds>& prim_bounds, uint32_t* prims,
+                  size_t count, int depth, std::vector<Edge>* edges,
+                  uint32_t* below, uint32_t* above, int bad_refines);
+  void make_leaf(const uint32_t* prims, size_t count);
+};
+
+} // namespace SceneObjects
+} // namespace CGL
+
+#endif // CGL_KDTREE_H
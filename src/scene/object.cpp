@@ -26,6 +26,7 @@ Mesh::Mesh(const HalfedgeMesh& mesh, BSDF* bsdf) {
     vertexI++;
   }
 
+  num_vertices = vertexI;
   positions = new Vector3D[vertexI];
   normals   = new Vector3D[vertexI];
   for (int i = 0; i < vertexI; i++) {
@@ -33,6 +34,7 @@ Mesh::Mesh(const HalfedgeMesh& mesh, BSDF* bsdf) {
     normals[i]   = verts[i]->normal;
   }
 
+  vector<uint32_t> indices;
   for (FaceCIter f = mesh.facesBegin(); f != mesh.facesEnd(); f++) {
     HalfedgeCIter h = f->halfedge();
     indices.push_back(vertexLabels[&*h->vertex()]);
@@ -42,25 +44,56 @@ Mesh::Mesh(const HalfedgeMesh& mesh, BSDF* bsdf) {
 
   this->bsdf = bsdf;
 
+  triangles = new TriangleStore(positions, normals, num_vertices, indices,
+                                bsdf);
+}
+
+Mesh::~Mesh() {
+  delete triangles;
+  delete[] positions;
+  delete[] normals;
 }
 
 vector<Primitive*> Mesh::get_primitives() const {
 
   vector<Primitive*> primitives;
-  size_t num_triangles = indices.size() / 3;
-  for (size_t i = 0; i < num_triangles; ++i) {
-    Triangle* tri = new Triangle(this, indices[i * 3],
-                                       indices[i * 3 + 1],
-                                       indices[i * 3 + 2]);
-    primitives.push_back(tri);
-  }
+  primitives.reserve(triangles->size());
+  for (const Triangle& tri : triangles->triangles)
+    primitives.push_back(const_cast<Triangle*>(&tri));
   return primitives;
 }
 
+bool Mesh::same_topology(const Mesh& other) const {
+  return num_vertices == other.num_vertices &&
+         triangles->indices == other.triangles->indices;
+}
+
+void Mesh::update_vertices(const Mesh& other) {
+  for (size_t i = 0; i < num_vertices; i++) {
+    positions[i] = other.positions[i];
+    normals[i] = other.normals[i];
+  }
+  triangles->update_vertices(positions, normals);
+}
+
 BSDF* Mesh::get_bsdf() const {
   return bsdf;
 }
 
+// Mesh instance //
+
+MeshInstance::MeshInstance(const Mesh* mesh, const Matrix4x4& transform,
+                           BSDF* bsdf)
+    : mesh(mesh), transform(transform), bsdf(bsdf) { }
+
+vector<Primitive*> MeshInstance::get_primitives() const {
+  return vector<Primitive*>();
+}
+
+BSDF* MeshInstance::get_bsdf() const {
+  return bsdf;
+}
+
 // Sphere object //
 
 SphereObject::SphereObject(const Vector3D o, double r, BSDF* bsdf) {
@@ -1,11 +1,14 @@
 #ifndef CGL_STATICSCENE_OBJECT_H
 #define CGL_STATICSCENE_OBJECT_H
 
+#include "CGL/matrix4x4.h"
 #include "util/halfEdgeMesh.h"
 #include "scene.h"
 
 namespace CGL { namespace SceneObjects {
 
+class TriangleStore;
+
 /**
  * A triangle mesh object.
  */
@@ -20,27 +23,108 @@ class Mesh : public SceneObject {
    */
   Mesh(const HalfedgeMesh& mesh, BSDF* bsdf);
 
+  /**
+   * Destructor.
+   * Frees the vertex arrays and the triangles of the mesh.
+   */
+  ~Mesh();
+
   /**
    * Get all the primitives (Triangle) in the mesh.
-   * Note that Triangle reference the mesh for the actual data.
+   * Note that Triangle reference the triangle store of the mesh for the
+   * actual data, and that the same primitives are returned on every call.
    * \return all the primitives in the mesh
    */
   vector<Primitive*> get_primitives() const;
 
+  /**
+   * Check if another mesh has the same vertices and triangles as this one,
+   * which means it can only differ in vertex positions and normals.
+   * \param other the mesh to compare with
+   * \return true if the meshes have the same topology
+   */
+  bool same_topology(const Mesh& other) const;
+
+  /**
+   * Copy vertex positions and normals from a mesh with the same topology.
+   * Triangles returned earlier by get_primitives see the new vertices.
+   * \param other the mesh to copy from, see same_topology
+   */
+  void update_vertices(const Mesh& other);
+
   /**
    * Get the BSDF of the surface material of the mesh.
    * \return BSDF of the surface material of the mesh
    */
   BSDF* get_bsdf() const;
 
+  /**
+   * Get the triangles of the mesh in structure-of-arrays form.
+   */
+  const TriangleStore* get_triangles() const { return triangles; }
+
   Vector3D *positions;  ///< position array
   Vector3D *normals;    ///< normal array
+  size_t num_vertices;  ///< length of the attribute arrays
 
  private:
 
+  Mesh(const Mesh&);             // owns its arrays, not copyable
+  Mesh& operator=(const Mesh&);
+
   BSDF* bsdf; ///< BSDF of surface material
 
-  vector<size_t> indices;  ///< triangles defined by indices
+  TriangleStore* triangles;  ///< triangles defined by indices
+
+};
+
+/**
+ * A placed copy of another triangle mesh.
+ * Shares the geometry of a Mesh that is also part of the scene and only adds
+ * a transform and a material of its own. The renderer builds a single BVH for
+ * the shared mesh and places it once per copy instead of duplicating the
+ * triangles.
+ */
+class MeshInstance : public SceneObject {
+ public:
+
+  /**
+   * Constructor.
+   * \param mesh the shared mesh, must outlive the instance
+   * \param transform affine transform from the world space of the shared
+   *                  mesh to the world space of the copy
+   * \param bsdf surface material of the copy
+   */
+  MeshInstance(const Mesh* mesh, const Matrix4x4& transform, BSDF* bsdf);
+
+  /**
+   * Get all the primitives in the instance.
+   * An instance owns no primitives, the renderer places the BVH of the shared
+   * mesh instead. Therefore this always returns an empty list.
+   */
+  vector<Primitive*> get_primitives() const;
+
+  /**
+   * Get the BSDF of the surface material of the copy.
+   * \return BSDF of the surface material of the copy
+   */
+  BSDF* get_bsdf() const;
+
+  /**
+   * Get the shared mesh.
+   */
+  const Mesh* get_mesh() const { return mesh; }
+
+  /**
+   * Get the transform from the shared mesh to the copy.
+   */
+  const Matrix4x4& get_transform() const { return transform; }
+
+ private:
+
+  const Mesh* mesh;     ///< shared mesh
+  Matrix4x4 transform;  ///< shared mesh to copy transform
+  BSDF* bsdf;           ///< BSDF of surface material
 
 };
 
@@ -0,0 +1,396 @@
+#ifndef CGL_RAY_BOX_H
+#define CGL_RAY_BOX_H
+
+#include <cstdint>
+#include <limits>
+
+#if defined(__SSE4_1__) || defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+#include "pathtracer/ray.h"
+
+namespace CGL {
+
+/**
+ * Error bound of the single precision slab test, see PBR 3.9.2.
+ * Far plane distances are scaled by this so that a ray grazing a box edge
+ * can not slip through because of rounding.
+ */
+static const float ray_box_robust_scale =
+    1.0f + 2.0f * 3.0f * std::numeric_limits<float>::epsilon();
+
+/**
+ * Per-ray data used by the slab kernels.
+ * Computed once per ray and reused for every box tested during traversal,
+ * so the kernels themselves only subtract, multiply and select.
+ */
+struct RayBoxData {
+
+  /**
+   * Constructor.
+   * Caches the ray in single precision together with the index of the slab
+   * plane the ray meets first along each axis.
+   * \param r the ray to cache
+   */
+  RayBoxData(const Ray& r) {
+    for (int a = 0; a < 3; a++) {
+      o[a] = r.o[a];
+      inv_d[a] = r.inv_d[a];
+      sign[a] = r.sign[a];
+      near[a] = r.sign[a] ? 4 + a : a;
+      far[a] = r.sign[a] ? a : 4 + a;
+    }
+    t_min = r.min_t;
+  }
+
+  float o[3];     ///< origin
+  float inv_d[3]; ///< component wise inverse direction
+  int sign[3];    ///< 1 where the direction component is negative
+  int near[3];    ///< index of the entry plane in an 8 float box
+  int far[3];     ///< index of the exit plane in an 8 float box
+  float t_min;    ///< start of the ray segment
+};
+
+/**
+ * Ray - box slab test for a single box.
+ * The box is given as 8 floats with the min corner in [0, 3) and the max
+ * corner in [4, 7); the two padding slots are never read, which lets nodes
+ * keep a child index or primitive count there.
+ * Division by zero in the inverse direction is handled: a NaN slab distance
+ * leaves the interval unchanged.
+ * \param box min and max corners of the box
+ * \param r per-ray data of the ray to test
+ * \param t_max end of the ray segment
+ * \param t_entry if not NULL, receives the entry time on return
+ * \param t_exit if not NULL, receives the exit time on return
+ * \return true if the box overlaps [t_min, t_max] along the ray
+ */
+inline bool ray_box_intersect(const float* box, const RayBoxData& r,
+                              float t_max, float* t_entry = NULL,
+                              float* t_exit = NULL) {
+  float t0 = r.t_min, t1 = t_max;
+  for (int a = 0; a < 3; a++) {
+    float near = (box[r.near[a]] - r.o[a]) * r.inv_d[a];
+    float far = (box[r.far[a]] - r.o[a]) * r.inv_d[a] * ray_box_robust_scale;
+    t0 = near > t0 ? near : t0;
+    t1 = far < t1 ? far : t1;
+  }
+  if (t_entry) *t_entry = t0;
+  if (t_exit) *t_exit = t1;
+  return t0 <= t1;
+}
+
+/**
+ * N boxes stored as structure of arrays, one lane per box.
+ * Unused lanes should be filled with an empty box (min = +inf,
+ * max = -inf), which every ray misses.
+ */
+template <int N>
+struct alignas(N * sizeof(float)) RayBoxSoA {
+  float bounds[2][3][N]; ///< [0 = min, 1 = max][axis][lane]
+
+  /**
+   * Make every lane an empty box.
+   */
+  void clear() {
+    for (int a = 0; a < 3; a++) {
+      for (int i = 0; i < N; i++) {
+        bounds[0][a][i] = std::numeric_limits<float>::infinity();
+        bounds[1][a][i] = -std::numeric_limits<float>::infinity();
+      }
+    }
+  }
+
+  /**
+   * Store a box in a lane.
+   * \param i the lane
+   * \param box min and max corners in the 8 float layout
+   */
+  void set(int i, const float* box) {
+    for (int a = 0; a < 3; a++) {
+      bounds[0][a][i] = box[a];
+      bounds[1][a][i] = box[4 + a];
+    }
+  }
+};
+
+typedef RayBoxSoA<4> RayBox4;
+typedef RayBoxSoA<8> RayBox8;
+
+/**
+ * Scalar slab test over all lanes of a SoA box group.
+ * Fallback for the SIMD kernels below and reference for testing them.
+ * \param boxes the boxes to test
+ * \param r per-ray data of the ray to test
+ * \param t_max end of the ray segment
+ * \param t_entry receives the entry time of each lane
+ * \return bit mask of the lanes that were hit
+ */
+template <int N>
+inline int ray_box_intersect_scalar(const RayBoxSoA<N>& boxes,
+                                    const RayBoxData& r, float t_max,
+                                    float* t_entry) {
+  int mask = 0;
+  for (int i = 0; i < N; i++) {
+    float t0 = r.t_min, t1 = t_max;
+    for (int a = 0; a < 3; a++) {
+      float near = (boxes.bounds[r.sign[a]][a][i] - r.o[a]) * r.inv_d[a];
+      float far = (boxes.bounds[1 - r.sign[a]][a][i] - r.o[a]) * r.inv_d[a] *
+                  ray_box_robust_scale;
+      t0 = near > t0 ? near : t0;
+      t1 = far < t1 ? far : t1;
+    }
+    t_entry[i] = t0;
+    mask |= (t0 <= t1) << i;
+  }
+  return mask;
+}
+
+/**
+ * Slab test against four boxes at once.
+ * Uses SSE when available and the scalar loop otherwise.
+ * \param boxes the boxes to test
+ * \param r per-ray data of the ray to test
+ * \param t_max end of the ray segment
+ * \param t_entry receives the entry time of each lane (16 byte aligned)
+ * \return bit mask of the lanes that were hit
+ */
+inline int ray_box_intersect4(const RayBox4& boxes, const RayBoxData& r,
+                              float t_max, float* t_entry) {
+#ifdef __SSE4_1__
+  __m128 t0 = _mm_set1_ps(r.t_min);
+  __m128 t1 = _mm_set1_ps(t_max);
+  const __m128 scale = _mm_set1_ps(ray_box_robust_scale);
+  for (int a = 0; a < 3; a++) {
+    __m128 o = _mm_set1_ps(r.o[a]);
+    __m128 inv_d = _mm_set1_ps(r.inv_d[a]);
+    __m128 lo = _mm_load_ps(boxes.bounds[r.sign[a]][a]);
+    __m128 hi = _mm_load_ps(boxes.bounds[1 - r.sign[a]][a]);
+    __m128 near = _mm_mul_ps(_mm_sub_ps(lo, o), inv_d);
+    __m128 far = _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(hi, o), inv_d), scale);
+    // max/min return the second operand on NaN, keeping the interval
+    t0 = _mm_max_ps(near, t0);
+    t1 = _mm_min_ps(far, t1);
+  }
+  _mm_store_ps(t_entry, t0);
+  return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+#else
+  return ray_box_intersect_scalar(boxes, r, t_max, t_entry);
+#endif
+}
+
+/**
+ * Slab test against eight boxes at once.
+ * Uses AVX when available and the scalar loop otherwise.
+ * \param boxes the boxes to test
+ * \param r per-ray data of the ray to test
+ * \param t_max end of the ray segment
+ * \param t_entry receives the entry time of each lane (32 byte aligned)
+ * \return bit mask of the lanes that were hit
+ */
+inline int ray_box_intersect8(const RayBox8& boxes, const RayBoxData& r,
+                              float t_max, float* t_entry) {
+#ifdef __AVX__
+  __m256 t0 = _mm256_set1_ps(r.t_min);
+  __m256 t1 = _mm256_set1_ps(t_max);
+  const __m256 scale = _mm256_set1_ps(ray_box_robust_scale);
+  for (int a = 0; a < 3; a++) {
+    __m256 o = _mm256_set1_ps(r.o[a]);
+    __m256 inv_d = _mm256_set1_ps(r.inv_d[a]);
+    __m256 lo = _mm256_load_ps(boxes.bounds[r.sign[a]][a]);
+    __m256 hi = _mm256_load_ps(boxes.bounds[1 - r.sign[a]][a]);
+    __m256 near = _mm256_mul_ps(_mm256_sub_ps(lo, o), inv_d);
+    __m256 far =
+        _mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(hi, o), inv_d), scale);
+    t0 = _mm256_max_ps(near, t0);
+    t1 = _mm256_min_ps(far, t1);
+  }
+  _mm256_store_ps(t_entry, t0);
+  return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+#else
+  return ray_box_intersect_scalar(boxes, r, t_max, t_entry);
+#endif
+}
+
+/**
+ * Maximum number of rays traced together as a packet, one bit of a 64 bit
+ * mask per ray.
+ */
+#define RAY_PACKET_SIZE 64
+
+/**
+ * Per-ray data of a packet of rays used by the packet slab kernel.
+ * Stored as structure of arrays so that one box is tested against eight rays
+ * at once. t_max is kept up to date by the traversal as rays find hits.
+ */
+struct alignas(32) RayPacketData {
+
+  /**
+   * Cache a ray of the packet in single precision.
+   * \param k index of the ray in the packet
+   * \param r the ray to cache
+   */
+  void set(int k, const Ray& r) {
+    for (int a = 0; a < 3; a++) {
+      o[a][k] = r.o[a];
+      inv_d[a][k] = r.inv_d[a];
+    }
+    t_min[k] = r.min_t;
+    t_max[k] = r.max_t;
+  }
+
+  float o[3][RAY_PACKET_SIZE];     ///< origins
+  float inv_d[3][RAY_PACKET_SIZE]; ///< component wise inverse directions
+  float t_min[RAY_PACKET_SIZE];    ///< starts of the ray segments
+  float t_max[RAY_PACKET_SIZE];    ///< ends of the ray segments
+};
+
+/**
+ * Slab test of a single box against the active rays of a packet.
+ * Rays are tested in groups of eight with AVX when available. Each ray picks
+ * its entry plane by the sign of its inverse direction, so the results are
+ * the same as those of ray_box_intersect for every ray.
+ * \param box min and max corners of the box in the 8 float layout
+ * \param p per-ray data of the packet
+ * \param active bit mask of the rays to test
+ * \param t_entry if not NULL, receives the entry time of every tested ray
+ *                (RAY_PACKET_SIZE floats, 32 byte aligned)
+ * \return bit mask of the active rays that hit the box
+ */
+inline uint64_t ray_box_intersect_packet(const float* box,
+                                         const RayPacketData& p,
+                                         uint64_t active,
+                                         float* t_entry = NULL) {
+  uint64_t hits = 0;
+#ifdef __AVX__
+  const __m256 scale = _mm256_set1_ps(ray_box_robust_scale);
+  for (int b = 0; b < RAY_PACKET_SIZE; b += 8) {
+    if (!((active >> b) & 0xff))
+      continue;
+    __m256 t0 = _mm256_load_ps(p.t_min + b);
+    __m256 t1 = _mm256_load_ps(p.t_max + b);
+    for (int a = 0; a < 3; a++) {
+      __m256 o = _mm256_load_ps(p.o[a] + b);
+      __m256 inv_d = _mm256_load_ps(p.inv_d[a] + b);
+      __m256 lo = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box[a]), o), inv_d);
+      __m256 hi =
+          _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box[4 + a]), o), inv_d);
+      // the sign bit of the inverse direction selects the entry plane
+      __m256 near = _mm256_blendv_ps(lo, hi, inv_d);
+      __m256 far = _mm256_mul_ps(_mm256_blendv_ps(hi, lo, inv_d), scale);
+      t0 = _mm256_max_ps(near, t0);
+      t1 = _mm256_min_ps(far, t1);
+    }
+    if (t_entry)
+      _mm256_store_ps(t_entry + b, t0);
+    hits |= (uint64_t)_mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ))
+            << b;
+  }
+#else
+  for (int k = 0; k < RAY_PACKET_SIZE; k++) {
+    if (!((active >> k) & 1))
+      continue;
+    float t0 = p.t_min[k], t1 = p.t_max[k];
+    for (int a = 0; a < 3; a++) {
+      int sign = p.inv_d[a][k] < 0;
+      float near = (box[sign ? 4 + a : a] - p.o[a][k]) * p.inv_d[a][k];
+      float far = (box[sign ? a : 4 + a] - p.o[a][k]) * p.inv_d[a][k] *
+                  ray_box_robust_scale;
+      t0 = near > t0 ? near : t0;
+      t1 = far < t1 ? far : t1;
+    }
+    if (t_entry)
+      t_entry[k] = t0;
+    hits |= (uint64_t)(t0 <= t1) << k;
+  }
+#endif
+  return hits & active;
+}
+
+/**
+ * Interval bounds of a packet of rays with a common origin.
+ * The inverse directions of the rays are bounded per axis, which gives one
+ * conservative slab test for the whole packet: a box the interval test
+ * misses is missed by every ray. Axes on which the directions of the rays
+ * differ in sign are left out of the test. Only usable when all rays share
+ * their origin, see valid.
+ */
+struct RayPacketInterval {
+
+  /**
+   * Bound the active rays of a packet.
+   * \param p per-ray data of the packet
+   * \param active bit mask of the rays to bound
+   */
+  RayPacketInterval(const RayPacketData& p, uint64_t active) {
+    valid = active != 0;
+    t_min = std::numeric_limits<float>::infinity();
+    t_max = -std::numeric_limits<float>::infinity();
+    for (int a = 0; a < 3; a++) {
+      inv_d_min[a] = std::numeric_limits<float>::infinity();
+      inv_d_max[a] = -std::numeric_limits<float>::infinity();
+    }
+    int first = -1;
+    for (int k = 0; k < RAY_PACKET_SIZE && valid; k++) {
+      if (!((active >> k) & 1))
+        continue;
+      if (first < 0)
+        first = k;
+      for (int a = 0; a < 3; a++) {
+        float inv_d = p.inv_d[a][k];
+        valid = valid && p.o[a][k] == p.o[a][first];
+        inv_d_min[a] = inv_d < inv_d_min[a] ? inv_d : inv_d_min[a];
+        inv_d_max[a] = inv_d > inv_d_max[a] ? inv_d : inv_d_max[a];
+      }
+      t_min = p.t_min[k] < t_min ? p.t_min[k] : t_min;
+      t_max = p.t_max[k] > t_max ? p.t_max[k] : t_max;
+    }
+    for (int a = 0; valid && a < 3; a++) {
+      o[a] = p.o[a][first];
+      mixed[a] = (inv_d_min[a] < 0) != (inv_d_max[a] < 0);
+      near[a] = inv_d_min[a] < 0 ? 4 + a : a;
+      far[a] = inv_d_min[a] < 0 ? a : 4 + a;
+    }
+  }
+
+  float o[3];         ///< common origin
+  float inv_d_min[3]; ///< smallest inverse direction on each axis
+  float inv_d_max[3]; ///< largest inverse direction on each axis
+  int near[3];        ///< index of the entry plane in an 8 float box
+  int far[3];         ///< index of the exit plane in an 8 float box
+  bool mixed[3];      ///< the directions differ in sign on the axis
+  float t_min;        ///< earliest start of the ray segments
+  float t_max;        ///< latest end of the ray segments
+  bool valid;         ///< the rays share their origin
+};
+
+/**
+ * Interval slab test of a box against a whole packet.
+ * Takes, on each axis, the earliest entry and the latest exit of any ray of
+ * the packet, so a miss is conservative. NaN distances from rays parallel
+ * to a slab leave the interval unchanged as in ray_box_intersect.
+ * \param box min and max corners of the box in the 8 float layout
+ * \param f interval bounds of the packet, must be valid
+ * \return false if no ray of the packet can hit the box
+ */
+inline bool ray_box_intersect_interval(const float* box,
+                                       const RayPacketInterval& f) {
+  float t0 = f.t_min, t1 = f.t_max;
+  for (int a = 0; a < 3; a++) {
+    if (f.mixed[a])
+      continue;
+    float to_near = box[f.near[a]] - f.o[a];
+    float to_far = box[f.far[a]] - f.o[a];
+    float near = to_near * (to_near >= 0 ? f.inv_d_min[a] : f.inv_d_max[a]);
+    float far = to_far * (to_far >= 0 ? f.inv_d_max[a] : f.inv_d_min[a]) *
+                ray_box_robust_scale;
+    t0 = near > t0 ? near : t0;
+    t1 = far < t1 ? far : t1;
+  }
+  return t0 <= t1;
+}
+
+} // namespace CGL
+
+#endif // CGL_RAY_BOX_H
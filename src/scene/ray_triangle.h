@@ -0,0 +1,407 @@
+#ifndef CGL_RAY_TRIANGLE_H
+#define CGL_RAY_TRIANGLE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "pathtracer/ray.h"
+#include "util/real.h"
+
+// the SIMD kernels work on floats, double precision builds test one
+// triangle at a time
+#if !defined(PT_DOUBLE_PRECISION) && defined(__AVX__)
+#define RAY_TRIANGLE_AVX
+#endif
+#if !defined(PT_DOUBLE_PRECISION) && defined(__SSE4_1__)
+#define RAY_TRIANGLE_SSE
+#endif
+
+#if defined(RAY_TRIANGLE_SSE) || defined(RAY_TRIANGLE_AVX)
+#include <immintrin.h>
+#endif
+
+namespace CGL {
+
+/**
+ * Per-ray data used by the triangle kernels.
+ * The watertight test of Woop et al. (JCGT 2013) shears and scales space so
+ * that the ray runs along +z from the origin. The permutation and shear
+ * depend only on the ray and are computed once per ray.
+ */
+struct RayTriangleData {
+
+  /**
+   * Constructor.
+   * Picks the dominant axis of the direction as z, keeping the winding of
+   * the remaining axes, and computes the shear onto it.
+   * \param r the ray to cache
+   */
+  RayTriangleData(const Ray& r) {
+    kz = 0;
+    for (int a = 1; a < 3; a++)
+      if (std::fabs(r.d[a]) > std::fabs(r.d[kz])) kz = a;
+    kx = (kz + 1) % 3;
+    ky = (kx + 1) % 3;
+    if (r.d[kz] < 0) {
+      int k = kx;
+      kx = ky;
+      ky = k;
+    }
+    shear[0] = r.d[kx] / r.d[kz];
+    shear[1] = r.d[ky] / r.d[kz];
+    shear[2] = 1.0 / r.d[kz];
+    for (int a = 0; a < 3; a++)
+      o[a] = r.o[a];
+  }
+
+  Real o[3];      ///< origin
+  int kx, ky, kz; ///< axes of the sheared space, kz dominant
+  Real shear[3];  ///< x and y shear along kz and the scale of z
+};
+
+/**
+ * Lanes of a triangle block: the width of the widest SIMD kernel built.
+ */
+#if defined(RAY_TRIANGLE_AVX)
+static const int ray_triangle_width = 8;
+#elif defined(RAY_TRIANGLE_SSE)
+static const int ray_triangle_width = 4;
+#else
+static const int ray_triangle_width = 1;
+#endif
+
+/**
+ * Triangles stored in blocks of ray_triangle_width lanes, each block a
+ * structure of arrays that a single SIMD test covers.
+ * A BVH keeps one slot per primitive reference, so the triangles of a leaf
+ * are consecutive lanes of one or two neighbouring blocks. Slots of other
+ * primitives hold NaN vertices, which no ray hits.
+ */
+struct RayTriangleSoA {
+
+  struct alignas(ray_triangle_width * sizeof(Real)) Block {
+    Real v[3][3][ray_triangle_width]; ///< [vertex][axis][lane]
+  };
+
+  /**
+   * Resize to n slots, all empty.
+   */
+  void resize(size_t n) {
+    Block empty;
+    for (int k = 0; k < 3; k++)
+      for (int a = 0; a < 3; a++)
+        for (int c = 0; c < ray_triangle_width; c++)
+          empty.v[k][a][c] = std::numeric_limits<Real>::quiet_NaN();
+    blocks.assign((n + ray_triangle_width - 1) / ray_triangle_width, empty);
+  }
+
+  /**
+   * Store a triangle in a slot.
+   * \param i the slot
+   * \param p the three vertices
+   */
+  void set(size_t i, const Vector3D* p) {
+    Block& b = blocks[i / ray_triangle_width];
+    for (int k = 0; k < 3; k++)
+      for (int a = 0; a < 3; a++)
+        b.v[k][a][i % ray_triangle_width] = p[k][a];
+  }
+
+  /**
+   * Get one coordinate of a vertex of a slot.
+   */
+  Real vertex(size_t i, int k, int a) const {
+    return blocks[i / ray_triangle_width].v[k][a][i % ray_triangle_width];
+  }
+
+  /**
+   * Memory held by the blocks in bytes.
+   */
+  size_t memory_bytes() const { return blocks.capacity() * sizeof(Block); }
+
+  std::vector<Block> blocks; ///< aligned by the over-aligned new of C++17
+};
+
+/**
+ * Watertight ray - triangle test of one slot.
+ * Fallback for the SIMD kernels below and reference for testing them.
+ * \param tris the triangles
+ * \param i the slot to test
+ * \param r per-ray data of the ray to test
+ * \param t_min start of the ray segment
+ * \param t_max end of the ray segment
+ * \param t receives the hit distance
+ * \param u receives the barycentric weight of the second vertex
+ * \param v receives the barycentric weight of the third vertex
+ * \return true if the triangle is hit inside (t_min, t_max)
+ */
+inline bool ray_triangle_intersect(const RayTriangleSoA& tris, size_t i,
+                                   const RayTriangleData& r, Real t_min,
+                                   Real t_max, Real* t, Real* u, Real* v) {
+  Real x[3], y[3], z[3];
+  for (int k = 0; k < 3; k++) {
+    Real px = tris.vertex(i, k, r.kx) - r.o[r.kx];
+    Real py = tris.vertex(i, k, r.ky) - r.o[r.ky];
+    Real pz = tris.vertex(i, k, r.kz) - r.o[r.kz];
+    x[k] = px - r.shear[0] * pz;
+    y[k] = py - r.shear[1] * pz;
+    z[k] = r.shear[2] * pz;
+  }
+  Real e0 = x[2] * y[1] - y[2] * x[1];
+  Real e1 = x[0] * y[2] - y[0] * x[2];
+  Real e2 = x[1] * y[0] - y[1] * x[0];
+  bool inside = (e0 >= 0 && e1 >= 0 && e2 >= 0) ||
+                (e0 <= 0 && e1 <= 0 && e2 <= 0);
+  Real det = e0 + e1 + e2;
+  if (!inside || det == 0)
+    return false;
+  Real hit_t = (e0 * z[0] + e1 * z[1] + e2 * z[2]) / det;
+  if (!(hit_t > t_min && hit_t < t_max))
+    return false;
+  *t = hit_t;
+  *u = e1 / det;
+  *v = e2 / det;
+  return true;
+}
+
+/**
+ * Pick the nearest of the lanes of a SIMD triangle test that hit.
+ * The kernels compare the scaled distance T against the segment scaled by
+ * the determinant, so only the lanes that pass pay for the divisions, which
+ * are the same as those of ray_triangle_intersect.
+ */
+template <int W>
+inline long ray_triangle_pick(int mask, size_t base, const float* T,
+                              const float* e1, const float* e2,
+                              const float* det, float t_min, float* t_max,
+                              float* u, float* v, long best) {
+  for (int c = 0; c < W; c++) {
+    if (!(mask & (1 << c)))
+      continue;
+    float t = T[c] / det[c];
+    if (t > t_min && t < *t_max) {
+      *t_max = t;
+      *u = e1[c] / det[c];
+      *v = e2[c] / det[c];
+      best = base + c;
+    }
+  }
+  return best;
+}
+
+/**
+ * Bounds of the division-free segment test of the SIMD kernels.
+ * The products t * |det| they compare T against are rounded, so the bounds
+ * are widened by a few ulps to never drop a lane that ray_triangle_pick
+ * would take. Lanes let through by the widening are rejected there.
+ */
+inline float ray_triangle_lower(float t_min) {
+  return t_min - 4 * std::numeric_limits<float>::epsilon() * std::fabs(t_min);
+}
+
+inline float ray_triangle_upper(float t_max) {
+  return t_max + 4 * std::numeric_limits<float>::epsilon() * std::fabs(t_max);
+}
+
+#ifdef RAY_TRIANGLE_AVX
+/**
+ * Nearest hit among consecutive triangle slots, eight slots at a time.
+ * Same arguments and result as ray_triangle_nearest.
+ */
+inline long ray_triangle_nearest8(const RayTriangleSoA& tris, size_t first,
+                                  size_t count, const RayTriangleData& r,
+                                  float t_min, float* t_max, float* u,
+                                  float* v) {
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 sign_mask = _mm256_set1_ps(-0.0f);
+  const __m256 sx = _mm256_set1_ps(r.shear[0]);
+  const __m256 sy = _mm256_set1_ps(r.shear[1]);
+  const __m256 sz = _mm256_set1_ps(r.shear[2]);
+  const __m256 ox = _mm256_set1_ps(r.o[r.kx]);
+  const __m256 oy = _mm256_set1_ps(r.o[r.ky]);
+  const __m256 oz = _mm256_set1_ps(r.o[r.kz]);
+  const float lower = ray_triangle_lower(t_min);
+  long best = -1;
+  size_t end = first + count;
+  for (size_t b = first / 8; b * 8 < end; b++) {
+    const RayTriangleSoA::Block& block = tris.blocks[b];
+    size_t base = b * 8;
+    // lanes of the block inside [first, end)
+    int lanes = (1 << std::min<size_t>(end - base, 8)) - 1;
+    if (first > base)
+      lanes &= ~((1 << (first - base)) - 1);
+    __m256 x[3], y[3], z[3];
+    for (int k = 0; k < 3; k++) {
+      __m256 px = _mm256_sub_ps(_mm256_load_ps(block.v[k][r.kx]), ox);
+      __m256 py = _mm256_sub_ps(_mm256_load_ps(block.v[k][r.ky]), oy);
+      __m256 pz = _mm256_sub_ps(_mm256_load_ps(block.v[k][r.kz]), oz);
+      x[k] = _mm256_sub_ps(px, _mm256_mul_ps(sx, pz));
+      y[k] = _mm256_sub_ps(py, _mm256_mul_ps(sy, pz));
+      z[k] = _mm256_mul_ps(sz, pz);
+    }
+    __m256 e0 = _mm256_sub_ps(_mm256_mul_ps(x[2], y[1]),
+                              _mm256_mul_ps(y[2], x[1]));
+    __m256 e1 = _mm256_sub_ps(_mm256_mul_ps(x[0], y[2]),
+                              _mm256_mul_ps(y[0], x[2]));
+    __m256 e2 = _mm256_sub_ps(_mm256_mul_ps(x[1], y[0]),
+                              _mm256_mul_ps(y[1], x[0]));
+    // inside when the three edge functions agree in sign; NaN slots fail
+    // every ordered comparison
+    __m256 pos = _mm256_and_ps(
+        _mm256_and_ps(_mm256_cmp_ps(e0, zero, _CMP_GE_OQ),
+                      _mm256_cmp_ps(e1, zero, _CMP_GE_OQ)),
+        _mm256_cmp_ps(e2, zero, _CMP_GE_OQ));
+    __m256 neg = _mm256_and_ps(
+        _mm256_and_ps(_mm256_cmp_ps(e0, zero, _CMP_LE_OQ),
+                      _mm256_cmp_ps(e1, zero, _CMP_LE_OQ)),
+        _mm256_cmp_ps(e2, zero, _CMP_LE_OQ));
+    __m256 det = _mm256_add_ps(_mm256_add_ps(e0, e1), e2);
+    __m256 T = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e0, z[0]),
+                                           _mm256_mul_ps(e1, z[1])),
+                             _mm256_mul_ps(e2, z[2]));
+    // t_min < T / det < t_max without dividing, by moving the sign of det
+    // onto T
+    __m256 sign = _mm256_and_ps(det, sign_mask);
+    __m256 abs_det = _mm256_xor_ps(det, sign);
+    __m256 signed_T = _mm256_xor_ps(T, sign);
+    __m256 valid = _mm256_and_ps(_mm256_or_ps(pos, neg),
+                                 _mm256_cmp_ps(det, zero, _CMP_NEQ_OQ));
+    valid = _mm256_and_ps(
+        valid, _mm256_cmp_ps(signed_T,
+                             _mm256_mul_ps(_mm256_set1_ps(lower), abs_det),
+                             _CMP_GT_OQ));
+    valid = _mm256_and_ps(
+        valid,
+        _mm256_cmp_ps(signed_T,
+                      _mm256_mul_ps(_mm256_set1_ps(ray_triangle_upper(*t_max)),
+                                    abs_det),
+                      _CMP_LT_OQ));
+    int mask = _mm256_movemask_ps(valid) & lanes;
+    if (!mask)
+      continue;
+    alignas(32) float Ts[8], e1s[8], e2s[8], dets[8];
+    _mm256_store_ps(Ts, T);
+    _mm256_store_ps(e1s, e1);
+    _mm256_store_ps(e2s, e2);
+    _mm256_store_ps(dets, det);
+    best = ray_triangle_pick<8>(mask, base, Ts, e1s, e2s, dets, t_min, t_max,
+                                u, v, best);
+  }
+  return best;
+}
+#endif
+
+#ifdef RAY_TRIANGLE_SSE
+/**
+ * Nearest hit among consecutive triangle slots, four slots at a time.
+ * Same arguments and result as ray_triangle_nearest. Works on blocks of
+ * eight lanes as well, as a half block at a time.
+ */
+inline long ray_triangle_nearest4(const RayTriangleSoA& tris, size_t first,
+                                  size_t count, const RayTriangleData& r,
+                                  float t_min, float* t_max, float* u,
+                                  float* v) {
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 sign_mask = _mm_set1_ps(-0.0f);
+  const __m128 sx = _mm_set1_ps(r.shear[0]);
+  const __m128 sy = _mm_set1_ps(r.shear[1]);
+  const __m128 sz = _mm_set1_ps(r.shear[2]);
+  const __m128 ox = _mm_set1_ps(r.o[r.kx]);
+  const __m128 oy = _mm_set1_ps(r.o[r.ky]);
+  const __m128 oz = _mm_set1_ps(r.o[r.kz]);
+  const float lower = ray_triangle_lower(t_min);
+  long best = -1;
+  size_t end = first + count;
+  for (size_t g = first / 4; g * 4 < end; g++) {
+    size_t base = g * 4;
+    const RayTriangleSoA::Block& block = tris.blocks[base / ray_triangle_width];
+    size_t lane = base % ray_triangle_width;
+    // lanes of the group inside [first, end)
+    int lanes = (1 << std::min<size_t>(end - base, 4)) - 1;
+    if (first > base)
+      lanes &= ~((1 << (first - base)) - 1);
+    __m128 x[3], y[3], z[3];
+    for (int k = 0; k < 3; k++) {
+      __m128 px = _mm_sub_ps(_mm_load_ps(&block.v[k][r.kx][lane]), ox);
+      __m128 py = _mm_sub_ps(_mm_load_ps(&block.v[k][r.ky][lane]), oy);
+      __m128 pz = _mm_sub_ps(_mm_load_ps(&block.v[k][r.kz][lane]), oz);
+      x[k] = _mm_sub_ps(px, _mm_mul_ps(sx, pz));
+      y[k] = _mm_sub_ps(py, _mm_mul_ps(sy, pz));
+      z[k] = _mm_mul_ps(sz, pz);
+    }
+    __m128 e0 = _mm_sub_ps(_mm_mul_ps(x[2], y[1]), _mm_mul_ps(y[2], x[1]));
+    __m128 e1 = _mm_sub_ps(_mm_mul_ps(x[0], y[2]), _mm_mul_ps(y[0], x[2]));
+    __m128 e2 = _mm_sub_ps(_mm_mul_ps(x[1], y[0]), _mm_mul_ps(y[1], x[0]));
+    __m128 pos = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(e0, zero),
+                                       _mm_cmpge_ps(e1, zero)),
+                            _mm_cmpge_ps(e2, zero));
+    __m128 neg = _mm_and_ps(_mm_and_ps(_mm_cmple_ps(e0, zero),
+                                       _mm_cmple_ps(e1, zero)),
+                            _mm_cmple_ps(e2, zero));
+    __m128 det = _mm_add_ps(_mm_add_ps(e0, e1), e2);
+    __m128 T = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e0, z[0]),
+                                     _mm_mul_ps(e1, z[1])),
+                          _mm_mul_ps(e2, z[2]));
+    __m128 sign = _mm_and_ps(det, sign_mask);
+    __m128 abs_det = _mm_xor_ps(det, sign);
+    __m128 signed_T = _mm_xor_ps(T, sign);
+    // cmpneq is true for NaN, so NaN slots are dropped by the others
+    __m128 valid = _mm_and_ps(_mm_or_ps(pos, neg), _mm_cmpneq_ps(det, zero));
+    valid = _mm_and_ps(valid, _mm_cmpgt_ps(signed_T, _mm_mul_ps(
+                                  _mm_set1_ps(lower), abs_det)));
+    valid = _mm_and_ps(valid, _mm_cmplt_ps(signed_T, _mm_mul_ps(
+                                  _mm_set1_ps(ray_triangle_upper(*t_max)),
+                                  abs_det)));
+    int mask = _mm_movemask_ps(valid) & lanes;
+    if (!mask)
+      continue;
+    alignas(16) float Ts[4], e1s[4], e2s[4], dets[4];
+    _mm_store_ps(Ts, T);
+    _mm_store_ps(e1s, e1);
+    _mm_store_ps(e2s, e2);
+    _mm_store_ps(dets, det);
+    best = ray_triangle_pick<4>(mask, base, Ts, e1s, e2s, dets, t_min, t_max,
+                                u, v, best);
+  }
+  return best;
+}
+#endif
+
+/**
+ * Nearest hit among consecutive triangle slots.
+ * Tests eight slots at once with AVX, four with SSE and one at a time
+ * otherwise, and in double precision builds. Ties go to the lower slot.
+ * \param tris the triangles
+ * \param first first slot to test
+ * \param count number of slots to test
+ * \param r per-ray data of the ray to test
+ * \param t_min start of the ray segment
+ * \param t_max end of the ray segment, shortened to the nearest hit
+ * \param u receives the barycentric weight of the second vertex
+ * \param v receives the barycentric weight of the third vertex
+ * \return the slot hit, or -1 if none is hit inside (t_min, t_max)
+ */
+inline long ray_triangle_nearest(const RayTriangleSoA& tris, size_t first,
+                                 size_t count, const RayTriangleData& r,
+                                 Real t_min, Real* t_max, Real* u,
+                                 Real* v) {
+#if defined(RAY_TRIANGLE_AVX)
+  return ray_triangle_nearest8(tris, first, count, r, t_min, t_max, u, v);
+#elif defined(RAY_TRIANGLE_SSE)
+  return ray_triangle_nearest4(tris, first, count, r, t_min, t_max, u, v);
+#else
+  long best = -1;
+  for (size_t i = first; i < first + count; i++) {
+    if (ray_triangle_intersect(tris, i, r, t_min, *t_max, t_max, u, v))
+      best = i;
+  }
+  return best;
+#endif
+}
+
+} // namespace CGL
+
+#endif // CGL_RAY_TRIANGLE_H
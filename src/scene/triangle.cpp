@@ -11,26 +11,49 @@
 namespace CGL {
 namespace SceneObjects {
 
-Triangle::Triangle(const Mesh *mesh, size_t v1, size_t v2, size_t v3) {
-  p1 = mesh->positions[v1];
-  p2 = mesh->positions[v2];
-  p3 = mesh->positions[v3];
-  n1 = mesh->normals[v1];
-  n2 = mesh->normals[v2];
-  n3 = mesh->normals[v3];
-  bbox = BBox(p1);
-  bbox.expand(p2);
-  bbox.expand(p3);
+TriangleStore::TriangleStore(const Vector3D *positions,
+                             const Vector3D *normals, size_t num_vertices,
+                             const std::vector<uint32_t> &indices, BSDF *bsdf)
+    : px(num_vertices), py(num_vertices), pz(num_vertices),
+      nx(num_vertices), ny(num_vertices), nz(num_vertices),
+      indices(indices), bsdf(bsdf) {
+  update_vertices(positions, normals);
+  size_t num_triangles = indices.size() / 3;
+  triangles.reserve(num_triangles);
+  for (size_t i = 0; i < num_triangles; i++)
+    triangles.emplace_back(this, (uint32_t)i);
+}
+
+void TriangleStore::update_vertices(const Vector3D *positions,
+                                    const Vector3D *normals) {
+  for (size_t i = 0; i < px.size(); i++) {
+    px[i] = positions[i].x;
+    py[i] = positions[i].y;
+    pz[i] = positions[i].z;
+    nx[i] = normals[i].x;
+    ny[i] = normals[i].y;
+    nz[i] = normals[i].z;
+  }
+}
 
-  bsdf = mesh->get_bsdf();
+size_t TriangleStore::memory_bytes() const {
+  return sizeof(*this) + px.capacity() * 6 * sizeof(Real) +
+         indices.capacity() * sizeof(uint32_t) +
+         triangles.capacity() * sizeof(Triangle);
 }
 
-BBox Triangle::get_bbox() const { return bbox; }
+BBox Triangle::get_bbox() const {
+  BBox bbox(vertex(0));
+  bbox.expand(vertex(1));
+  bbox.expand(vertex(2));
+  return bbox;
+}
 
 static std::array<double, 4> Moller_Trumbore(const Ray &r, const Triangle &tri) {
-  auto E1 = tri.p2 - tri.p1;
-  auto E2 = tri.p3 - tri.p1;
-  auto S = r.o - tri.p1;
+  Vector3D p1 = tri.vertex(0), p2 = tri.vertex(1), p3 = tri.vertex(2);
+  auto E1 = p2 - p1;
+  auto E2 = p3 - p1;
+  auto S = r.o - p1;
   auto S1 = cross(r.d, E2);
   auto S2 = cross(S, E1);
   auto tmp = dot(S1, E1);
@@ -65,7 +88,7 @@ bool Triangle::intersect(const Ray &r, Intersection *isect) const {
     return false;
   r.max_t = t; // max_t is mutable and we can modify it
   isect->t = t;
-  isect->n = (b0 * n1 + b1 * n2 + b2 * n3).unit();
+  isect->n = (b0 * normal(0) + b1 * normal(1) + b2 * normal(2)).unit();
   isect->primitive = this;
   isect->bsdf = get_bsdf();
 
@@ -77,18 +100,20 @@ bool Triangle::intersect(const Ray &r, Intersection *isect) const {
 void Triangle::draw(const Color &c, float alpha) const {
   glColor4f(c.r, c.g, c.b, alpha);
   glBegin(GL_TRIANGLES);
-  glVertex3d(p1.x, p1.y, p1.z);
-  glVertex3d(p2.x, p2.y, p2.z);
-  glVertex3d(p3.x, p3.y, p3.z);
+  for (int k = 0; k < 3; k++) {
+    Vector3D p = vertex(k);
+    glVertex3d(p.x, p.y, p.z);
+  }
   glEnd();
 }
 
 void Triangle::drawOutline(const Color &c, float alpha) const {
   glColor4f(c.r, c.g, c.b, alpha);
   glBegin(GL_LINE_LOOP);
-  glVertex3d(p1.x, p1.y, p1.z);
-  glVertex3d(p2.x, p2.y, p2.z);
-  glVertex3d(p3.x, p3.y, p3.z);
+  for (int k = 0; k < 3; k++) {
+    Vector3D p = vertex(k);
+    glVertex3d(p.x, p.y, p.z);
+  }
   glEnd();
 }
 
@@ -3,30 +3,32 @@
 
 #include "object.h"
 #include "primitive.h"
+#include "util/real.h"
+
+#include <cstdint>
+#include <vector>
 
 namespace CGL { namespace SceneObjects {
 
+class TriangleStore;
+
 /**
  * A single triangle from a mesh.
- * To save space, it holds a pointer back to the data in the original mesh
- * rather than holding the data itself. This means that its lifetime is tied
- * to that of the original mesh. The primitive may refer back to the mesh
- * object for other information such as normal, texcoord, material.
+ * To save space, it only refers to its triangle in the TriangleStore of the
+ * original mesh rather than holding the data itself. This means that its
+ * lifetime is tied to that of the original mesh. The store holds the vertex
+ * positions, normals and material of the triangle.
  */
 class Triangle : public Primitive {
 public:
 
   /**
    * Constructor.
-   * Construct a mesh triangle with the given indicies into the triangle mesh.
-   * \param mesh pointer to the mesh the triangle is in
-   * \param v1 index of triangle vertex in the mesh's attribute arrays
-   * \param v2 index of triangle vertex in the mesh's attribute arrays
-   * \param v3 index of triangle vertex in the mesh's attribute arrays
+   * Construct a view of a triangle in a triangle store.
+   * \param store the store holding the triangle
+   * \param id index of the triangle in the store
    */
-  Triangle(const Mesh* mesh, size_t v1, size_t v2, size_t v3);
-
-  Triangle() {};
+  Triangle(const TriangleStore* store, uint32_t id) : store(store), id(id) {}
 
   /**
    * Get the world space bounding box of the triangle.
@@ -61,7 +63,7 @@ public:
    * In the case of a triangle, the surface material BSDF is stored in 
    * the mesh it belongs to. 
    */
-  BSDF* get_bsdf() const { return bsdf; }
+  BSDF* get_bsdf() const;
 
   /**
    * Draw with OpenGL (for visualizer)
@@ -73,14 +75,95 @@ public:
    */
   void drawOutline(const Color& c, float alpha) const;
 
-  Vector3D p1, p2, p3;
-  Vector3D n1, n2, n3;
-  
-  BSDF* bsdf;
+  /**
+   * Get a vertex position of the triangle.
+   * \param k vertex of the triangle, 0 to 2
+   * \return world space position of the vertex
+   */
+  Vector3D vertex(int k) const;
 
-  BBox bbox;
+  /**
+   * Get a vertex normal of the triangle.
+   * \param k vertex of the triangle, 0 to 2
+   * \return normal at the vertex
+   */
+  Vector3D normal(int k) const;
+
+  /**
+   * Interpolate the vertex normals at a point of the triangle.
+   * \param u barycentric weight of the second vertex
+   * \param v barycentric weight of the third vertex
+   * \return unit shading normal at the point
+   */
+  Vector3D shading_normal(double u, double v) const {
+    return ((1 - u - v) * normal(0) + u * normal(1) + v * normal(2)).unit();
+  }
+
+  const TriangleStore* store;  ///< store holding the triangle data
+  uint32_t id;                 ///< index of the triangle in the store
 }; // class Triangle
 
+/**
+ * The triangles of one mesh in structure-of-arrays form.
+ * Vertex positions and normals are kept once per vertex as Real, one array
+ * per coordinate, and are shared by the triangles through 32-bit indices.
+ * The material is kept once for the whole mesh. The Triangle primitives
+ * handed to the BVH live in one array in the store, so triangle ids that
+ * are close are also close in memory.
+ */
+class TriangleStore {
+public:
+
+  /**
+   * Constructor.
+   * \param positions vertex positions
+   * \param normals vertex normals
+   * \param num_vertices length of the vertex arrays
+   * \param indices three vertex indices per triangle
+   * \param bsdf surface material of all the triangles
+   */
+  TriangleStore(const Vector3D* positions, const Vector3D* normals,
+                size_t num_vertices, const std::vector<uint32_t>& indices,
+                BSDF* bsdf);
+
+  /**
+   * Replace the vertex positions and normals, keeping the triangles.
+   * \param positions new vertex positions, as many as before
+   * \param normals new vertex normals, as many as before
+   */
+  void update_vertices(const Vector3D* positions, const Vector3D* normals);
+
+  /**
+   * Get the number of triangles in the store.
+   */
+  size_t size() const { return triangles.size(); }
+
+  /**
+   * Get the memory held by the store, including its Triangle primitives.
+   * \return size of the store in bytes
+   */
+  size_t memory_bytes() const;
+
+  std::vector<Real> px, py, pz;   ///< vertex positions
+  std::vector<Real> nx, ny, nz;   ///< vertex normals
+  std::vector<uint32_t> indices;  ///< three vertex indices per triangle
+  BSDF* bsdf;                     ///< surface material of the mesh
+
+  std::vector<Triangle> triangles;  ///< primitives, one per triangle
+}; // class TriangleStore
+
+inline Vector3D Triangle::vertex(int k) const {
+  uint32_t v = store->indices[3 * id + k];
+  return Vector3D(store->px[v], store->py[v], store->pz[v]);
+}
+
+inline Vector3D Triangle::normal(int k) const {
+  uint32_t v = store->indices[3 * id + k];
+  return Vector3D(store->nx[v], store->ny[v], store->nz[v]);
+}
+
+inline BSDF* Triangle::get_bsdf() const { return store->bsdf; }
+
 } // namespace SceneObjects
 } // namespace CGL
 
@@ -3,6 +3,7 @@
 
 #include "CGL/color.h"
 #include "CGL/vector3D.h"
+#include "util/real.h"
 
 #include <vector>
 #include <string.h>
@@ -99,7 +100,7 @@ struct HDRImageBuffer {
    * \param w width of the image
    * \param h height of the image
    */
-  HDRImageBuffer(size_t w, size_t h) : w(w), h(h) { data.resize(w * h); }
+  HDRImageBuffer(size_t w, size_t h) : w(w), h(h) { data.resize(3 * w * h); }
 
   /**
    * Resize the image buffer.
@@ -109,10 +110,18 @@ struct HDRImageBuffer {
   void resize(size_t w, size_t h) {
     this->w = w;
     this->h = h;
-    data.resize(w * h);
+    data.resize(3 * w * h);
     clear();
   }
 
+  /**
+   * Get the color of a pixel.
+   * \param i index of the pixel, x + y * w
+   */
+  Vector3D pixel(size_t i) const {
+    return Vector3D(data[3 * i], data[3 * i + 1], data[3 * i + 2]);
+  }
+
   /**
    * Update the color of a given pixel.
    * \param s new Vector3D value to be set
@@ -122,7 +131,10 @@ struct HDRImageBuffer {
   void update_pixel(const Vector3D& s, size_t x, size_t y) {
     // assert(0 <= x && x < w);
     // assert(0 <= y && y < h);
-    data[x + y * w] = s;
+    Real* p = &data[3 * (x + y * w)];
+    p[0] = s.x;
+    p[1] = s.y;
+    p[2] = s.z;
   }
 
   /**
@@ -137,7 +149,10 @@ struct HDRImageBuffer {
   void update_pixel(const Vector3D& s, size_t x, size_t y, float r) {
     // assert(0 <= x && x < w);
     // assert(0 <= y && y < h);
-    data[x + y * w] = s * r + (1 - r) * data[x + y * w];
+    Real* p = &data[3 * (x + y * w)];
+    p[0] = s.x * r + (1 - r) * p[0];
+    p[1] = s.y * r + (1 - r) * p[1];
+    p[2] = s.z * r + (1 - r) * p[2];
   }
 
   /**
@@ -155,7 +170,7 @@ struct HDRImageBuffer {
     float avg = 0;
     for (size_t i = 0; i < w * h; ++i) {
       // the small delta value below is used to avoids singularity
-      avg += log(0.0000001f + data[i].illum());
+      avg += log(0.0000001f + pixel(i).illum());
     }
     avg = exp(avg / (w * h));
 
@@ -165,7 +180,7 @@ struct HDRImageBuffer {
     float exposure = sqrt(pow(2,level));
     for (size_t y = 0; y < h; ++y) {
       for (size_t x = 0; x < w; ++x) {
-        Vector3D s = data[x + y * w];
+        Vector3D s = pixel(x + y * w);
         float l = s.illum();
         s *= key / avg;
         s *= ((l + 1) / (wht * wht)) / (l + 1);
@@ -188,7 +203,7 @@ struct HDRImageBuffer {
     float exposure = sqrt(pow(2,level));
     for (size_t y = y0; y < y1; ++y) {
       for (size_t x = x0; x < x1; ++x) {
-        const Vector3D& s = data[x + y * w];
+        Vector3D s = pixel(x + y * w);
         float r = std::max(0.0, std::min(pow(s.r * exposure, one_over_gamma), 1.0));
         float g = std::max(0.0, std::min(pow(s.g * exposure, one_over_gamma), 1.0));
         float b = std::max(0.0, std::min(pow(s.b * exposure, one_over_gamma), 1.0));
@@ -207,12 +222,12 @@ struct HDRImageBuffer {
    */
   void clear() {
     data.clear();
-    data.resize(w * h, Vector3D(0.0));
+    data.resize(3 * w * h, 0);
   }
 
   size_t w; ///< width
   size_t h; ///< height
-  std::vector<Vector3D> data; ///< pixel buffer
+  std::vector<Real> data; ///< pixel buffer, r g b per pixel
 
 }; // class HDRImageBuffer
 
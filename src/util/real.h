@@ -0,0 +1,23 @@
+#ifndef CGL_REAL_H
+#define CGL_REAL_H
+
+namespace CGL {
+
+/**
+ * Scalar type of the stored triangle and sample data: the vertices and
+ * normals of the triangle store, the triangle blocks and per-ray data of
+ * the watertight kernel, and the HDR frame buffer. Float is the default, it
+ * doubles the SIMD width of the kernel and halves the memory of that data.
+ * Rays, bounding boxes and intersections are built on CGL's Vector3D and
+ * stay double either way. Configuring with BUILD_DOUBLE_PRECISION stores
+ * the data above in double, to validate the float results.
+ */
+#ifdef PT_DOUBLE_PRECISION
+typedef double Real;
+#else
+typedef float Real;
+#endif
+
+} // namespace CGL
+
+#endif // CGL_REAL_H